@@ -0,0 +1,28 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Per-thread bump allocator. stb_image/stb_image_write and the fill's
+// temporaries allocate from it; call arena_reset() between images so the
+// next one reuses the same (already faulted-in) pages instead of the heap.
+//
+// Memory cost: allocations under 256 KB are bumped out of 1 MB blocks, and
+// freeing one that is not the newest returns nothing until arena_reset().
+// Larger ones (image buffers, zlib streams) get their own chunk. Once
+// freed, the next large request reuses it or gives it back to the system,
+// so the peak is about what is live at once, as with malloc. Chunks still
+// live at a reset are kept for the next image and given back after one
+// image unused.
+void *arena_alloc(size_t size);
+void *arena_realloc(void *p, size_t new_size);
+void arena_free(void *p);
+
+// Rewinds the calling thread's arena. Everything allocated since the last
+// reset becomes invalid; the memory itself is kept for the next image.
+void arena_reset(void);
+
+// Gives the calling thread's memory back to the system (e.g. at thread exit).
+void arena_release(void);
+
+#endif
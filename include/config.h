@@ -6,10 +6,43 @@
 // Default: 80.0
 #define COLOR_THRESHOLD 80.0 
 
+// How the flood fill walks the background. 0 = a queue of pixels; 1 =
+// bit-parallel: 64 pixels per step, sweeping the whole image until nothing
+// changes (several times faster on noisy backgrounds, but slower where the
+// background winds around hair or a spiral); 2 = the same bitmaps stored in
+// 64x64 blocks and grown by a queue of 64-pixel words, so steps up and down
+// stay in cache on very wide images (close to 1 in practice: the sweeps
+// already read memory in order). Same background either way.
+#define FILL_ENGINE 0
+
+// Frames of a --raw video per full flood fill. The frames in between start
+// from the previous frame's background and only follow what moved; a pocket
+// the subject closes off (an arm on the hip) stays white until the next full
+// fill. 1 = a full fill every frame.
+#define MASK_REFRESH_FRAMES 15
+
 // --- OUTPUT SETTINGS ---
 // Quality of the saved JPG (1-100)
 #define JPEG_QUALITY 90
 
+// Encode with the integer DCT: ~20% faster and bit-exact on every build,
+// at a small PSNR cost (avoid it above quality 95). 0 = float DCT.
+#define JPEG_FIXED_POINT 0
+
+// Chroma resolution: 444 (full), 422 (half width) or 420 (half width and
+// height; about half the size of 444 for the same quality). 0 = 420 up to
+// quality 90, 444 above.
+#define JPEG_SUBSAMPLING 0
+
+// Deflate level for --png. 1-4 are the fast levels (greedy matching, "up"
+// filter): on photos 2 is about 6x faster than 8 at roughly the same size.
+// 5-9 use stb's slower lazy-matching search.
+#define PNG_COMPRESSION_LEVEL 2
+
+// Threads compressing a --png file, one band of rows each. 0 = one per CPU
+// core, 1 = a single stream.
+#define PNG_THREADS 0
+
 // The text added to the start of the new filename
 #define OUTPUT_PREFIX "white_"
 
@@ -19,5 +52,12 @@
 #define TARGET_R 255
 #define TARGET_G 255
 #define TARGET_B 255
+// Used for greyscale photos instead (BT.601 luma of the color above)
+#define TARGET_GRAY ((TARGET_R * 299 + TARGET_G * 587 + TARGET_B * 114 + 500) / 1000)
+
+// --- MEMORY SETTINGS ---
+// Back the decoded image with 2 MB huge pages when the OS supports it
+// (Linux transparent huge pages). 0 = plain malloc.
+#define USE_HUGE_PAGES 1
 
 #endif
\ No newline at end of file
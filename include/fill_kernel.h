@@ -0,0 +1,387 @@
+// Flood fill (from scratch, or on from the last video frame's mask), paint
+// and cutout kernels for one channel count. process.c includes
+// this once per count with CHANNELS defined; each copy has the pixel size
+// and channel offsets as constants, so neighbours are fixed pointer steps
+// rather than IDX() multiplies.
+//
+// 'limit' is what background_mask() derives from the threshold: the
+// smallest |dv| (grey) or squared RGB distance that is NOT background.
+
+#define KERNEL_NAME_(name, n) name##_##n
+#define KERNEL_NAME(name, n) KERNEL_NAME_(name, n)
+
+#if CHANNELS < 3
+#define IS_BACKGROUND(p) (abs((p)[0] - bg[0]) < limit)
+#else
+#define IS_BACKGROUND(p) (((p)[0] - bg[0]) * ((p)[0] - bg[0]) + \
+                          ((p)[1] - bg[1]) * ((p)[1] - bg[1]) + \
+                          ((p)[2] - bg[2]) * ((p)[2] - bg[2]) < limit)
+#endif
+
+// Min/max of each byte position down the rows of a full-width tile (byte j
+// is channel j % CHANNELS). Fixed trip counts, so the compiler turns the
+// inner loop into a few vector min/max instructions per row.
+static void KERNEL_NAME(tile_range, CHANNELS)(const unsigned char *p, size_t row, int rows,
+                                              unsigned char *lo, unsigned char *hi) {
+    memcpy(lo, p, FILL_TILE * CHANNELS);
+    memcpy(hi, p, FILL_TILE * CHANNELS);
+    for (int y = 1; y < rows; y++) {
+        const unsigned char *r = p + y * row;
+        for (int j = 0; j < FILL_TILE * CHANNELS; j++) {
+            lo[j] = r[j] < lo[j] ? r[j] : lo[j];
+            hi[j] = r[j] > hi[j] ? r[j] : hi[j];
+        }
+    }
+}
+
+// Sorts every tile into TILE_ALL (every pixel matches the background),
+// TILE_NONE (no pixel does) or TILE_MIXED. Each tile's channel minima and
+// maxima span a box of colors: if even the box corner farthest from the
+// background color is within the limit, so is every pixel; if even the
+// nearest point of the box is not, no pixel is. 'bg' is the background
+// color (the image's first pixel, when 'img' is a band of a bigger image).
+static void KERNEL_NAME(classify_tiles, CHANNELS)(const unsigned char *img, const unsigned char *bg, int width,
+                                                  int height, int limit, unsigned char *tiles) {
+    size_t row = (size_t)width * CHANNELS;
+    unsigned char lo[FILL_TILE * CHANNELS], hi[FILL_TILE * CHANNELS];
+
+    for (int y0 = 0; y0 < height; y0 += FILL_TILE) {
+        int rows = height - y0 < FILL_TILE ? height - y0 : FILL_TILE;
+        for (int x0 = 0; x0 < width; x0 += FILL_TILE) {
+            const unsigned char *p = img + y0 * row + (size_t)x0 * CHANNELS;
+            int n = (width - x0 < FILL_TILE ? width - x0 : FILL_TILE) * CHANNELS;
+            if (n == FILL_TILE * CHANNELS) {
+                KERNEL_NAME(tile_range, CHANNELS)(p, row, rows, lo, hi);
+            } else {
+                // Last tile of a row, cut short by the image edge
+                memcpy(lo, p, n);
+                memcpy(hi, p, n);
+                for (int y = 1; y < rows; y++) {
+                    for (int j = 0; j < n; j++) {
+                        unsigned char v = p[y * row + j];
+                        if (v < lo[j]) lo[j] = v;
+                        if (v > hi[j]) hi[j] = v;
+                    }
+                }
+            }
+
+            int far = 0, near = 0;
+            for (int c = 0; c < (CHANNELS < 3 ? 1 : 3); c++) {
+                int cmin = 255, cmax = 0;
+                for (int j = c; j < n; j += CHANNELS) {
+                    if (lo[j] < cmin) cmin = lo[j];
+                    if (hi[j] > cmax) cmax = hi[j];
+                }
+                int f = abs(cmin - bg[c]) > abs(cmax - bg[c]) ? abs(cmin - bg[c]) : abs(cmax - bg[c]);
+                int d = bg[c] < cmin ? cmin - bg[c] : bg[c] > cmax ? bg[c] - cmax : 0;
+#if CHANNELS < 3
+                far = f;
+                near = d;
+#else
+                far += f * f;
+                near += d * d;
+#endif
+            }
+            *tiles++ = far < limit ? TILE_ALL : near >= limit ? TILE_NONE : TILE_MIXED;
+        }
+    }
+}
+
+// Takes in the neighbour (nx, ny) if it is background: a TILE_ALL tile is
+// filled whole and queued in 'tq', a TILE_MIXED pixel is tested and queued
+// in 'q'. Nothing in a TILE_NONE tile is ever tested.
+#define VISIT(nx, ny, n, np)                                                              \
+    do {                                                                                  \
+        if (!visited[n]) {                                                                \
+            unsigned char *t = tiles + ((ny) / FILL_TILE) * columns + (nx) / FILL_TILE;  \
+            if (*t == TILE_ALL) {                                                         \
+                *t = TILE_FILLED;                                                         \
+                fill_tile(visited, width, height, (nx) / FILL_TILE, (ny) / FILL_TILE);    \
+                enqueue(tq, (nx) / FILL_TILE, (ny) / FILL_TILE);                          \
+            } else if (*t == TILE_MIXED && IS_BACKGROUND(np)) {                           \
+                visited[n] = 1;                                                           \
+                enqueue(q, nx, ny);                                                       \
+            }                                                                             \
+        }                                                                                 \
+    } while (0)
+
+// VISIT() for a neighbour in the pixel's own tile, whose state is known
+#define TEST(nx, ny, n, np)                     \
+    do {                                        \
+        if (!visited[n] && IS_BACKGROUND(np)) { \
+            visited[n] = 1;                     \
+            enqueue(q, nx, ny);                 \
+        }                                       \
+    } while (0)
+
+// Spreads the background out from the pixels in 'q' and the filled tiles in
+// 'tq' (all already marked in 'visited')
+static void KERNEL_NAME(grow_mask, CHANNELS)(const unsigned char *img, unsigned char *visited,
+                                             int width, int height, int limit, unsigned char *tiles,
+                                             Queue *q, Queue *tq) {
+    const unsigned char *bg = img;
+    size_t row = (size_t)width * CHANNELS;
+    int columns = (width + FILL_TILE - 1) / FILL_TILE;
+
+    for (;;) {
+        while (!isQueueEmpty(q)) {
+            Point current = dequeue(q);
+            int cx = current.x;
+            int cy = current.y;
+            size_t i = (size_t)cy * width + cx;
+            const unsigned char *p = img + i * CHANNELS;
+
+            // Up, down, left, right. A neighbour in the same tile is in a
+            // TILE_MIXED tile like this pixel (or in one where the test finds
+            // nothing new), so only steps into the next tile look up its state.
+            if (cy > 0) {
+                if (cy & (FILL_TILE - 1)) TEST(cx, cy - 1, i - width, p - row);
+                else VISIT(cx, cy - 1, i - width, p - row);
+            }
+            if (cy < height - 1) {
+                if ((cy + 1) & (FILL_TILE - 1)) TEST(cx, cy + 1, i + width, p + row);
+                else VISIT(cx, cy + 1, i + width, p + row);
+            }
+            if (cx > 0) {
+                if (cx & (FILL_TILE - 1)) TEST(cx - 1, cy, i - 1, p - CHANNELS);
+                else VISIT(cx - 1, cy, i - 1, p - CHANNELS);
+            }
+            if (cx < width - 1) {
+                if ((cx + 1) & (FILL_TILE - 1)) TEST(cx + 1, cy, i + 1, p + CHANNELS);
+                else VISIT(cx + 1, cy, i + 1, p + CHANNELS);
+            }
+        }
+        if (isQueueEmpty(tq)) break;
+
+        // A filled tile: everything just outside its four edges
+        Point t = dequeue(tq);
+        int x0 = t.x * FILL_TILE, y0 = t.y * FILL_TILE;
+        int x1 = x0 + FILL_TILE < width ? x0 + FILL_TILE : width;
+        int y1 = y0 + FILL_TILE < height ? y0 + FILL_TILE : height;
+        for (int x = x0; x < x1; x++) {
+            if (y0 > 0) VISIT(x, y0 - 1, (size_t)(y0 - 1) * width + x, img + ((y0 - 1) * row + x * CHANNELS));
+            if (y1 < height) VISIT(x, y1, (size_t)y1 * width + x, img + (y1 * row + x * CHANNELS));
+        }
+        for (int y = y0; y < y1; y++) {
+            if (x0 > 0) VISIT(x0 - 1, y, (size_t)y * width + x0 - 1, img + (y * row + (x0 - 1) * CHANNELS));
+            if (x1 < width) VISIT(x1, y, (size_t)y * width + x1, img + (y * row + x1 * CHANNELS));
+        }
+    }
+}
+#undef TEST
+#undef VISIT
+
+// Starts the fill at the top-left pixel, which is background by definition
+static void KERNEL_NAME(seed_mask, CHANNELS)(unsigned char *visited, int width, int height,
+                                             unsigned char *tiles, Queue *q, Queue *tq) {
+    if (tiles[0] == TILE_ALL) {
+        tiles[0] = TILE_FILLED;
+        fill_tile(visited, width, height, 0, 0);
+        enqueue(tq, 0, 0);
+    } else if (!visited[0]) {
+        visited[0] = 1;
+        enqueue(q, 0, 0);
+    }
+}
+
+static void KERNEL_NAME(fill_mask, CHANNELS)(const unsigned char *img, unsigned char *visited,
+                                             int width, int height, int limit, unsigned char *tiles) {
+    const unsigned char *bg = img;
+    KERNEL_NAME(classify_tiles, CHANNELS)(img, bg, width, height, limit, tiles);
+    Queue* q = createQueue();
+    Queue* tq = createQueue();
+    KERNEL_NAME(seed_mask, CHANNELS)(visited, width, height, tiles, q, tq);
+    KERNEL_NAME(grow_mask, CHANNELS)(img, visited, width, height, limit, tiles, q, tq);
+    freeQueue(tq);
+    freeQueue(q);
+}
+
+// Candidate bitmap for the bit-parallel engines: bit x % 64 of word
+// bit_word(x / 64, y) is set when pixel (x, y) matches the background ('bits'
+// comes in zeroed). Whole tiles are written at once from the tile map; only
+// TILE_MIXED pixels are tested. 'bg' as for classify_tiles().
+static void KERNEL_NAME(candidate_bits, CHANNELS)(const unsigned char *img, const unsigned char *bg, int width,
+                                                  int height, int limit, unsigned char *tiles, uint64_t *bits,
+                                                  size_t words, int tiled) {
+    size_t row = (size_t)width * CHANNELS;
+    size_t step = tiled ? 1 : words;
+    KERNEL_NAME(classify_tiles, CHANNELS)(img, bg, width, height, limit, tiles);
+
+    const unsigned char *t = tiles;
+    for (int y0 = 0; y0 < height; y0 += FILL_TILE) {
+        int y1 = y0 + FILL_TILE < height ? y0 + FILL_TILE : height;
+        for (int x0 = 0; x0 < width; x0 += FILL_TILE, t++) {
+            int n = width - x0 < FILL_TILE ? width - x0 : FILL_TILE;
+            uint64_t *b = bits + bit_word(words, x0 / 64, y0, tiled);
+            int shift = x0 % 64;
+            if (*t == TILE_ALL) {
+                uint64_t run = (((uint64_t)1 << n) - 1) << shift;
+                for (int y = y0; y < y1; y++, b += step) *b |= run;
+            } else if (*t == TILE_MIXED) {
+                const unsigned char *p = img + y0 * row + (size_t)x0 * CHANNELS;
+                for (int y = y0; y < y1; y++, b += step, p += row) {
+                    uint64_t run = 0;
+                    if (n == FILL_TILE) {
+                        // A byte per pixel over a fixed trip count (vector
+                        // compares), then packed eight bytes to eight bits
+                        // by one multiply: byte i lands in bit 56 + i
+                        unsigned char is[FILL_TILE];
+                        for (int x = 0; x < FILL_TILE; x++) is[x] = IS_BACKGROUND(p + x * CHANNELS);
+                        for (int x = 0; x < FILL_TILE; x += 8) {
+                            uint64_t v;
+                            memcpy(&v, is + x, 8);
+                            run |= (v * 0x0102040810204080ull) >> 56 << x;
+                        }
+                    } else {
+                        for (int x = 0; x < n; x++) run |= (uint64_t)IS_BACKGROUND(p + x * CHANNELS) << x;
+                    }
+                    *b |= run << shift;
+                }
+            }
+        }
+    }
+}
+
+// Next video frame: 'visited' comes in as the last frame's mask. Pixels that
+// no longer match the background are dropped, and the fill resumes from the
+// edge of what is left, so only newly uncovered background is traversed.
+static void KERNEL_NAME(track_mask, CHANNELS)(const unsigned char *img, unsigned char *visited,
+                                              int width, int height, int limit, unsigned char *tiles) {
+    const unsigned char *bg = img;
+    size_t row = (size_t)width * CHANNELS;
+    KERNEL_NAME(classify_tiles, CHANNELS)(img, bg, width, height, limit, tiles);
+
+    // Drop what no longer matches, a tile at a time where the tile decides
+    // it. A TILE_ALL tile is in one piece: all of it stays if any of it was
+    // kept.
+    unsigned char *t = tiles;
+    for (int y0 = 0; y0 < height; y0 += FILL_TILE) {
+        int y1 = y0 + FILL_TILE < height ? y0 + FILL_TILE : height;
+        for (int x0 = 0; x0 < width; x0 += FILL_TILE, t++) {
+            int n = width - x0 < FILL_TILE ? width - x0 : FILL_TILE;
+            unsigned char *v = visited + (size_t)y0 * width + x0;
+            if (*t == TILE_NONE) {
+                for (int y = y0; y < y1; y++, v += width) memset(v, 0, n);
+            } else if (*t == TILE_ALL) {
+                int any = 0;
+                for (int y = y0; y < y1 && !any; y++, v += width) any = memchr(v, 1, n) != NULL;
+                if (any) {
+                    *t = TILE_FILLED;
+                    fill_tile(visited, width, height, x0 / FILL_TILE, y0 / FILL_TILE);
+                }
+            } else {
+                const unsigned char *p = img + y0 * row + (size_t)x0 * CHANNELS;
+                for (int y = y0; y < y1; y++, v += width, p += row) {
+                    for (int x = 0; x < n; x++) v[x] &= IS_BACKGROUND(p + x * CHANNELS);
+                }
+            }
+        }
+    }
+
+    Queue* q = createQueue();
+    Queue* tq = createQueue();
+    KERNEL_NAME(seed_mask, CHANNELS)(visited, width, height, tiles, q, tq);
+
+    // Restart from every kept pixel with a neighbour outside the mask. Eight
+    // pixels at a time are skipped when none of them is kept, or when they
+    // and all their neighbours are. Rows off the image count as kept.
+    const uint64_t all = 0x0101010101010101ull;
+    for (int y = 0; y < height; y++) {
+        const unsigned char *v = visited + (size_t)y * width;
+        const unsigned char *up = y > 0 ? v - width : v;
+        const unsigned char *down = y < height - 1 ? v + width : v;
+        for (int x = 0; x < width; x++) {
+            if ((x & 7) == 0 && x + 8 <= width) {
+                uint64_t here, above, below;
+                memcpy(&here, v + x, 8);
+                memcpy(&above, up + x, 8);
+                memcpy(&below, down + x, 8);
+                if (here == 0 || (here == all && above == all && below == all &&
+                                  (x == 0 || v[x - 1]) && (x + 8 == width || v[x + 8]))) {
+                    x += 7;
+                    continue;
+                }
+            }
+            if (v[x] && ((x > 0 && !v[x - 1]) || (x < width - 1 && !v[x + 1]) || !up[x] || !down[x]))
+                enqueue(q, x, y);
+        }
+    }
+    KERNEL_NAME(grow_mask, CHANNELS)(img, visited, width, height, limit, tiles, q, tq);
+    freeQueue(tq);
+    freeQueue(q);
+}
+
+// Paints the background from the finished mask a run at a time: the mask is
+// skimmed eight bytes per step for where runs of 1s start and end, and a
+// long run is one fill_pattern() (wide, or with 'stream' non-temporal,
+// stores) instead of a store per channel per pixel.
+static void KERNEL_NAME(paint, CHANNELS)(unsigned char *img, const unsigned char *mask, size_t count,
+                                         int stream) {
+#if CHANNELS < 3
+    const unsigned char px[] = {TARGET_GRAY, 255};
+#else
+    const unsigned char px[] = {TARGET_R, TARGET_G, TARGET_B, 255};  // opaque
+#endif
+    const uint64_t all = 0x0101010101010101ull;
+    size_t i = 0;
+    while (i < count) {
+        uint64_t w;
+        while (i + 8 <= count && (memcpy(&w, mask + i, 8), w == 0)) i += 8;
+        while (i < count && !mask[i]) i++;
+        size_t j = i;
+        while (j + 8 <= count && (memcpy(&w, mask + j, 8), w == all)) j += 8;
+        while (j < count && mask[j]) j++;
+
+        unsigned char *p = img + i * CHANNELS;
+        if (j - i >= PAINT_RUN) {
+            fill_pattern(p, (j - i) * CHANNELS, px, CHANNELS, stream);
+        } else {
+            for (size_t n = i; n < j; n++, p += CHANNELS) memcpy(p, px, CHANNELS);
+        }
+        i = j;
+    }
+}
+
+// paint() for PNG output: 'out' gets an alpha channel (grey+alpha or RGBA)
+// that is 0 on the background. The hidden background pixels still get the
+// target color, so they compress to long runs. 'out' may be 'img' when the
+// image already has alpha.
+#if CHANNELS < 3
+#define OUT_CHANNELS 2
+#else
+#define OUT_CHANNELS 4
+#endif
+static void KERNEL_NAME(cutout, CHANNELS)(const unsigned char *img, const unsigned char *mask, size_t count,
+                                          unsigned char *out) {
+    const unsigned char *p = img;
+    unsigned char *q = out;
+    for (size_t i = 0; i < count; i++, p += CHANNELS, q += OUT_CHANNELS) {
+        if (mask[i]) {
+#if CHANNELS < 3
+            q[0] = TARGET_GRAY;
+#else
+            q[0] = TARGET_R;
+            q[1] = TARGET_G;
+            q[2] = TARGET_B;
+#endif
+            q[OUT_CHANNELS - 1] = 0;  // transparent
+            continue;
+        }
+        q[0] = p[0];
+#if CHANNELS >= 3
+        q[1] = p[1];
+        q[2] = p[2];
+#endif
+#if CHANNELS == OUT_CHANNELS
+        q[OUT_CHANNELS - 1] = p[CHANNELS - 1];
+#else
+        q[OUT_CHANNELS - 1] = 255;
+#endif
+    }
+}
+#undef OUT_CHANNELS
+
+#undef IS_BACKGROUND
+#undef KERNEL_NAME
+#undef KERNEL_NAME_
+#undef CHANNELS
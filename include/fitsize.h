@@ -0,0 +1,23 @@
+#ifndef FITSIZE_H
+#define FITSIZE_H
+
+#include <stddef.h>
+#include "stb_image_write.h"
+
+// Outcome of a --max-bytes search
+typedef struct {
+    stbi_write_jpg_cache *cache;  // DCT of the image, ready to write at 'quality'
+    int quality;
+    size_t bytes;                 // file size at that quality
+    int fits;                     // 0 when even quality 1 is over the limit
+} JpegFit;
+
+// Finds the highest quality <= max_quality whose JPEG is at most max_bytes.
+// The image is colour-converted and DCT'd once; every probe after that only
+// re-quantizes and entropy-codes the cached blocks. Write the result with
+// stbi_write_jpg_from_cache(path, fit->cache, fit->quality); the cache lives
+// in the arena. Returns 0 if the cache could not be built.
+int jpeg_fit(JpegFit *fit, const unsigned char *img, int width, int height, int channels,
+             int max_quality, size_t max_bytes);
+
+#endif
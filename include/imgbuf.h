@@ -0,0 +1,19 @@
+#ifndef IMGBUF_H
+#define IMGBUF_H
+
+#include <stddef.h>
+
+// Reusable pixel buffer the decoder writes into (stbi_load_*_into).
+// It only ever grows, so a batch of same-sized images decodes into the same
+// pages without touching the allocator.
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    int huge; // allocated with mmap for huge pages rather than malloc
+} ImageBuffer;
+
+// Makes sure the buffer holds at least 'size' bytes. Returns 0 when out of memory.
+int imgbuf_reserve(ImageBuffer *buf, size_t size);
+void imgbuf_free(ImageBuffer *buf);
+
+#endif
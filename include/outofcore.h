@@ -0,0 +1,24 @@
+#ifndef OUTOFCORE_H
+#define OUTOFCORE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "stb_image_write.h"
+
+// Background removal for images too big to hold in memory (gigapixel
+// stitches), raw PNM in and raw PNM out. The pixels are only ever in memory
+// a band of rows (about 'budget' bytes, at least 16 rows) at a time:
+//  1. a pass over the input sets a bit for every background-colored pixel,
+//  2. the fill runs over the whole image's bitmaps (2 bits per pixel, kept
+//     in scratch files mapped into memory, so the OS pages them out as it
+//     needs to), so what is background is decided globally, as in memory,
+//  3. a second pass over the input paints each band and writes it out.
+// 'in' is just past the header pnm_read_header() read. A file is read twice
+// in place; a pipe is copied to a scratch file on the first pass. Scratch
+// files go in $TMPDIR (default /tmp) and are gone when this returns. The
+// result goes out through 'func' (as with pnm_write_frame). Returns 0 on
+// failure: out of memory or scratch space, or the input is cut short.
+int remove_background_out_of_core(FILE *in, int width, int height, int channels, int maxval, double threshold,
+                                  size_t budget, stbi_write_func *func, void *context);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef PNGOUT_H
+#define PNGOUT_H
+
+#include "stb_image_write.h"
+
+// Writes an 8-bit image (1-4 channels) as PNG through 'func', with the
+// calling thread's stb write settings. With threads > 1 the rows are split
+// into that many bands, pigz-style: each band is filtered and deflated on
+// its own thread and the pieces are joined into one file. 0 = one thread
+// per CPU core. Returns 0 on failure.
+int save_png(stbi_write_func *func, void *context, int width, int height, int channels, const unsigned char *img,
+             int threads);
+
+#endif
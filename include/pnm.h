@@ -0,0 +1,40 @@
+#ifndef PNM_H
+#define PNM_H
+
+#include <stdio.h>
+#include "imgbuf.h"
+#include "stb_image_write.h"
+
+// Raw (binary) netpbm frames for pipelines: P5 grey, P6 RGB and P7 PAM with
+// 1-4 channels, 8 bits per sample. There is nothing to decode, so a frame
+// goes from the stream straight into the image buffer, and frames can be
+// sent back to back on one pipe. 16-bit frames (maxval above 255) are
+// read too, scaled down to 8 bits.
+
+// Reads the next frame into 'buf'. Returns 1 for a frame, 0 at the end of
+// the stream, -1 when the data is not a raw PNM frame or is cut short.
+int pnm_read_frame(FILE *f, ImageBuffer *buf, int *width, int *height, int *channels);
+
+// The two halves of pnm_read_frame() for images read a band at a time: the
+// header (same results; 'maxval' is what the samples are out of), then
+// 'size' samples (2 * size bytes when maxval > 255) scaled to 0-255. pnm_read_samples() returns 0
+// when the stream is cut short.
+int pnm_read_header(FILE *f, int *width, int *height, int *channels, int *maxval);
+int pnm_read_samples(FILE *f, unsigned char *data, size_t size, int maxval);
+
+// Headerless frames of a size given up front (ffmpeg -f rawvideo), e.g.
+// rgb24 for 3 channels. Same results as pnm_read_frame().
+int pnm_read_raw_frame(FILE *f, ImageBuffer *buf, int width, int height, int channels);
+
+// Writes one frame through an stb-style callback: P5 or P6 for 1 or 3
+// channels, P7 for 2 or 4. Returns 0 for any other channel count.
+int pnm_write_frame(stbi_write_func *func, void *context, const unsigned char *img, int width, int height,
+                    int channels);
+
+// Just the header of pnm_write_frame(), for writing the rows separately
+int pnm_write_header(stbi_write_func *func, void *context, int width, int height, int channels);
+
+// Extension matching what pnm_write_frame writes (".pgm", ".ppm" or ".pam")
+const char *pnm_extension(int channels);
+
+#endif
@@ -1,7 +1,52 @@
 #ifndef PROCESS_H
 #define PROCESS_H
 
+#include <stdint.h>
+
+// 1 = background for every pixel reachable from the top-left corner within
+// 'threshold' of its color. Arena memory (see arena.h).
+unsigned char *background_mask(const unsigned char *img, int width, int height, int channels, double threshold);
+
+// background_mask() for the frames of a video, into 'mask' (width*height
+// bytes that the caller keeps between frames). With 'reuse', 'mask' holds
+// the previous frame's result: pixels that stopped matching are dropped and
+// the fill only spreads into newly uncovered background, which is much less
+// work than a full fill when little moves. A pocket the subject closes off
+// stays background until the next full fill (reuse = 0). Returns 0 when out
+// of memory.
+int track_background(const unsigned char *img, int width, int height, int channels, double threshold,
+                     unsigned char *mask, int reuse);
+
+// The painting and cutout halves of remove_background()/cut_background(),
+// for a mask you already have
+void paint_background(unsigned char *img, const unsigned char *mask, int width, int height, int channels);
+void cutout_background(const unsigned char *img, const unsigned char *mask, int width, int height, int channels,
+                       unsigned char *out);
+
+// The fill for an image that is only ever in memory a band of rows at a
+// time (outofcore.h). The bitmaps have a bit per pixel, bit x % 64 of word
+// x / 64 of each row of (width + 63) / 64 words, and can be far bigger than
+// the bands: a fill over them only ever walks down and up whole rows.
+//  - background_bits_band(): sets the bits of the band's pixels within
+//    'threshold' of 'bg' (the image's first pixel) in 'bits' (the band's
+//    first row of a zeroed bitmap).
+//  - connect_background(): 'fill' (zeroed on entry) becomes the part of
+//    'cand' connected to the top-left pixel: background_mask() as bits.
+//  - paint_background_bits(): paint_background() for a band from the rows
+//    of 'fill' that cover it.
+// Each returns 0 when out of memory.
+int background_bits_band(const unsigned char *band, const unsigned char *bg, int width, int rows, int channels,
+                         double threshold, uint64_t *bits);
+int connect_background(uint64_t *cand, uint64_t *fill, int width, int height);
+int paint_background_bits(unsigned char *band, const uint64_t *fill, int width, int rows, int channels);
+
 // Updated: Now accepts 'double threshold' as the last argument
 void remove_background(unsigned char *img, int width, int height, int channels, double threshold);
 
+// Like remove_background, but into 'out' with an alpha channel added: grey
+// becomes grey+alpha, RGB becomes RGBA, and background pixels get alpha 0.
+// 'out' may be 'img' for 2- and 4-channel images. Returns 0 when out of memory.
+int cut_background(const unsigned char *img, int width, int height, int channels, double threshold,
+                   unsigned char *out);
+
 #endif
\ No newline at end of file
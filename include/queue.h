@@ -12,6 +12,7 @@ typedef struct Node {
 
 typedef struct {
     Node *front, *rear;
+    Node *free_list; // dequeued nodes, reused by the next enqueue
 } Queue;
 
 Queue* createQueue();
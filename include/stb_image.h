@@ -270,6 +270,12 @@ RECENT REVISION HISTORY:
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// On x64, AVX2 versions of the IDCT, 2x2 upsampler and YCbCr conversion are
+// compiled alongside the SSE2 ones (using per-function target attributes, so
+// no -mavx2 is needed) and selected by a run-time CPU test. They produce
+// bit-identical output to the SSE2 kernels. Define STBI_NO_AVX2 to leave
+// them out.
+//
 // If for some reason you do not want to use any of SIMD code, or if
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
@@ -433,6 +439,47 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
 #endif
 
+// Decode into caller-owned memory instead of a freshly allocated buffer.
+// Row j of the image starts at out + j*out_stride; out_size is the number of
+// bytes available at 'out'. Size the buffer with stbi_info_* first (pass the
+// channel count you want as desired_channels so the layout is fixed).
+// JPEG decodes straight into 'out'; other formats are decoded as usual and
+// copied. Returns 1 on success, 0 on failure (including "buffer too small").
+STBIDEF int stbi_load_from_memory_into   (stbi_uc           const *buffer, int len   , stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int stbi_load_from_callbacks_into(stbi_io_callbacks const *clbk  , void *user, stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into               (char const *filename,                        stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+#ifndef STBI_NO_JPEG
+// JPEG coefficient access: decode a JPEG and also keep its quantized DCT
+// coefficients, so it can be re-encoded (e.g. with stbi_write_jpg_coefficients)
+// without going through pixels for every block.
+typedef struct
+{
+   int h, v;                  // sampling factors
+   int blocks_w, blocks_h;    // 'coeff' size in 8x8 blocks (covers whole MCUs)
+   short *coeff;              // quantized, natural order, 64 per block, row-major blocks
+   unsigned short quant[64];  // quantization table, natural order
+   void *raw;                 // allocation behind 'coeff'
+} stbi_jpeg_component;
+
+typedef struct
+{
+   int num_components;        // 1 (grayscale) or 3 (YCbCr)
+   int h_max, v_max;          // largest sampling factors; an MCU is 8*h_max x 8*v_max pixels
+   int mcus_x, mcus_y;        // MCUs across and down
+   stbi_jpeg_component comp[3];
+} stbi_jpeg_coefficients;
+
+// Returns the decoded pixels like stbi_load_from_memory (never flipped) and
+// fills *coeffs. Fails for anything that isn't a JPEG, and for JPEGs that
+// aren't grayscale or YCbCr (CMYK, Adobe RGB). Release the coefficients with
+// stbi_jpeg_coefficients_free and the pixels with stbi_image_free.
+STBIDEF stbi_uc *stbi_load_jpeg_coefficients_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_jpeg_coefficients *coeffs);
+STBIDEF void     stbi_jpeg_coefficients_free(stbi_jpeg_coefficients *coeffs);
+#endif
+
 #ifdef STBI_WINDOWS_UTF8
 STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
 #endif
@@ -643,12 +690,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -665,9 +714,9 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #endif
 
 #ifdef STBI_HAS_LROTL
-   #define stbi_lrot(x,y)  _lrotl(x,y)
+   #define stbi_lrot64(x,y)  _rotl64(x,y)
 #else
-   #define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (-(y) & 31)))
+   #define stbi_lrot64(x,y)  (((x) << (y)) | ((x) >> (-(y) & 63)))
 #endif
 
 #if defined(STBI_MALLOC) && defined(STBI_FREE) && (defined(STBI_REALLOC) || defined(STBI_REALLOC_SIZED))
@@ -750,7 +799,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -761,7 +810,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -774,6 +823,38 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 kernels: x64 only, always behind a run-time check. GCC/Clang need
+// the target attribute to emit AVX2 code without -mavx2 for the whole file.
+#if defined(STBI_SSE2) && defined(STBI__X64_TARGET) && !defined(STBI_NO_AVX2) && !defined(STBI_NO_JPEG)
+#if defined(_MSC_VER) && _MSC_VER >= 1700
+#define STBI_AVX2
+#define STBI__AVX2_TARGET
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define STBI_AVX2
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#ifdef STBI_AVX2
+#include <immintrin.h>
+
+static int stbi__avx2_available(void)
+{
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid(info, 1);
+   // need OSXSAVE + AVX, and the OS must save the ymm state
+   if ((info[2] & 0x18000000) != 0x18000000) return 0;
+   if ((_xgetbv(0) & 6) != 6) return 0;
+   __cpuidex(info, 7, 0);
+   return (info[1] >> 5) & 1;
+#else
+   // checks OS ymm support as well
+   return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -817,6 +898,11 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   // caller-supplied destination for the stbi_load_*_into functions, or NULL
+   stbi_uc *out_buffer;
+   int out_stride;
+   size_t out_size;
 } stbi__context;
 
 
@@ -830,6 +916,7 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->out_buffer = NULL;
 }
 
 // initialize a callback-based context
@@ -843,6 +930,7 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
+   s->out_buffer = NULL;
 }
 
 #ifndef STBI_NO_STDIO
@@ -1219,16 +1307,15 @@ static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int chan
    return enlarged;
 }
 
-static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
+static void stbi__vertical_flip_rows(void *image, size_t bytes_per_row, size_t stride, int h)
 {
    int row;
-   size_t bytes_per_row = (size_t)w * bytes_per_pixel;
    stbi_uc temp[2048];
    stbi_uc *bytes = (stbi_uc *)image;
 
    for (row = 0; row < (h>>1); row++) {
-      stbi_uc *row0 = bytes + row*bytes_per_row;
-      stbi_uc *row1 = bytes + (h - row - 1)*bytes_per_row;
+      stbi_uc *row0 = bytes + row*stride;
+      stbi_uc *row1 = bytes + (h - row - 1)*stride;
       // swap row0 with row1
       size_t bytes_left = bytes_per_row;
       while (bytes_left) {
@@ -1243,6 +1330,12 @@ static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
    }
 }
 
+static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
+{
+   size_t bytes_per_row = (size_t)w * bytes_per_pixel;
+   stbi__vertical_flip_rows(image, bytes_per_row, bytes_per_row, h);
+}
+
 #ifndef STBI_NO_GIF
 static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int bytes_per_pixel)
 {
@@ -1283,6 +1376,56 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    return (unsigned char *) result;
 }
 
+// does a w*h*n image fit in the caller's buffer at the caller's stride?
+static int stbi__out_buffer_fits(stbi__context *s, int w, int h, int n)
+{
+   size_t row = (size_t) w * n;
+   if (s->out_stride < 0 || (size_t) s->out_stride < row) return 0;
+   if (h == 0) return 1;
+   if (row > s->out_size) return 0;
+   return (size_t) (h-1) <= (s->out_size - row) / (size_t) s->out_stride;
+}
+
+static int stbi__load_into(stbi__context *s, stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__result_info ri;
+   int w, h, c, n;
+   stbi_uc *result;
+
+   s->out_buffer = out;
+   s->out_stride = out_stride;
+   s->out_size = out_size;
+   result = (stbi_uc *) stbi__load_main(s, &w, &h, &c, req_comp, &ri, 8);
+   if (result == NULL)
+      return 0;
+   n = req_comp ? req_comp : c;
+
+   if (result != out) {
+      // this loader can't write in place; copy its result over
+      int j;
+      STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
+      if (ri.bits_per_channel != 8) {
+         result = stbi__convert_16_to_8((stbi__uint16 *) result, w, h, n);
+         if (result == NULL) return 0;
+      }
+      if (!stbi__out_buffer_fits(s, w, h, n)) {
+         STBI_FREE(result);
+         return stbi__err("buffer too small", "Output buffer too small for image");
+      }
+      for (j=0; j < h; ++j)
+         memcpy(out + (size_t) j * out_stride, result + (size_t) j * w * n, (size_t) w * n);
+      STBI_FREE(result);
+   }
+
+   if (stbi__vertically_flip_on_load)
+      stbi__vertical_flip_rows(out, (size_t) w * n, (size_t) out_stride, h);
+
+   *x = w;
+   *y = h;
+   if (comp) *comp = c;
+   return 1;
+}
+
 static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
@@ -1386,6 +1529,18 @@ STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req
    return result;
 }
 
+STBIDEF int stbi_load_into(char const *filename, stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   int result;
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__load_into(&s,out,out_stride,out_size,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
 STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
    stbi__uint16 *result;
@@ -1440,6 +1595,20 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF int stbi_load_from_memory_into(stbi_uc const *buffer, int len, stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into(&s,out,out_stride,out_size,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_from_callbacks_into(stbi_io_callbacks const *clbk, void *user, stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_into(&s,out,out_stride,out_size,x,y,comp,req_comp);
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1933,7 +2102,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 #ifndef STBI_NO_JPEG
 
 // huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+#define FAST_BITS   11 // larger handles more cases; smaller stomps less cache
 
 typedef struct
 {
@@ -1952,7 +2121,7 @@ typedef struct
    stbi__huffman huff_dc[4];
    stbi__huffman huff_ac[4];
    stbi__uint16 dequant[4][64];
-   stbi__int16 fast_ac[4][1 << FAST_BITS];
+   stbi__int32 fast_ac[4][1 << FAST_BITS];
 
 // sizes for components, interleaved MCUs
    int img_h_max, img_v_max;
@@ -1972,11 +2141,22 @@ typedef struct
       stbi_uc *data;
       void *raw_data, *raw_coeff;
       stbi_uc *linebuf;
-      short   *coeff;   // progressive only
+      short   *coeff;   // progressive, or when the caller asked for coefficients
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+      stbi_uc *idct_out; // destination of the block held in the other slot, or NULL
+      int      idct_slot;
    } img_comp[4];
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+   // baseline blocks are held back one at a time so horizontally adjacent
+   // pairs can go through idct_block2_kernel together. two 64-entry slots
+   // per component, plus slack to 16-byte align them wherever we were allocated
+   short idct_raw[4*2*64 + 8];
+
+   // when set, baseline blocks are kept quantized in img_comp[].coeff (like
+   // progressive ones) and handed to the caller here at the end
+   stbi_jpeg_coefficients *coeff_out;
+
+   stbi__uint64   code_buffer; // jpeg entropy-coded buffer, msb-aligned
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
@@ -1996,6 +2176,7 @@ typedef struct
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_block2_kernel)(stbi_uc *out, int out_stride, short data0[64], short data1[64]); // data1 lands at out+8; may be NULL
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
@@ -2045,9 +2226,9 @@ static int stbi__build_huffman(stbi__huffman *h, int *count)
    return 1;
 }
 
-// build a table that decodes both magnitude and value of small ACs in
-// one go.
-static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
+// build a table that decodes run, size and the extended magnitude of
+// common ACs in one go.
+static void stbi__build_fast_ac(stbi__int32 *fast_ac, stbi__huffman *h)
 {
    int i;
    for (i=0; i < (1 << FAST_BITS); ++i) {
@@ -2064,9 +2245,8 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
             int k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - magbits);
             int m = 1 << (magbits - 1);
             if (k < m) k += (~0U << magbits) + 1;
-            // if the result is small enough, we can fit it in fast_ac table
-            if (k >= -128 && k <= 127)
-               fast_ac[i] = (stbi__int16) ((k * 256) + (run * 16) + (len + magbits));
+            // magbits <= FAST_BITS-1, so k always fits above the low 8 bits
+            fast_ac[i] = (k * 256) + (run * 16) + (len + magbits);
          }
       }
    }
@@ -2074,20 +2254,39 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
 
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+   stbi__context *s = j->s;
+   // fast path: if the next 8 bytes are in memory and none of the ones we
+   // take is 0xff, there's no stuffing or marker to handle, so load them in
+   // one go. n whole bytes tops the buffer up to 56..63 bits.
+   if (!j->nomore && s->img_buffer_end - s->img_buffer >= 8) {
+      int n = (63 - j->code_bits) >> 3;
+      stbi_uc *p = s->img_buffer;
+      stbi__uint64 keep = ~(~(stbi__uint64) 0 >> (n*8));
+      stbi__uint64 v = ((stbi__uint64) p[0] << 56) | ((stbi__uint64) p[1] << 48) | ((stbi__uint64) p[2] << 40) | ((stbi__uint64) p[3] << 32)
+                     | ((stbi__uint64) p[4] << 24) | ((stbi__uint64) p[5] << 16) | ((stbi__uint64) p[6] <<  8) |  (stbi__uint64) p[7];
+      // a 0xff byte in the kept part of v is a zero byte in t
+      stbi__uint64 t = ~v | ~keep;
+      if (!((t - 0x0101010101010101ull) & ~t & 0x8080808080808080ull)) {
+         j->code_buffer |= (v & keep) >> j->code_bits;
+         j->code_bits += n*8;
+         s->img_buffer += n;
+         return;
+      }
+   }
    do {
-      unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
+      unsigned int b = j->nomore ? 0 : stbi__get8(s);
       if (b == 0xff) {
-         int c = stbi__get8(j->s);
-         while (c == 0xff) c = stbi__get8(j->s); // consume fill bytes
+         int c = stbi__get8(s);
+         while (c == 0xff) c = stbi__get8(s); // consume fill bytes
          if (c != 0) {
             j->marker = (unsigned char) c;
             j->nomore = 1;
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (stbi__uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= 56);
 }
 
 // (1 << n) - 1
@@ -2103,7 +2302,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -2120,7 +2319,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -2134,10 +2333,10 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
+   c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
    if(c < 0 || c >= 256) // symbol id out of bounds!
        return -1;
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   STBI_ASSERT((j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -2152,41 +2351,39 @@ static const int stbi__jbias[16] = {0,-1,-3,-7,-15,-31,-63,-127,-255,-511,-1023,
 // always extends everything it receives.
 stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 {
-   unsigned int k;
+   stbi__uint64 k;
    int sgn;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
    if (j->code_bits < n) return 0; // ran out of bits from stream, return 0s intead of continuing
 
-   sgn = j->code_buffer >> 31; // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   sgn = (int) (j->code_buffer >> 63); // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
+   k = stbi_lrot64(j->code_buffer, n);
+   j->code_buffer = k & ~(stbi__uint64) stbi__bmask[n];
    j->code_bits -= n;
-   return k + (stbi__jbias[n] & (sgn - 1));
+   return (int) (k & stbi__bmask[n]) + (stbi__jbias[n] & (sgn - 1));
 }
 
 // get some unsigned bits
 stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
-   unsigned int k;
+   stbi__uint64 k;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
    if (j->code_bits < n) return 0; // ran out of bits from stream, return 0s intead of continuing
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = stbi_lrot64(j->code_buffer, n);
+   j->code_buffer = k & ~(stbi__uint64) stbi__bmask[n];
    j->code_bits -= n;
-   return k;
+   return (int) (k & stbi__bmask[n]);
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-   unsigned int k;
+   stbi__uint64 k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
    if (j->code_bits < 1) return 0; // ran out of bits from stream, return 0s intead of continuing
    k = j->code_buffer;
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return (int) (k >> 63);
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -2207,7 +2404,7 @@ static const stbi_uc stbi__jpeg_dezigzag[64+15] =
 };
 
 // decode one 64-entry block--
-static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi__uint16 *dequant)
+static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int32 *fac, int b, stbi__uint16 *dequant)
 {
    int diff,dc,k;
    int t;
@@ -2232,7 +2429,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
       r = fac[c];
       if (r) { // fast-AC path
          k += (r >> 4) & 15; // run
@@ -2292,7 +2489,7 @@ static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__
 
 // @OPTIMIZE: store non-zigzagged during the decode passes,
 // and only de-zigzag when dequantizing
-static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__huffman *hac, stbi__int16 *fac)
+static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__huffman *hac, stbi__int32 *fac)
 {
    int k;
    if (j->spec_start == 0) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
@@ -2310,7 +2507,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (64 - FAST_BITS));
          r = fac[c];
          if (r) { // fast-AC path
             k += (r >> 4) & 15; // run
@@ -2704,6 +2901,183 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// avx2 integer IDCT of two horizontally adjacent blocks at once. this is the
+// sse2 version above with block 0 in the low 128-bit lane and block 1 in the
+// high lane; every operation used is lane-local, so results are bit-identical.
+STBI__AVX2_TARGET
+static void stbi__idct_avx2(stbi_uc *out, int out_stride, short data0[64], short data1[64])
+{
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_set1_epi32((int) (((unsigned int) (x) & 0xffff) | ((unsigned int) (y) << 16)))
+
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   // block 0 row k in the low lane, block 1 row k in the high lane
+   #define dct_load(k) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (data0 + (k)*8))), \
+                              _mm_load_si128((const __m128i *) (data1 + (k)*8)), 1)
+
+   // p holds rows r (qword 0/2) and r+1 (qword 1/3) of both blocks
+   #define dct_store2(p) \
+      { \
+         __m256i q = _mm256_permute4x64_epi64(p, 0xd8); \
+         _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(q)); out += out_stride; \
+         _mm_storeu_si128((__m128i *) out, _mm256_extracti128_si256(q, 1)); out += out_stride; \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose, per lane
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m256i p0 = _mm256_packus_epi16(row0, row1);
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose, per lane
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
+
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      // store; each output row is 16 contiguous bytes across both blocks
+      dct_store2(p0);
+      dct_store2(p2);
+      dct_store2(p1);
+      dct_store2(p3);
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+#undef dct_store2
+}
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2946,13 +3320,64 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// baseline blocks are decoded into stbi__jpeg_block_buf and then handed to
+// stbi__jpeg_idct_block, which holds each one back until it knows whether the
+// next block of the same component sits right next to it
+static short *stbi__jpeg_idct_buf(stbi__jpeg *z, int n, int slot)
+{
+   short *buf = (short *) (((size_t) z->idct_raw + 15) & ~(size_t) 15);
+   return buf + (n*2 + slot) * 64;
+}
+
+static short *stbi__jpeg_block_buf(stbi__jpeg *z, int n)
+{
+   return stbi__jpeg_idct_buf(z, n, z->img_comp[n].idct_slot);
+}
+
+static void stbi__jpeg_idct_block(stbi__jpeg *z, int n, stbi_uc *out)
+{
+   int slot = z->img_comp[n].idct_slot;
+   int w2 = z->img_comp[n].w2;
+   stbi_uc *prev = z->img_comp[n].idct_out;
+   if (!z->idct_block2_kernel) {
+      z->idct_block_kernel(out, w2, stbi__jpeg_idct_buf(z, n, slot));
+      return;
+   }
+   if (prev) {
+      if (out == prev + 8) {
+         z->idct_block2_kernel(prev, w2, stbi__jpeg_idct_buf(z, n, !slot), stbi__jpeg_idct_buf(z, n, slot));
+         z->img_comp[n].idct_out = NULL;
+         return;
+      }
+      z->idct_block_kernel(prev, w2, stbi__jpeg_idct_buf(z, n, !slot));
+   }
+   z->img_comp[n].idct_out = out;
+   z->img_comp[n].idct_slot = !slot;
+}
+
+static void stbi__jpeg_idct_flush(stbi__jpeg *z)
+{
+   int n;
+   for (n=0; n < z->s->img_n; ++n) {
+      if (z->img_comp[n].idct_out) {
+         z->idct_block_kernel(z->img_comp[n].idct_out, z->img_comp[n].w2, stbi__jpeg_idct_buf(z, n, !z->img_comp[n].idct_slot));
+         z->img_comp[n].idct_out = NULL;
+      }
+   }
+}
+
+// decode_block multiplies by this when the quantized values are being kept
+static stbi__uint16 stbi__jpeg_unit_dequant[64] = {
+   1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
+   1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1
+};
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
    if (!z->progressive) {
       if (z->scan_n == 1) {
          int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
          int n = z->order[0];
          // non-interleaved data, we just need to process one block at a time,
          // in trivial scanline order
@@ -2963,8 +3388,13 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (z->coeff_out) {
+                  short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, stbi__jpeg_unit_dequant)) return 0;
+               } else {
+                  if (!stbi__jpeg_decode_block(z, stbi__jpeg_block_buf(z, n), z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  stbi__jpeg_idct_block(z, n, z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8);
+               }
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2978,7 +3408,6 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          return 1;
       } else { // interleaved
          int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
          for (j=0; j < z->img_mcu_y; ++j) {
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
@@ -2991,8 +3420,13 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                         int x2 = (i*z->img_comp[n].h + x)*8;
                         int y2 = (j*z->img_comp[n].v + y)*8;
                         int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        if (z->coeff_out) {
+                           short *data = z->img_comp[n].coeff + 64 * (x2/8 + (y2/8) * z->img_comp[n].coeff_w);
+                           if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, stbi__jpeg_unit_dequant)) return 0;
+                        } else {
+                           if (!stbi__jpeg_decode_block(z, stbi__jpeg_block_buf(z, n), z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                           stbi__jpeg_idct_block(z, n, z->img_comp[n].data+z->img_comp[n].w2*y2+x2);
+                        }
                      }
                   }
                }
@@ -3079,8 +3513,9 @@ static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
 
 static void stbi__jpeg_finish(stbi__jpeg *z)
 {
-   if (z->progressive) {
+   if (z->progressive || z->coeff_out) {
       // dequantize and idct the data
+      STBI_SIMD_ALIGN(short, copy[128]);
       int i,j,n;
       for (n=0; n < z->s->img_n; ++n) {
          int w = (z->img_comp[n].x+7) >> 3;
@@ -3088,8 +3523,18 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+               if (z->coeff_out) {
+                  // the caller gets the quantized values, so work on a copy
+                  memcpy(copy, data, (i+1 < w ? 128 : 64) * sizeof(short));
+                  data = copy;
+               }
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (z->idct_block2_kernel && i+1 < w) {
+                  stbi__jpeg_dequantize(data+64, z->dequant[z->img_comp[n].tq]);
+                  z->idct_block2_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, data+64);
+                  ++i;
+               } else
+                  z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
             }
          }
       }
@@ -3334,12 +3779,14 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
+      z->img_comp[i].idct_out = NULL;
+      z->img_comp[i].idct_slot = 0;
       z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
       if (z->img_comp[i].raw_data == NULL)
          return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
-      if (z->progressive) {
+      if (z->progressive || z->coeff_out) {
          // w2, h2 are multiples of 8 (see above)
          z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
          z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
@@ -3347,6 +3794,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
+         // baseline scans may not cover the padding blocks of a component
+         if (z->coeff_out)
+            memset(z->img_comp[i].coeff, 0, (size_t) z->img_comp[i].w2 * z->img_comp[i].h2 * sizeof(short));
       }
    }
 
@@ -3423,6 +3873,7 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
          if (!stbi__parse_entropy_coded_data(j)) return 0;
+         stbi__jpeg_idct_flush(j);
          if (j->marker == STBI__MARKER_none ) {
          j->marker = stbi__skip_jpeg_junk_at_end(j);
             // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
@@ -3441,7 +3892,7 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
          m = stbi__get_marker(j);
       }
    }
-   if (j->progressive)
+   if (j->progressive || j->coeff_out)
       stbi__jpeg_finish(j);
    return 1;
 }
@@ -3643,6 +4094,75 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
+#ifdef STBI_AVX2
+STBI__AVX2_TARGET
+static stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // same filter as stbi__resample_row_hv_2_simd, 16 input pixels per iteration
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~15); i += 16) {
+      // vertical pass, 3*x + y = 4*x + (y - x)
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i diff  = _mm256_sub_epi16(farw, nearw);
+      __m256i nears = _mm256_slli_epi16(nearw, 2);
+      __m256i curr  = _mm256_add_epi16(nears, diff);
+
+      // "prev"/"next" are curr shifted by one pixel across the lane boundary,
+      // with the neighbouring pixels outside this group patched in
+      __m256i lo0  = _mm256_permute2x128_si256(curr, curr, 0x08); // 0 | curr.lo
+      __m256i hi0  = _mm256_permute2x128_si256(curr, curr, 0x81); // curr.hi | 0
+      __m256i prv0 = _mm256_alignr_epi8(curr, lo0, 14);
+      __m256i nxt0 = _mm256_alignr_epi8(hi0, curr, 2);
+      __m256i prev = _mm256_insert_epi16(prv0, t1, 0);
+      __m256i next = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+      // horizontal pass, polyphase
+      __m256i bias = _mm256_set1_epi16(8);
+      __m256i curs = _mm256_slli_epi16(curr, 2);
+      __m256i prvd = _mm256_sub_epi16(prev, curr);
+      __m256i nxtd = _mm256_sub_epi16(next, curr);
+      __m256i curb = _mm256_add_epi16(curs, bias);
+      __m256i even = _mm256_add_epi16(prvd, curb);
+      __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+      // interleave even/odd (per lane, which keeps pixel order), undo scaling
+      __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+      __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+      __m256i de0  = _mm256_srli_epi16(int0, 4);
+      __m256i de1  = _mm256_srli_epi16(int1, 4);
+
+      __m256i outv = _mm256_packus_epi16(de0, de1);
+      _mm256_storeu_si256((__m256i *) (out + i*2), outv);
+
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
    // resample with nearest-neighbor
@@ -3677,7 +4197,7 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255; // step 3 has no alpha byte to spare
       out += step;
    }
 }
@@ -3811,7 +4331,111 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255;
+      out += step;
+   }
+}
+#endif
+
+#ifdef STBI_AVX2
+STBI__AVX2_TARGET
+static void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   // same arithmetic as the sse2 kernel, 16 pixels per iteration; unlike the
+   // sse2 kernel this also handles step == 3, which is what RGB loads use
+   int i = 0;
+
+   if (step == 4 || step == 3) {
+      __m256i signflip  = _mm256_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi8((char) (unsigned char) 128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+      // drops every 4th byte of each 4-pixel group
+      __m256i rgb_shuf = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+                                          0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+      // step 3 writes 4 bytes past the 48 it produces, so it needs at least
+      // two more pixels in the row after each group
+      int tail = step == 4 ? 15 : 17;
+
+      for (; i+tail < count; i += 16) {
+         // load; pixels 0..7 go to the low lane, 8..15 to the high lane
+         __m256i y_bytes  = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (y+i))), 0x50);
+         __m256i cr_bytes = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (pcr+i))), 0x50);
+         __m256i cb_bytes = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (pcb+i))), 0x50);
+         __m256i cr_biased = _mm256_xor_si256(cr_bytes, signflip); // -128
+         __m256i cb_biased = _mm256_xor_si256(cb_bytes, signflip); // -128
+
+         // unpack to short (and left-shift cr, cb by 8)
+         __m256i yw  = _mm256_unpacklo_epi8(y_bias, y_bytes);
+         __m256i crw = _mm256_unpacklo_epi8(_mm256_setzero_si256(), cr_biased);
+         __m256i cbw = _mm256_unpacklo_epi8(_mm256_setzero_si256(), cb_biased);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+         // transpose to interleave channels; o0 = pixels 0-3|8-11, o1 = 4-7|12-15
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+         __m256i a  = _mm256_permute2x128_si256(o0, o1, 0x20); // pixels 0..7
+         __m256i b  = _mm256_permute2x128_si256(o0, o1, 0x31); // pixels 8..15
+
+         if (step == 4) {
+            _mm256_storeu_si256((__m256i *) (out + 0), a);
+            _mm256_storeu_si256((__m256i *) (out + 32), b);
+            out += 64;
+         } else {
+            // squeeze each 4-pixel group to 12 bytes and overlap the stores
+            __m256i a3 = _mm256_shuffle_epi8(a, rgb_shuf);
+            __m256i b3 = _mm256_shuffle_epi8(b, rgb_shuf);
+            _mm_storeu_si128((__m128i *) (out + 0),  _mm256_castsi256_si128(a3));
+            _mm_storeu_si128((__m128i *) (out + 12), _mm256_extracti128_si256(a3, 1));
+            _mm_storeu_si128((__m128i *) (out + 24), _mm256_castsi256_si128(b3));
+            _mm_storeu_si128((__m128i *) (out + 36), _mm256_extracti128_si256(b3, 1));
+            out += 48;
+         }
+      }
+   }
+
+   for (; i < count; ++i) {
+      int y_fixed = (y[i] << 20) + (1<<19); // rounding
+      int r,g,b;
+      int cr = pcr[i] - 128;
+      int cb = pcb[i] - 128;
+      r = y_fixed + cr* stbi__float2fixed(1.40200f);
+      g = y_fixed + cr*-stbi__float2fixed(0.71414f) + ((cb*-stbi__float2fixed(0.34414f)) & 0xffff0000);
+      b = y_fixed                                   +   cb* stbi__float2fixed(1.77200f);
+      r >>= 20;
+      g >>= 20;
+      b >>= 20;
+      if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
+      if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
+      if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
+      out[0] = (stbi_uc)r;
+      out[1] = (stbi_uc)g;
+      out[2] = (stbi_uc)b;
+      if (step == 4) out[3] = 255;
       out += step;
    }
 }
@@ -3832,6 +4456,14 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_block2_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
@@ -3862,6 +4494,31 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
+// hand the coefficient buffers over to the caller; cleanup won't free them
+static void stbi__jpeg_export_coefficients(stbi__jpeg *z)
+{
+   stbi_jpeg_coefficients *c = z->coeff_out;
+   int n, i;
+   c->num_components = z->s->img_n;
+   c->h_max = z->img_h_max;
+   c->v_max = z->img_v_max;
+   c->mcus_x = z->img_mcu_x;
+   c->mcus_y = z->img_mcu_y;
+   for (n=0; n < z->s->img_n; ++n) {
+      stbi_jpeg_component *d = &c->comp[n];
+      d->h = z->img_comp[n].h;
+      d->v = z->img_comp[n].v;
+      d->blocks_w = z->img_comp[n].coeff_w;
+      d->blocks_h = z->img_comp[n].coeff_h;
+      d->coeff = z->img_comp[n].coeff;
+      d->raw = z->img_comp[n].raw_coeff;
+      for (i=0; i < 64; ++i)
+         d->quant[i] = z->dequant[z->img_comp[n].tq][i];
+      z->img_comp[n].raw_coeff = NULL;
+      z->img_comp[n].coeff = NULL;
+   }
+}
+
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n, is_rgb;
@@ -3878,6 +4535,11 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 
    is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
 
+   if (z->coeff_out && (is_rgb || (z->s->img_n != 1 && z->s->img_n != 3))) {
+      stbi__cleanup_jpeg(z);
+      return stbi__errpuc("unsupported colorspace", "JPEG coefficients are only available for grayscale and YCbCr");
+   }
+
    if (z->s->img_n == 3 && n < 3 && !is_rgb)
       decode_n = 1;
    else
@@ -3891,6 +4553,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    {
       int k;
       unsigned int i,j;
+      size_t stride;
       stbi_uc *output;
       stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
 
@@ -3919,12 +4582,19 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
       }
 
       // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      if (z->s->out_buffer) {
+         if (!stbi__out_buffer_fits(z->s, z->s->img_x, z->s->img_y, n)) { stbi__cleanup_jpeg(z); return stbi__errpuc("buffer too small", "Output buffer too small for image"); }
+         output = z->s->out_buffer;
+         stride = z->s->out_stride;
+      } else {
+         output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+         if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+         stride = (size_t) n * z->s->img_x;
+      }
 
       // now go ahead and resample
       for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
+         stbi_uc *out = output + stride * j;
          for (k=0; k < decode_n; ++k) {
             stbi__resample *r = &res_comp[k];
             int y_bot = r->ystep >= (r->vs >> 1);
@@ -3947,7 +4617,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
                      out[0] = y[i];
                      out[1] = coutput[1][i];
                      out[2] = coutput[2][i];
-                     out[3] = 255;
+                     if (n == 4) out[3] = 255;
                      out += n;
                   }
                } else {
@@ -3960,7 +4630,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
                      out[0] = stbi__blinn_8x8(coutput[0][i], m);
                      out[1] = stbi__blinn_8x8(coutput[1][i], m);
                      out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
+                     if (n == 4) out[3] = 255;
                      out += n;
                   }
                } else if (z->app14_color_transform == 2) { // YCCK
@@ -3978,7 +4648,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
             } else
                for (i=0; i < z->s->img_x; ++i) {
                   out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
+                  if (n == 4) out[3] = 255;
                   out += n;
                }
          } else {
@@ -4017,6 +4687,8 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
             }
          }
       }
+      if (z->coeff_out)
+         stbi__jpeg_export_coefficients(z);
       stbi__cleanup_jpeg(z);
       *out_x = z->s->img_x;
       *out_y = z->s->img_y;
@@ -4039,6 +4711,35 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    return result;
 }
 
+STBIDEF stbi_uc *stbi_load_jpeg_coefficients_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_jpeg_coefficients *coeffs)
+{
+   unsigned char* result;
+   stbi__context s;
+   stbi__jpeg* j;
+   memset(coeffs, 0, sizeof(*coeffs));
+   stbi__start_mem(&s,buffer,len);
+   if (!stbi__jpeg_test(&s)) return stbi__errpuc("not JPEG", "Image is not a JPEG");
+   j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
+   if (!j) return stbi__errpuc("outofmem", "Out of memory");
+   memset(j, 0, sizeof(stbi__jpeg));
+   j->s = &s;
+   j->coeff_out = coeffs;
+   stbi__setup_jpeg(j);
+   result = load_jpeg_image(j, x,y,comp,req_comp);
+   STBI_FREE(j);
+   return result;
+}
+
+STBIDEF void stbi_jpeg_coefficients_free(stbi_jpeg_coefficients *coeffs)
+{
+   int n;
+   for (n=0; n < 3; ++n) {
+      STBI_FREE(coeffs->comp[n].raw);
+      coeffs->comp[n].raw = NULL;
+      coeffs->comp[n].coeff = NULL;
+   }
+}
+
 static int stbi__jpeg_test(stbi__context *s)
 {
    int r;
@@ -4087,8 +4788,10 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 
 #ifndef STBI_NO_ZLIB
 
-// fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+// fast-way is faster to check than jpeg huffman, but slow way is slower.
+// 9 bits cover the default tables; dynamic tables built for photos put most
+// of their length codes at 10-11 bits, so resolve those in one lookup too
+#define STBI__ZFAST_BITS  11
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
@@ -4179,7 +4882,7 @@ typedef struct
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
    int hit_zeof_once;
-   stbi__uint32 code_buffer;
+   stbi__uint64 code_buffer;
 
    char *zout;
    char *zout_start;
@@ -4199,34 +4902,54 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
    return stbi__zeof(z) ? 0 : *z->zbuffer++;
 }
 
+// little-endian 64-bit load; compilers turn this into a single mov
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+   return  (stbi__uint64) p[0]        | ((stbi__uint64) p[1] <<  8) |
+          ((stbi__uint64) p[2] << 16) | ((stbi__uint64) p[3] << 24) |
+          ((stbi__uint64) p[4] << 32) | ((stbi__uint64) p[5] << 40) |
+          ((stbi__uint64) p[6] << 48) | ((stbi__uint64) p[7] << 56);
+}
+
+// tops the bit buffer up to 56..63 bits
 static void stbi__fill_bits(stbi__zbuf *z)
 {
+   if (z->code_buffer >= ((stbi__uint64) 1 << z->num_bits)) {
+      z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
+      return;
+   }
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      // take as many whole bytes of an 8-byte load as fit
+      int n = (63 - z->num_bits) >> 3;
+      stbi__uint64 v = stbi__zload64(z->zbuffer) & (((stbi__uint64) 1 << (n*8)) - 1);
+      z->code_buffer |= v << z->num_bits;
+      z->zbuffer += n;
+      z->num_bits += n*8;
+      return;
+   }
    do {
-      if (z->code_buffer >= (1U << z->num_bits)) {
-        z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
-        return;
-      }
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+      z->code_buffer |= (stbi__uint64) stbi__zget8(z) << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits < 56);
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
 }
 
-static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+// symbol for a code too long for the fast table; its length goes in *size
+static int stbi__zhuffman_lookup_slow(const stbi__zhuffman *z, stbi__uint64 bits, int *size)
 {
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (bits & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4235,9 +4958,17 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
    if (b >= STBI__ZNSYMS) return -1; // some data was corrupt somewhere!
    if (z->size[b] != s) return -1;  // was originally an assert, but report failure instead.
+   *size = s;
+   return z->value[b];
+}
+
+static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+{
+   int s, v = stbi__zhuffman_lookup_slow(z, a->code_buffer, &s);
+   if (v < 0) return -1;
    a->code_buffer >>= s;
    a->num_bits -= s;
-   return z->value[b];
+   return v;
 }
 
 stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
@@ -4306,11 +5037,103 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// Decodes the bulk of a block: while 8 input bytes and room for a maximal
+// match (plus 8 bytes of copy overrun) remain, one refill of the 64-bit
+// buffer to 56+ bits covers a length code, a distance code and both their
+// extra bits (48 bits at most), so nothing in here checks either buffer end.
+// Returns 1 at the end of the block, else 0 with the bit buffer positioned
+// at a symbol for the caller's one-at-a-time loop: near either end, or at a
+// bad symbol, which the caller then reports.
+static int stbi__parse_huffman_fast(stbi__zbuf *a, char **pzout)
+{
+   const stbi_uc *in = a->zbuffer, *in_end = a->zbuffer_end - 8;
+   char *zout = *pzout, *zout_end = a->zout_end - (258 + 8);
+   stbi__uint64 bits = a->code_buffer, bits0;
+   int num_bits = a->num_bits, num_bits0, r = 0;
+   while (in <= in_end && zout <= zout_end) {
+      int z, s, e, len, dist, b;
+      stbi_uc *p;
+      if (num_bits < 48) {
+         // The load also ORs the low bits of the byte after the last one
+         // taken above num_bits; the next refill ORs the same bits into
+         // the same place, and they are masked off before returning.
+         bits |= stbi__zload64(in) << num_bits;
+         in += (63 - num_bits) >> 3;
+         num_bits |= 56;
+      }
+      bits0 = bits;
+      num_bits0 = num_bits;
+      b = a->z_length.fast[bits & STBI__ZFAST_MASK];
+      if (b) {
+         s = b >> 9;
+         z = b & 511;
+      } else {
+         z = stbi__zhuffman_lookup_slow(&a->z_length, bits, &s);
+         if (z < 0) break;
+      }
+      bits >>= s;
+      num_bits -= s;
+      if (z < 256) {
+         *zout++ = (char) z;
+         continue;
+      }
+      if (z == 256) { r = 1; break; }
+      if (z >= 286) { bits = bits0; num_bits = num_bits0; break; }
+      z -= 257;
+      e = stbi__zlength_extra[z];
+      len = stbi__zlength_base[z] + (int) (bits & ((1u << e) - 1));
+      bits >>= e;
+      num_bits -= e;
+      b = a->z_distance.fast[bits & STBI__ZFAST_MASK];
+      if (b) {
+         s = b >> 9;
+         z = b & 511;
+      } else {
+         z = stbi__zhuffman_lookup_slow(&a->z_distance, bits, &s);
+      }
+      if (z < 0 || z >= 30) { bits = bits0; num_bits = num_bits0; break; }
+      bits >>= s;
+      num_bits -= s;
+      e = stbi__zdist_extra[z];
+      dist = stbi__zdist_base[z] + (int) (bits & ((1u << e) - 1));
+      bits >>= e;
+      num_bits -= e;
+      if (zout - a->zout_start < dist) { bits = bits0; num_bits = num_bits0; break; }
+      p = (stbi_uc *) (zout - dist);
+      if (dist >= 8) { // 8 bytes at a time; may write up to 7 past the match
+         char *end = zout + len;
+         do {
+            memcpy(zout, p, 8);
+            zout += 8;
+            p += 8;
+         } while (zout < end);
+         zout = end;
+      } else if (dist == 1) { // run of one byte; common in images.
+         memset(zout, *p, len);
+         zout += len;
+      } else {
+         do *zout++ = *p++; while (--len);
+      }
+   }
+   a->zbuffer = (stbi_uc *) in;
+   a->code_buffer = bits & (((stbi__uint64) 1 << num_bits) - 1);
+   a->num_bits = num_bits;
+   *pzout = zout;
+   return r;
+}
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      if (a->zbuffer_end - a->zbuffer >= 8 && a->zout_end - zout >= 258 + 8) {
+         if (stbi__parse_huffman_fast(a, &zout)) {
+            a->zout = zout;
+            return 1;
+         }
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4409,12 +5232,12 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
 static int stbi__parse_uncompressed_block(stbi__zbuf *a)
 {
    stbi_uc header[4];
-   int len,nlen,k;
+   int len,nlen,k,n;
    if (a->num_bits & 7)
       stbi__zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
       a->code_buffer >>= 8;
       a->num_bits -= 8;
@@ -4426,9 +5249,18 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
+   // the bit buffer may still hold the first few bytes of the block
+   n = a->num_bits >> 3;
+   if (n > len) n = len;
+   if (a->zbuffer + (len - n) > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
+   for (k=0; k < n; ++k) {
+      *a->zout++ = (char) (a->code_buffer & 255);
+      a->code_buffer >>= 8;
+      a->num_bits -= 8;
+   }
+   len -= n;
    memcpy(a->zout, a->zbuffer, len);
    a->zbuffer += len;
    a->zout += len;
@@ -4692,6 +5524,95 @@ static void stbi__create_png_alpha_expand8(stbi_uc *dest, stbi_uc *src, stbi__ui
    }
 }
 
+#ifdef STBI_SSE2
+// SSE2 unfiltering. Up is plain SIMD for any pixel size. Sub and Average
+// depend on the pixel to the left, so for 8-bit RGB and RGBA they take a
+// whole pixel per step (Sub 4 per step, with a prefix sum). Paeth is left
+// to the scalar code: its chain from one pixel to the next is long enough
+// that doing the channels side by side in a register lost to the scalar
+// loop, where they overlap anyway. Returns 0 for cases not handled here.
+stbi_inline static __m128i stbi__png_load_px(const stbi_uc *p, int bpp)
+{
+   stbi__uint32 v = p[0] | (p[1] << 8) | ((stbi__uint32) p[2] << 16);
+   if (bpp == 4) v |= (stbi__uint32) p[3] << 24;
+   return _mm_cvtsi32_si128((int) v);
+}
+
+stbi_inline static void stbi__png_store_px(stbi_uc *p, __m128i x, int bpp)
+{
+   stbi__uint32 v = (stbi__uint32) _mm_cvtsi128_si32(x);
+   p[0] = (stbi_uc) v;
+   p[1] = (stbi_uc) (v >> 8);
+   p[2] = (stbi_uc) (v >> 16);
+   if (bpp == 4) p[3] = (stbi_uc) (v >> 24);
+}
+
+static int stbi__png_unfilter_px_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int nk, int bpp, int filter)
+{
+   __m128i a = _mm_setzero_si128(), b, x;
+   int k = 0;
+   switch (filter) {
+   case STBI__F_sub:
+      // cur = prefix sum of raw, by pixel: two shift+adds sum 4 pixels
+      // (5 for 3-byte ones, of which 4 are kept), then add the carry
+      if (bpp == 4) {
+         for (; k+16 <= nk; k += 16) {
+            x = _mm_loadu_si128((const __m128i *) (raw+k));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi8(x, a);
+            _mm_storeu_si128((__m128i *) (cur+k), x);
+            a = _mm_shuffle_epi32(x, 0xff);
+         }
+      } else {
+         for (; k+16 <= nk; k += 12) {
+            x = _mm_loadu_si128((const __m128i *) (raw+k));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+            x = _mm_add_epi8(x, a);
+            _mm_storeu_si128((__m128i *) (cur+k), x);  // last 4 bytes are redone next step
+            a = _mm_srli_si128(_mm_slli_si128(x, 4), 13);
+            a = _mm_or_si128(a, _mm_slli_si128(a, 3));
+            a = _mm_or_si128(a, _mm_slli_si128(a, 6));
+         }
+      }
+      for (; k < nk; k += bpp) {
+         a = _mm_add_epi8(a, stbi__png_load_px(raw+k, bpp));
+         stbi__png_store_px(cur+k, a, bpp);
+      }
+      return 1;
+   case STBI__F_avg:
+      for (; k < nk; k += bpp) {
+         // floor((a+b)/2); _mm_avg_epu8 rounds up
+         b = stbi__png_load_px(prior+k, bpp);
+         x = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+         a = _mm_add_epi8(stbi__png_load_px(raw+k, bpp), x);
+         stbi__png_store_px(cur+k, a, bpp);
+      }
+      return 1;
+   }
+   return 0;
+}
+
+static int stbi__png_unfilter_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int nk, int bpp, int filter)
+{
+   if (filter == STBI__F_up) {
+      int k = 0;
+      for (; k+16 <= nk; k += 16) {
+         __m128i x = _mm_loadu_si128((const __m128i *) (raw+k));
+         __m128i p = _mm_loadu_si128((const __m128i *) (prior+k));
+         _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(x, p));
+      }
+      for (; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      return 1;
+   }
+   if (bpp == 3 || bpp == 4)
+      return stbi__png_unfilter_px_sse2(cur, raw, prior, nk, bpp, filter);
+   return 0;
+}
+#endif
+
 // create the png data from post-deflated data
 static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
 {
@@ -4707,6 +5628,9 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
+#ifdef STBI_SSE2
+   int use_sse2 = stbi__sse2_available();
+#endif
 
    STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
    a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
@@ -4752,6 +5676,9 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       if (j == 0) filter = first_row_filter[filter];
 
       // perform actual filtering
+#ifdef STBI_SSE2
+      if (!use_sse2 || !stbi__png_unfilter_sse2(cur, raw, prior, nk, filter_bytes, filter))
+#endif
       switch (filter) {
       case STBI__F_none:
          memcpy(cur, raw, nk);
@@ -68,6 +68,17 @@ USAGE:
       int stbi_write_tga_with_rle;             // defaults to true; set to 0 to disable RLE
       int stbi_write_png_compression_level;    // defaults to 8; set to higher for more compression
       int stbi_write_force_png_filter;         // defaults to -1; set to 0..5 to force a filter mode
+      int stbi_write_jpg_fixed_point;          // defaults to 0; set to 1 for the integer JPEG DCT
+      int stbi_write_jpg_subsampling;          // defaults to STBIW_JPG_AUTO; see below
+
+   The globals (and stbi_flip_vertically_on_write) are shared by every thread.
+   A thread that calls stbi_write_set_thread_settings() gets its own copy
+   instead and never reads them again, so concurrent writers need no locks:
+      stbi_write_settings ws;
+      stbi_write_get_settings(&ws);      // start from the current defaults
+      ws.png_compression_level = 6;
+      stbi_write_set_thread_settings(&ws);
+   Each write takes a snapshot of the calling thread's settings when it starts.
 
 
    You can define STBI_WRITE_NO_STDIO to disable the file variant of these
@@ -97,7 +108,9 @@ USAGE:
    at the end of the line.)
 
    PNG allows you to set the deflate compression level by setting the global
-   variable 'stbi_write_png_compression_level' (it defaults to 8).
+   variable 'stbi_write_png_compression_level' (it defaults to 8). Levels 1-4
+   trade size for speed: a greedy deflate with short hash chains, and the
+   "up" filter on every row instead of trying all five per row.
 
    HDR expects linear float data. Since the format is always 32-bit rgb(e)
    data, alpha (if provided) is discarded, and for monochrome data it is
@@ -108,7 +121,17 @@ USAGE:
 
    JPEG does ignore alpha channels in input data; quality is between 1 and 100.
    Higher quality looks better but results in a bigger image.
+   Greyscale input (comp 1 or 2) is written as a single-component JPEG.
    JPEG baseline (no JPEG progressive).
+   With 'stbi_write_jpg_fixed_point' set, the JPEG writer colour-converts,
+   transforms and quantizes in integers (16-bit lanes, SSE2 when available)
+   instead of floats: faster, and the same bytes from every compiler and
+   platform. Quantized coefficients stay within 1 of the float path's
+   (at quality 100 a rare one is off by 2, and files come out ~10% larger:
+   keep the float path for near-lossless output).
+   'stbi_write_jpg_subsampling' picks the chroma resolution: STBIW_JPG_444,
+   STBIW_JPG_422 (half width) or STBIW_JPG_420 (half width and height).
+   The default, STBIW_JPG_AUTO, is 4:2:0 up to quality 90 and 4:4:4 above.
 
 CREDITS:
 
@@ -170,8 +193,17 @@ LICENSE
 STBIWDEF int stbi_write_tga_with_rle;
 STBIWDEF int stbi_write_png_compression_level;
 STBIWDEF int stbi_write_force_png_filter;
+STBIWDEF int stbi_write_jpg_fixed_point;
+STBIWDEF int stbi_write_jpg_subsampling;
 #endif
 
+// JPEG chroma subsampling: stbi_write_jpg_subsampling and the 'subsample'
+// argument of the cache and encoder functions below
+#define STBIW_JPG_AUTO  -1   // 4:2:0 up to quality 90, 4:4:4 above
+#define STBIW_JPG_444    0
+#define STBIW_JPG_420    1
+#define STBIW_JPG_422    2
+
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_png(char const *filename, int w, int h, int comp, const void  *data, int stride_in_bytes);
 STBIWDEF int stbi_write_bmp(char const *filename, int w, int h, int comp, const void  *data);
@@ -194,6 +226,117 @@ STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x,
 
 STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
+// PNG in independently compressed row bands, the way pigz splits a file:
+// each band is filtered and deflated on its own (ending in a sync flush), so
+// different threads can run stbi_write_png_band() on different bands at the
+// same time; the writer then joins the bands' IDAT chunks and checksums.
+// Bands always use the built-in speed-oriented deflate (never
+// STBIW_ZLIB_COMPRESS); at levels 5+ it searches longer hash chains. Each
+// band costs a few bytes and the matches that would cross its top edge.
+// All memory is allocated by stbi_write_png_bands_begin(), which also takes
+// the settings; 'data' must stay valid until the bands are compressed.
+typedef struct stbi_write_png_bands stbi_write_png_bands;
+
+STBIWDEF stbi_write_png_bands *stbi_write_png_bands_begin(int w, int h, int comp, const void *data, int stride_in_bytes, int bands);
+STBIWDEF int  stbi_write_png_band(stbi_write_png_bands *png, int band);
+STBIWDEF int  stbi_write_png_bands_to_func(stbi_write_func *func, void *context, stbi_write_png_bands *png);
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int  stbi_write_png_from_bands(char const *filename, stbi_write_png_bands *png);
+#endif
+STBIWDEF void stbi_write_png_bands_free(stbi_write_png_bands *png);
+
+// Write a baseline JPEG straight from quantized DCT coefficients (e.g. the ones
+// stb_image's stbi_load_jpeg_coefficients_from_memory returns), with the given
+// quantization tables and the standard Huffman tables. comp is 1 (Y) or 3
+// (YCbCr); sampling factors are honored for 3 components.
+typedef struct
+{
+   int h, v;                      // sampling factors, 1..4
+   int blocks_w;                  // blocks per row in 'coeff'
+   const short *coeff;            // quantized coefficients, natural order, 64 per block
+   const unsigned short *quant;   // quantization table, natural order
+} stbi_write_jpg_component;
+
+STBIWDEF int stbi_write_jpg_coefficients_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const stbi_write_jpg_component *components);
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_jpg_coefficients(char const *filename, int w, int h, int comp, const stbi_write_jpg_component *components);
+#endif
+
+// Colour conversion and forward DCT done once, then encoded at any number of
+// qualities: a cache holds the DCT of every block, so each encode (or size
+// probe) is only quantization and entropy coding. Encoding a cache built with
+// the subsampling stbi_write_jpg would use at a quality gives the same bytes
+// at that quality. The flip-on-write setting is taken when the cache is created.
+typedef struct stbi_write_jpg_cache stbi_write_jpg_cache;
+
+STBIWDEF stbi_write_jpg_cache *stbi_write_jpg_cache_create(int w, int h, int comp, const void *data, int subsample);
+STBIWDEF void   stbi_write_jpg_cache_free(stbi_write_jpg_cache *cache);
+STBIWDEF int    stbi_write_jpg_cache_to_func(stbi_write_func *func, void *context, const stbi_write_jpg_cache *cache, int quality);
+// size in bytes of the file stbi_write_jpg_from_cache would write; 0 on failure
+STBIWDEF size_t stbi_write_jpg_cache_size(const stbi_write_jpg_cache *cache, int quality);
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int    stbi_write_jpg_from_cache(char const *filename, const stbi_write_jpg_cache *cache, int quality);
+#endif
+
+// One image at several qualities in a single pass: colour conversion and the
+// DCT run once per block, only quantization and Huffman coding repeat per
+// output. Each output is byte-identical to stbi_write_jpg at its quality.
+// Returns 1 if every output was written.
+typedef struct
+{
+   stbi_write_func *func;
+   void *context;
+   int quality;
+} stbi_write_jpg_output;
+
+STBIWDEF int stbi_write_jpg_multi_to_func(const stbi_write_jpg_output *outputs, int count, int x, int y, int comp, const void *data);
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_jpg_multi(char const * const *filenames, const int *qualities, int count, int x, int y, int comp, const void *data);
+#endif
+
+// Quantization tables and file header for one quality and subsampling, built
+// once for any number of images. An encoder is read-only after creation, so
+// several threads can write through the same one. STBIW_JPG_AUTO picks the
+// subsampling from the quality, which gives the same bytes as stbi_write_jpg
+// with the default settings.
+typedef struct stbi_write_jpg_encoder stbi_write_jpg_encoder;
+
+STBIWDEF stbi_write_jpg_encoder *stbi_write_jpg_encoder_create(int quality, int subsample);
+STBIWDEF void stbi_write_jpg_encoder_free(stbi_write_jpg_encoder *enc);
+STBIWDEF int  stbi_write_jpg_encoder_to_func(stbi_write_func *func, void *context, const stbi_write_jpg_encoder *enc, int x, int y, int comp, const void *data);
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int  stbi_write_jpg_with_encoder(char const *filename, const stbi_write_jpg_encoder *enc, int x, int y, int comp, const void *data);
+#endif
+
+// Progressive JPEG: the same DCT and quantization as stbi_write_jpg, sent as
+// ten scans (libjpeg's default script: spectral selection plus successive
+// approximation) with optimal Huffman tables per scan. A decoder can show a
+// coarse image after the first scan, which only carries the DC values.
+STBIWDEF int stbi_write_jpg_progressive_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality);
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_jpg_progressive(char const *filename, int x, int y, int comp, const void *data, int quality);
+#endif
+
+// Forward DCT + quantization of one 8x8 block, the same way stbi_write_jpg
+// does it. 'samples' are row-major and centered on zero (value - 128 for Y);
+// 'quant' and 'out' are in natural order.
+STBIWDEF void stbi_write_jpg_quantize_block(const float samples[64], const unsigned short quant[64], short out[64]);
+
+typedef struct
+{
+   int flip_vertically;        // see stbi_flip_vertically_on_write
+   int png_compression_level;  // see stbi_write_png_compression_level
+   int force_png_filter;       // see stbi_write_force_png_filter
+   int tga_with_rle;           // see stbi_write_tga_with_rle
+   int jpg_fixed_point;        // see stbi_write_jpg_fixed_point
+   int jpg_subsampling;        // see stbi_write_jpg_subsampling
+} stbi_write_settings;
+
+// per-thread override of the globals; NULL goes back to the globals
+STBIWDEF void stbi_write_set_thread_settings(stbi_write_settings const *settings);
+// the settings a write started on this thread would use right now
+STBIWDEF void stbi_write_get_settings(stbi_write_settings *settings);
+
 #endif//INCLUDE_STB_IMAGE_WRITE_H
 
 #ifdef STB_IMAGE_WRITE_IMPLEMENTATION
@@ -216,6 +359,44 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 #include <string.h>
 #include <math.h>
 
+// SSE2 for the JPEG kernels and Adler-32 when the compiler targets it anyway
+// (as stb_image does, no runtime detection); STBIW_NO_SIMD turns it off
+#if !defined(STBIW_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBIW_SSE2
+#include <emmintrin.h>
+#endif
+
+// PCLMULQDQ CRC-32 for PNG chunks (unless STBIW_CRC32 replaces it): always
+// behind a run-time check. GCC/Clang need the target attribute to emit it
+// without -mpclmul for the whole file.
+#if defined(STBIW_SSE2) && !defined(STBIW_NO_PCLMUL) && !defined(STBIW_CRC32)
+#if defined(_MSC_VER) && _MSC_VER >= 1700
+#define STBIW_PCLMUL
+#define STBIW__PCLMUL_TARGET
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define STBIW_PCLMUL
+#define STBIW__PCLMUL_TARGET __attribute__((target("pclmul")))
+#endif
+#endif
+
+#ifdef STBIW_PCLMUL
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h> // __cpuid
+#endif
+
+static int stbiw__pclmul_available(void)
+{
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid(info, 1);
+   return (info[2] >> 1) & 1;
+#else
+   return __builtin_cpu_supports("pclmul");
+#endif
+}
+#endif
+
 #if defined(STBIW_MALLOC) && defined(STBIW_FREE) && (defined(STBIW_REALLOC) || defined(STBIW_REALLOC_SIZED))
 // ok
 #elif !defined(STBIW_MALLOC) && !defined(STBIW_FREE) && !defined(STBIW_REALLOC) && !defined(STBIW_REALLOC_SIZED)
@@ -251,10 +432,14 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 static int stbi_write_png_compression_level = 8;
 static int stbi_write_tga_with_rle = 1;
 static int stbi_write_force_png_filter = -1;
+static int stbi_write_jpg_fixed_point = 0;
+static int stbi_write_jpg_subsampling = STBIW_JPG_AUTO;
 #else
 int stbi_write_png_compression_level = 8;
 int stbi_write_tga_with_rle = 1;
 int stbi_write_force_png_filter = -1;
+int stbi_write_jpg_fixed_point = 0;
+int stbi_write_jpg_subsampling = STBIW_JPG_AUTO;
 #endif
 
 static int stbi__flip_vertically_on_write = 0;
@@ -264,12 +449,64 @@ STBIWDEF void stbi_flip_vertically_on_write(int flag)
    stbi__flip_vertically_on_write = flag;
 }
 
+#ifndef STBIW_NO_THREAD_LOCALS
+   #if defined(__cplusplus) &&  __cplusplus >= 201103L
+      #define STBIW_THREAD_LOCAL       thread_local
+   #elif defined(__GNUC__) && __GNUC__ < 5
+      #define STBIW_THREAD_LOCAL       __thread
+   #elif defined(_MSC_VER)
+      #define STBIW_THREAD_LOCAL       __declspec(thread)
+   #elif defined (__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+      #define STBIW_THREAD_LOCAL       _Thread_local
+   #endif
+
+   #ifndef STBIW_THREAD_LOCAL
+      #if defined(__GNUC__)
+        #define STBIW_THREAD_LOCAL       __thread
+      #endif
+   #endif
+#endif
+
+#ifdef STBIW_THREAD_LOCAL
+static STBIW_THREAD_LOCAL stbi_write_settings stbiw__thread_settings;
+static STBIW_THREAD_LOCAL int stbiw__thread_settings_set;
+#endif
+
+STBIWDEF void stbi_write_set_thread_settings(stbi_write_settings const *settings)
+{
+#ifdef STBIW_THREAD_LOCAL
+   stbiw__thread_settings_set = settings != NULL;
+   if (settings)
+      stbiw__thread_settings = *settings;
+#else
+   STBIW_ASSERT(0 && "stbi_write_set_thread_settings needs thread-local storage");
+   (void) settings;
+#endif
+}
+
+STBIWDEF void stbi_write_get_settings(stbi_write_settings *settings)
+{
+#ifdef STBIW_THREAD_LOCAL
+   if (stbiw__thread_settings_set) {
+      *settings = stbiw__thread_settings;
+      return;
+   }
+#endif
+   settings->flip_vertically = stbi__flip_vertically_on_write;
+   settings->png_compression_level = stbi_write_png_compression_level;
+   settings->force_png_filter = stbi_write_force_png_filter;
+   settings->tga_with_rle = stbi_write_tga_with_rle;
+   settings->jpg_fixed_point = stbi_write_jpg_fixed_point;
+   settings->jpg_subsampling = stbi_write_jpg_subsampling;
+}
+
 typedef struct
 {
    stbi_write_func *func;
    void *context;
    unsigned char buffer[64];
    int buf_used;
+   stbi_write_settings settings; // snapshot taken when the write starts
 } stbi__write_context;
 
 // initialize a callback-based context
@@ -277,6 +514,7 @@ static void stbi__start_write_callbacks(stbi__write_context *s, stbi_write_func
 {
    s->func    = c;
    s->context = context;
+   stbi_write_get_settings(&s->settings);
 }
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -345,6 +583,7 @@ static void stbi__end_write_file(stbi__write_context *s)
 
 typedef unsigned int stbiw_uint32;
 typedef int stb_image_write_test[sizeof(stbiw_uint32)==4 ? 1 : -1];
+typedef unsigned long long stbiw_uint64;
 
 static void stbiw__writefv(stbi__write_context *s, const char *fmt, va_list v)
 {
@@ -456,7 +695,7 @@ static void stbiw__write_pixels(stbi__write_context *s, int rgb_dir, int vdir, i
    if (y <= 0)
       return;
 
-   if (stbi__flip_vertically_on_write)
+   if (s->settings.flip_vertically)
       vdir *= -1;
 
    if (vdir < 0) {
@@ -538,7 +777,7 @@ static int stbi_write_tga_core(stbi__write_context *s, int x, int y, int comp, v
    if (y < 0 || x < 0)
       return 0;
 
-   if (!stbi_write_tga_with_rle) {
+   if (!s->settings.tga_with_rle) {
       return stbiw__outfile(s, -1, -1, x, y, comp, 0, (void *) data, has_alpha, 0,
          "111 221 2222 11", 0, 0, format, 0, 0, 0, 0, 0, x, y, (colorbytes + has_alpha) * 8, has_alpha * 8);
    } else {
@@ -547,7 +786,7 @@ static int stbi_write_tga_core(stbi__write_context *s, int x, int y, int comp, v
 
       stbiw__writef(s, "111 221 2222 11", 0,0,format+8, 0,0,0, 0,0,x,y, (colorbytes + has_alpha) * 8, has_alpha * 8);
 
-      if (stbi__flip_vertically_on_write) {
+      if (s->settings.flip_vertically) {
          j = 0;
          jend = y;
          jdir = 1;
@@ -778,7 +1017,7 @@ static int stbi_write_hdr_core(stbi__write_context *s, int x, int y, int comp, f
       s->func(s->context, buffer, len);
 
       for(i=0; i < y; i++)
-         stbiw__write_hdr_scanline(s, x, comp, scratch, data + comp*x*(stbi__flip_vertically_on_write ? y-1-i : i));
+         stbiw__write_hdr_scanline(s, x, comp, scratch, data + comp*x*(s->settings.flip_vertically ? y-1-i : i));
       STBIW_FREE(scratch);
       return 1;
    }
@@ -846,16 +1085,6 @@ static unsigned char *stbiw__zlib_flushf(unsigned char *data, unsigned int *bitb
    return data;
 }
 
-static int stbiw__zlib_bitrev(int code, int codebits)
-{
-   int res=0;
-   while (codebits--) {
-      res = (res << 1) | (code & 1);
-      code >>= 1;
-   }
-   return res;
-}
-
 static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
 {
    int i;
@@ -892,20 +1121,275 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #endif // STBIW_ZLIB_COMPRESS
 
+static int stbiw__zlib_bitrev(int code, int codebits)
+{
+   int res=0;
+   while (codebits--) {
+      res = (res << 1) | (code & 1);
+      code >>= 1;
+   }
+   return res;
+}
+
+// deflate length and distance codes: base value and extra bits per code
+static const unsigned short stbiw__zlib_lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+static const unsigned char  stbiw__zlib_lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+static const unsigned short stbiw__zlib_distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+static const unsigned char  stbiw__zlib_disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+#ifdef STBIW_SSE2
+static unsigned int stbiw__hsum_epi32(__m128i v)
+{
+   v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+   v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+   return (unsigned int) _mm_cvtsi128_si32(v);
+}
+#endif
+
+static unsigned int stbiw__zlib_adler32(unsigned int adler, const unsigned char *data, int len)
+{
+   unsigned int s1 = adler & 0xffff, s2 = adler >> 16;
+   while (len > 0) {
+      int i = 0, blocklen = len < 5552 ? len : 5552;
+#ifdef STBIW_SSE2
+      // 16 bytes a step: s1 gains their sum, s2 gains s1 for each of them,
+      // i.e. 16 * s1-before-the-step plus the bytes weighted 16..1. The
+      // block length keeps every sum below 2^32 as in the scalar loop.
+      int n16 = blocklen & ~15;
+      if (n16) {
+         const __m128i zero = _mm_setzero_si128();
+         const __m128i wlo = _mm_setr_epi16(16,15,14,13,12,11,10,9), whi = _mm_setr_epi16(8,7,6,5,4,3,2,1);
+         __m128i vs1 = zero, vprev = zero, vs2 = zero;
+         for (; i < n16; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+            vprev = _mm_add_epi32(vprev, vs1);
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), wlo));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), whi));
+         }
+         s2 += s1 * (unsigned int) n16 + 16 * stbiw__hsum_epi32(vprev) + stbiw__hsum_epi32(vs2);
+         s1 += stbiw__hsum_epi32(vs1);
+      }
+#endif
+      for (; i < blocklen; ++i) { s1 += data[i]; s2 += s1; }
+      s1 %= 65521; s2 %= 65521;
+      data += blocklen;
+      len -= blocklen;
+   }
+   return (s2 << 16) | s1;
+}
+
+// adler32 of A followed by B, from the checksums of each and B's length
+static unsigned int stbiw__zlib_adler32_combine(unsigned int adler1, unsigned int adler2, int len2)
+{
+   unsigned int rem = (unsigned int) (len2 % 65521);
+   unsigned int s1 = adler1 & 0xffff;
+   unsigned int s2 = (rem * s1) % 65521;
+   s1 += (adler2 & 0xffff) + 65521 - 1;
+   s2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s2 >= 2*65521) s2 -= 2*65521;
+   if (s2 >= 65521) s2 -= 65521;
+   return (s2 << 16) | s1;
+}
+
+// Speed-oriented deflate, used for compression levels 1-4 and for PNG row
+// bands: greedy matching through a 4-byte hash and short chains (no lazy
+// matching), 8 bytes compared at a time, the fixed Huffman codes from a
+// table and a 64-bit bit buffer writing into memory sized up front.
+#define stbiw__ZFAST_BITS    15
+#define stbiw__ZFAST_WINDOW  32768
+// ints of hash state stbiw__zlib_deflate_fast needs
+#define stbiw__ZFAST_STATE   ((1 << stbiw__ZFAST_BITS) + stbiw__ZFAST_WINDOW)
+
+// most bytes stbiw__zlib_deflate_fast writes for 'len' input bytes
+static int stbiw__zlib_fast_bound(int len)
+{
+   return len + len/8 + (len/32767 + 1)*5 + 16;
+}
+
+static int stbiw__zlib_matchlen(const unsigned char *a, const unsigned char *b, int limit)
+{
+   int n = 0;
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   while (n + 8 <= limit) {
+      stbiw_uint64 x, y;
+      memcpy(&x, a+n, 8);
+      memcpy(&y, b+n, 8);
+      if (x != y) return n + (__builtin_ctzll(x ^ y) >> 3);
+      n += 8;
+   }
+#endif
+   while (n < limit && a[n] == b[n]) ++n;
+   return n;
+}
+
+// length 3..258 -> length code 0..28
+static int stbiw__zlib_lencode(int len)
+{
+   int v = len - 3, k = 0;
+   if (len == 258) return 28;
+   if (v < 8) return v;
+   while ((v >> k) > 1) ++k;
+   return 4*k - 4 + ((v >> (k-2)) & 3);
+}
+
+// distance 1..32768 -> distance code 0..29
+static int stbiw__zlib_distcode(int dist)
+{
+   int v = dist - 1, k = 0;
+   if (v < 4) return v;
+   while ((v >> k) > 1) ++k;
+   return 2*k + ((v >> (k-1)) & 1);
+}
+
+// Raw deflate of data[0..data_len) into 'out' (stbiw__zlib_fast_bound bytes).
+// The last stream of a file ends in a BFINAL block; any other ends in a sync
+// flush (an empty stored block), so streams can simply be concatenated.
+// 'state' is stbiw__ZFAST_STATE ints of scratch. Returns the bytes written.
+static int stbiw__zlib_deflate_fast(const unsigned char *data, int data_len, int level, int last, int *state, unsigned char *out)
+{
+   int *head = state, *prev = state + (1 << stbiw__ZFAST_BITS);
+   int chain = level < 2 ? 1 : level < 5 ? 1 << (level-1) : 2*level;
+   unsigned short lit[288];
+   unsigned char litn[288], distrev[30];
+   stbiw_uint64 bitbuf = 0;
+   int bitcount = 0, i = 0, j, o = 0;
+
+   for (j=0; j < 288; ++j) {
+      int code = j <= 143 ? 0x30 + j : j <= 255 ? 0x190 + j-144 : j <= 279 ? j-256 : 0xc0 + j-280;
+      litn[j] = (unsigned char) (j <= 143 ? 8 : j <= 255 ? 9 : j <= 279 ? 7 : 8);
+      lit[j] = (unsigned short) stbiw__zlib_bitrev(code, litn[j]);
+   }
+   for (j=0; j < 30; ++j)
+      distrev[j] = (unsigned char) stbiw__zlib_bitrev(j, 5);
+   for (j=0; j < (1 << stbiw__ZFAST_BITS); ++j)
+      head[j] = -1;
+
+#define stbiw__zfast_add(code,codebits) (bitbuf |= (stbiw_uint64) (code) << bitcount, bitcount += (codebits))
+#define stbiw__zfast_flush() \
+   if (bitcount >= 32) { \
+      out[o] = STBIW_UCHAR(bitbuf); out[o+1] = STBIW_UCHAR(bitbuf >> 8); \
+      out[o+2] = STBIW_UCHAR(bitbuf >> 16); out[o+3] = STBIW_UCHAR(bitbuf >> 24); \
+      o += 4; bitbuf >>= 32; bitcount -= 32; \
+   }
+
+   stbiw__zfast_add(last ? 1 : 0, 1);  // BFINAL
+   stbiw__zfast_add(1, 2);             // BTYPE = 1 -- fixed huffman
+
+   while (i + 4 <= data_len) {
+      stbiw_uint32 v = data[i] | (data[i+1] << 8) | (data[i+2] << 16) | ((stbiw_uint32) data[i+3] << 24);
+      int h = (int) ((v * 2654435761u) >> (32 - stbiw__ZFAST_BITS));
+      int cand = head[h], best = 0, dist = 0, k;
+      int limit = data_len - i < 258 ? data_len - i : 258;
+      prev[i & (stbiw__ZFAST_WINDOW-1)] = cand;
+      head[h] = i;
+      for (k = chain; k > 0 && cand >= 0 && i - cand < stbiw__ZFAST_WINDOW; --k) {
+         if (data[cand+best] == data[i+best]) {
+            int len = stbiw__zlib_matchlen(data+cand, data+i, limit);
+            if (len > best) {
+               best = len;
+               dist = i - cand;
+               if (len == limit) break;
+            }
+         }
+         cand = prev[cand & (stbiw__ZFAST_WINDOW-1)];
+      }
+
+      if (best >= 3) {
+         int lc = stbiw__zlib_lencode(best), dc = stbiw__zlib_distcode(dist);
+         stbiw__zfast_add(lit[257+lc], litn[257+lc]);
+         stbiw__zfast_add(best - stbiw__zlib_lengthc[lc], stbiw__zlib_lengtheb[lc]);
+         stbiw__zfast_add(distrev[dc], 5);
+         stbiw__zfast_add(dist - stbiw__zlib_distc[dc], stbiw__zlib_disteb[dc]);
+         stbiw__zfast_flush();
+         // level 1 doesn't index the bytes inside a match
+         if (level > 1) {
+            int end = i + best;
+            if (end > data_len - 3) end = data_len - 3;
+            for (j = i+1; j < end; ++j) {
+               v = data[j] | (data[j+1] << 8) | (data[j+2] << 16) | ((stbiw_uint32) data[j+3] << 24);
+               h = (int) ((v * 2654435761u) >> (32 - stbiw__ZFAST_BITS));
+               prev[j & (stbiw__ZFAST_WINDOW-1)] = head[h];
+               head[h] = j;
+            }
+         }
+         i += best;
+      } else {
+         stbiw__zfast_add(lit[data[i]], litn[data[i]]);
+         stbiw__zfast_flush();
+         ++i;
+      }
+   }
+   for (; i < data_len; ++i) {
+      stbiw__zfast_add(lit[data[i]], litn[data[i]]);
+      stbiw__zfast_flush();
+   }
+   stbiw__zfast_add(lit[256], litn[256]); // end of block
+   if (!last)
+      stbiw__zfast_add(0, 3);   // sync flush: empty stored block, BFINAL = 0
+   for (; bitcount > 0; bitcount -= 8, bitbuf >>= 8)
+      out[o++] = STBIW_UCHAR(bitbuf);
+   if (!last) {
+      out[o++] = 0; out[o++] = 0; out[o++] = 0xff; out[o++] = 0xff;
+   }
+#undef stbiw__zfast_add
+#undef stbiw__zfast_flush
+
+   // store uncompressed instead if compression was worse
+   if (o > data_len + (data_len ? (data_len+32766)/32767 : 1)*5) {
+      o = 0;
+      j = 0;
+      do {
+         int blocklen = data_len - j;
+         if (blocklen > 32767) blocklen = 32767;
+         out[o++] = STBIW_UCHAR(last && data_len - j == blocklen); // BFINAL = ?, BTYPE = 0 -- no compression
+         out[o++] = STBIW_UCHAR(blocklen);
+         out[o++] = STBIW_UCHAR(blocklen >> 8);
+         out[o++] = STBIW_UCHAR(~blocklen);
+         out[o++] = STBIW_UCHAR(~blocklen >> 8);
+         memcpy(out+o, data+j, blocklen);
+         o += blocklen;
+         j += blocklen;
+      } while (j < data_len);
+   }
+   return o;
+}
+
 STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
 {
 #ifdef STBIW_ZLIB_COMPRESS
    // user provided a zlib compress implementation, use that
    return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
 #else // use builtin
-   static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
-   static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
-   static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
-   static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+   const unsigned short *lengthc = stbiw__zlib_lengthc, *distc = stbiw__zlib_distc;
+   const unsigned char *lengtheb = stbiw__zlib_lengtheb, *disteb = stbiw__zlib_disteb;
    unsigned int bitbuf=0;
    int i,j, bitcount=0;
    unsigned char *out = NULL;
-   unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
+   unsigned char ***hash_table;
+   unsigned int adler;
+
+   if (quality >= 1 && quality < 5) {
+      int *state = (int *) STBIW_MALLOC(stbiw__ZFAST_STATE * sizeof(int));
+      if (!state) return NULL;
+      out = (unsigned char *) STBIW_MALLOC(2 + stbiw__zlib_fast_bound(data_len) + 4);
+      if (!out) { STBIW_FREE(state); return NULL; }
+      out[0] = 0x78;   // DEFLATE 32K window
+      out[1] = 0x01;   // FLEVEL = 0, fastest
+      j = 2 + stbiw__zlib_deflate_fast(data, data_len, quality, 1, state, out+2);
+      STBIW_FREE(state);
+      adler = stbiw__zlib_adler32(1, data, data_len);
+      out[j++] = STBIW_UCHAR(adler >> 24);
+      out[j++] = STBIW_UCHAR(adler >> 16);
+      out[j++] = STBIW_UCHAR(adler >> 8);
+      out[j++] = STBIW_UCHAR(adler);
+      *out_len = j;
+      return out;
+   }
+
+   hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
    if (hash_table == NULL)
       return NULL;
    if (quality < 5) quality = 5;
@@ -998,22 +1482,12 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
       }
    }
 
-   {
-      // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
-   }
+   // compute adler32 on input
+   adler = stbiw__zlib_adler32(1, data, data_len);
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 24));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 16));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 8));
+   stbiw__sbpush(out, STBIW_UCHAR(adler));
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
@@ -1021,6 +1495,78 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
 #endif // STBIW_ZLIB_COMPRESS
 }
 
+#ifdef STBIW_PCLMUL
+// CRC-32 by carry-less multiplication: four 128-bit lanes folded forward 64
+// bytes at a time, folded into one, then Barrett-reduced to 32 bits (Intel's
+// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ"; the
+// constants are for the bit-reflected gzip/PNG polynomial). 'len' is a
+// multiple of 16, at least 64; 'crc' is the running (inverted) value.
+static STBIW__PCLMUL_TARGET unsigned int stbiw__crc32_pclmul(const unsigned char *buf, int len, unsigned int crc)
+{
+   const __m128i k1k2 = _mm_setr_epi32((int) 0x54442bd4u, 1, (int) 0xc6e41596u, 1);
+   const __m128i k3k4 = _mm_setr_epi32((int) 0x751997d0u, 1, (int) 0xccaa009eu, 0);
+   const __m128i k5k0 = _mm_setr_epi32((int) 0x63cd6124u, 1, 0, 0);
+   const __m128i poly = _mm_setr_epi32((int) 0xdb710641u, 1, (int) 0xf7011641u, 1);
+   const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+   __m128i x0, x1, x2, x3, x4, x5;
+
+   x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+   x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+   x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+   x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+   x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+   buf += 64;
+   len -= 64;
+
+   // fold 4 x 128 bits forward by 512 bits per step
+   while (len >= 64) {
+      __m128i y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00), y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+      __m128i y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00), y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+      x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), y1);
+      x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), y2);
+      x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), y3);
+      x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), y4);
+      x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i *) (buf + 0x00)));
+      x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i *) (buf + 0x10)));
+      x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i *) (buf + 0x20)));
+      x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i *) (buf + 0x30)));
+      buf += 64;
+      len -= 64;
+   }
+
+   // fold the four lanes into one, then any 16-byte blocks left
+   x0 = k3k4;
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x11), x2), x5);
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x11), x3), x5);
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x11), x4), x5);
+   while (len >= 16) {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *) buf)), x5);
+      buf += 16;
+      len -= 16;
+   }
+
+   // 128 -> 64 bits
+   x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+   x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_and_si128(x1, mask32);
+   x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+   // Barrett reduction to 32 bits
+   x2 = _mm_and_si128(x1, mask32);
+   x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+   x2 = _mm_and_si128(x2, mask32);
+   x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+   return (unsigned int) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
+
 static unsigned int stbiw__crc32(unsigned char *buffer, int len)
 {
 #ifdef STBIW_CRC32
@@ -1063,8 +1609,33 @@ static unsigned int stbiw__crc32(unsigned char *buffer, int len)
    };
 
    unsigned int crc = ~0u;
-   int i;
-   for (i=0; i < len; ++i)
+   int i = 0;
+#ifdef STBIW_PCLMUL
+   if (len >= 64 && stbiw__pclmul_available()) {
+      i = len & ~15;
+      crc = stbiw__crc32_pclmul(buffer, i, crc);
+   } else
+#endif
+   if (len >= 1024) {
+      // slicing-by-8: slice[k] is the table for a byte k+1 positions further
+      // from the end of the 8, built per call (it only takes a couple of us)
+      unsigned int slice[7][256];
+      int j, k;
+      for (j=0; j < 256; ++j) {
+         unsigned int c = crc_table[j];
+         for (k=0; k < 7; ++k) {
+            c = (c >> 8) ^ crc_table[c & 0xff];
+            slice[k][j] = c;
+         }
+      }
+      for (; i+8 <= len; i += 8) {
+         stbiw_uint32 lo = crc ^ (buffer[i] | (buffer[i+1] << 8) | (buffer[i+2] << 16) | ((stbiw_uint32) buffer[i+3] << 24));
+         stbiw_uint32 hi = buffer[i+4] | (buffer[i+5] << 8) | (buffer[i+6] << 16) | ((stbiw_uint32) buffer[i+7] << 24);
+         crc = slice[6][lo & 0xff] ^ slice[5][(lo >> 8) & 0xff] ^ slice[4][(lo >> 16) & 0xff] ^ slice[3][lo >> 24] ^
+               slice[2][hi & 0xff] ^ slice[1][(hi >> 8) & 0xff] ^ slice[0][(hi >> 16) & 0xff] ^ crc_table[hi >> 24];
+      }
+   }
+   for (; i < len; ++i)
       crc = (crc >> 8) ^ crc_table[buffer[i] ^ (crc & 0xff)];
    return ~crc;
 #endif
@@ -1082,22 +1653,23 @@ static void stbiw__wpcrc(unsigned char **data, int len)
 
 static unsigned char stbiw__paeth(int a, int b, int c)
 {
+   // written as selects rather than early returns so compilers emit cmovs:
+   // the branches are unpredictable on photographic rows
    int p = a + b - c, pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
-   if (pa <= pb && pa <= pc) return STBIW_UCHAR(a);
-   if (pb <= pc) return STBIW_UCHAR(b);
-   return STBIW_UCHAR(c);
+   int bc = pb <= pc ? b : c;
+   return STBIW_UCHAR(pa <= pb && pa <= pc ? a : bc);
 }
 
 // @OPTIMIZE: provide an option that always forces left-predict or paeth predict
-static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer, int flip)
 {
    static int mapping[] = { 0,1,2,3,4 };
    static int firstmap[] = { 0,1,0,5,6 };
    int *mymap = (y != 0) ? mapping : firstmap;
    int i;
    int type = mymap[filter_type];
-   unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
-   int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+   unsigned char *z = pixels + stride_bytes * (flip ? height-1-y : y);
+   int signed_stride = flip ? -stride_bytes : stride_bytes;
 
    if (type==0) {
       memcpy(line_buffer, z, width*n);
@@ -1125,33 +1697,33 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
    }
 }
 
-STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+// Filters rows j0..j1-1 of the image into 'filt', each row prefixed by its
+// filter type.
+static void stbiw__png_filter_rows(stbi_write_settings const *settings, const unsigned char *pixels, int stride_bytes, int x, int y, int n, int j0, int j1, unsigned char *filt, signed char *line_buffer)
 {
-   int force_filter = stbi_write_force_png_filter;
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int j,zlen;
-
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
+   int force_filter = settings->force_png_filter;
+   int level = settings->png_compression_level;
+   int j;
 
    if (force_filter >= 5) {
       force_filter = -1;
    }
 
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
+   for (j=j0; j < j1; ++j) {
       int filter_type;
       if (force_filter > -1) {
          filter_type = force_filter;
-         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
+         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer, settings->flip_vertically);
+      } else if (level >= 1 && level < 5) {
+         // Fast levels: up on every row (sub on the first), as fpng does. On
+         // photos it compresses better than any per-row pick, since rows
+         // filtered alike keep matching each other at distance 1 row.
+         filter_type = j == 0 ? 1 : 2;
+         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer, settings->flip_vertically);
       } else { // Estimate the best filter by running through all of them:
          int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
          for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
+            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer, settings->flip_vertically);
 
             // Estimate the entropy of the line using this filter; the less, the better.
             est = 0;
@@ -1164,25 +1736,21 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
             }
          }
          if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
+            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer, settings->flip_vertically);
             filter_type = best_filter;
          }
       }
       // when we get here, filter_type contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) filter_type;
-      STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
+      filt[(j-j0)*(x*n+1)] = (unsigned char) filter_type;
+      STBIW_MEMMOVE(filt+(j-j0)*(x*n+1)+1, line_buffer, x*n);
    }
-   STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
-   STBIW_FREE(filt);
-   if (!zlib) return 0;
-
-   // each tag requires 12 bytes of overhead
-   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
-   if (!out) return 0;
-   *out_len = 8 + 12+13 + 12+zlen + 12;
+}
 
-   o=out;
+// signature and IHDR chunk, 33 bytes
+static unsigned char *stbiw__png_header(unsigned char *o, int x, int y, int n)
+{
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
    STBIW_MEMMOVE(o,sig,8); o+= 8;
    stbiw__wp32(o, 13); // header length
    stbiw__wptag(o, "IHDR");
@@ -1194,6 +1762,32 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    *o++ = 0;
    *o++ = 0;
    stbiw__wpcrc(&o,13);
+   return o;
+}
+
+static unsigned char *stbiw__png_to_mem(stbi_write_settings const *settings, const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   unsigned char *out,*o, *filt, *zlib;
+   signed char *line_buffer;
+   int zlen;
+
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
+   stbiw__png_filter_rows(settings, pixels, stride_bytes, x, y, n, 0, y, filt, line_buffer);
+   STBIW_FREE(line_buffer);
+   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, settings->png_compression_level);
+   STBIW_FREE(filt);
+   if (!zlib) return 0;
+
+   // each tag requires 12 bytes of overhead
+   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
+   if (!out) return 0;
+   *out_len = 8 + 12+13 + 12+zlen + 12;
+
+   o = stbiw__png_header(out, x, y, n);
 
    stbiw__wp32(o, zlen);
    stbiw__wptag(o, "IDAT");
@@ -1211,12 +1805,22 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    return out;
 }
 
+STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   stbi_write_settings settings;
+   stbi_write_get_settings(&settings);
+   return stbiw__png_to_mem(&settings, pixels, stride_bytes, x, y, n, out_len);
+}
+
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
 {
    FILE *f;
    int len;
-   unsigned char *png = stbi_write_png_to_mem((const unsigned char *) data, stride_bytes, x, y, comp, &len);
+   unsigned char *png;
+   stbi_write_settings settings;
+   stbi_write_get_settings(&settings);
+   png = stbiw__png_to_mem(&settings, (const unsigned char *) data, stride_bytes, x, y, comp, &len);
    if (png == NULL) return 0;
 
    f = stbiw__fopen(filename, "wb");
@@ -1231,7 +1835,10 @@ STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const
 STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes)
 {
    int len;
-   unsigned char *png = stbi_write_png_to_mem((const unsigned char *) data, stride_bytes, x, y, comp, &len);
+   unsigned char *png;
+   stbi_write_settings settings;
+   stbi_write_get_settings(&settings);
+   png = stbiw__png_to_mem(&settings, (const unsigned char *) data, stride_bytes, x, y, comp, &len);
    if (png == NULL) return 0;
    func(context, png, len);
    STBIW_FREE(png);
@@ -1239,6 +1846,161 @@ STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x,
 }
 
 
+typedef struct
+{
+   int y0, y1;                // rows of the image in this band
+   unsigned char *filt;       // filtered rows
+   signed char *line_buffer;
+   int *state;                // deflate hash chains
+   unsigned char *chunk;      // IDAT chunk: length, tag, [zlib header], deflate data, [adler32], crc
+   int chunk_len;             // 0 until the band is compressed
+   unsigned int adler;        // adler32 of 'filt'
+} stbiw__png_band;
+
+struct stbi_write_png_bands
+{
+   stbi_write_settings settings;
+   const unsigned char *pixels;
+   int stride, x, y, n;
+   int count;
+   stbiw__png_band *band;
+};
+
+STBIWDEF stbi_write_png_bands *stbi_write_png_bands_begin(int x, int y, int comp, const void *data, int stride_bytes, int bands)
+{
+   stbi_write_png_bands *png;
+   int b, rowlen = x*comp+1;
+
+   if (x <= 0 || y <= 0 || comp < 1 || comp > 4 || !data) return NULL;
+   if (bands < 1) bands = 1;
+   if (bands > y) bands = y;
+
+   png = (stbi_write_png_bands *) STBIW_MALLOC(sizeof(*png) + bands * sizeof(stbiw__png_band));
+   if (!png) return NULL;
+   stbi_write_get_settings(&png->settings);
+   if (png->settings.png_compression_level < 1) png->settings.png_compression_level = 5;
+   png->pixels = (const unsigned char *) data;
+   png->stride = stride_bytes ? stride_bytes : x*comp;
+   png->x = x;
+   png->y = y;
+   png->n = comp;
+   png->count = bands;
+   png->band = (stbiw__png_band *) (png + 1);
+
+   // everything the bands need is allocated here, so stbi_write_png_band()
+   // doesn't allocate and may run on any thread
+   for (b = 0; b < bands; ++b) {
+      stbiw__png_band *band = &png->band[b];
+      int len;
+      band->y0 = (int) ((long long) y * b / bands);
+      band->y1 = (int) ((long long) y * (b+1) / bands);
+      len = (band->y1 - band->y0) * rowlen;
+      band->state = (int *) STBIW_MALLOC(stbiw__ZFAST_STATE * sizeof(int) + len + x*comp + 8+2 + stbiw__zlib_fast_bound(len) + 4+4);
+      if (!band->state) {
+         while (b--) STBIW_FREE(png->band[b].state);
+         STBIW_FREE(png);
+         return NULL;
+      }
+      band->filt = (unsigned char *) (band->state + stbiw__ZFAST_STATE);
+      band->line_buffer = (signed char *) (band->filt + len);
+      band->chunk = (unsigned char *) (band->line_buffer + x*comp);
+      band->chunk_len = 0;
+   }
+   return png;
+}
+
+STBIWDEF int stbi_write_png_band(stbi_write_png_bands *png, int b)
+{
+   stbiw__png_band *band;
+   int len, zlen;
+   unsigned char *o;
+
+   if (!png || b < 0 || b >= png->count) return 0;
+   band = &png->band[b];
+   len = (band->y1 - band->y0) * (png->x*png->n+1);
+   stbiw__png_filter_rows(&png->settings, png->pixels, png->stride, png->x, png->y, png->n, band->y0, band->y1, band->filt, band->line_buffer);
+
+   o = band->chunk + 8;
+   if (b == 0) {
+      *o++ = 0x78;   // DEFLATE 32K window
+      *o++ = png->settings.png_compression_level < 5 ? 0x01 : 0x5e;  // FLEVEL = 0 or 1
+   }
+   o += stbiw__zlib_deflate_fast(band->filt, len, png->settings.png_compression_level, b == png->count-1, band->state, o);
+   band->adler = stbiw__zlib_adler32(1, band->filt, len);
+   if (b == png->count-1)
+      o += 4;   // adler32 of the whole stream, filled in by the writer
+   zlen = (int) (o - band->chunk) - 8;
+   o = band->chunk;
+   stbiw__wp32(o, zlen);
+   stbiw__wptag(o, "IDAT");
+   o += zlen;
+   if (b != png->count-1)
+      stbiw__wpcrc(&o, zlen);
+   band->chunk_len = 8 + zlen + 4;
+   return 1;
+}
+
+static int stbiw__png_bands_core(stbi__write_context *s, stbi_write_png_bands *png)
+{
+   unsigned char hdr[33], iend[12], *o;
+   stbiw__png_band *last;
+   unsigned int adler;
+   int b;
+
+   for (b = 0; b < png->count; ++b)
+      if (!png->band[b].chunk_len) return 0;
+
+   last = &png->band[png->count-1];
+   adler = png->band[0].adler;
+   for (b = 1; b < png->count; ++b)
+      adler = stbiw__zlib_adler32_combine(adler, png->band[b].adler, (png->band[b].y1 - png->band[b].y0) * (png->x*png->n+1));
+   o = last->chunk + last->chunk_len - 8;
+   stbiw__wp32(o, adler);
+   stbiw__wpcrc(&o, last->chunk_len - 12);
+
+   stbiw__png_header(hdr, png->x, png->y, png->n);
+   s->func(s->context, hdr, sizeof(hdr));
+   for (b = 0; b < png->count; ++b)
+      s->func(s->context, png->band[b].chunk, png->band[b].chunk_len);
+   o = iend;
+   stbiw__wp32(o,0);
+   stbiw__wptag(o, "IEND");
+   stbiw__wpcrc(&o,0);
+   s->func(s->context, iend, sizeof(iend));
+   return 1;
+}
+
+STBIWDEF int stbi_write_png_bands_to_func(stbi_write_func *func, void *context, stbi_write_png_bands *png)
+{
+   stbi__write_context s = { 0 };
+   if (!png) return 0;
+   stbi__start_write_callbacks(&s, func, context);
+   return stbiw__png_bands_core(&s, png);
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_png_from_bands(char const *filename, stbi_write_png_bands *png)
+{
+   stbi__write_context s = { 0 };
+   if (!png) return 0;
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbiw__png_bands_core(&s, png);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+#endif
+
+STBIWDEF void stbi_write_png_bands_free(stbi_write_png_bands *png)
+{
+   int b;
+   if (!png) return;
+   for (b = png->count; b-- > 0;)
+      STBIW_FREE(png->band[b].state);
+   STBIW_FREE(png);
+}
+
 /* ***************************************************************************
  *
  * JPEG writer
@@ -1250,24 +2012,91 @@ STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x,
 static const unsigned char stbiw__jpg_ZigZag[] = { 0,1,5,6,14,15,27,28,2,4,7,13,16,26,29,42,3,8,12,17,25,30,41,43,9,11,18,
       24,31,40,44,53,10,19,23,32,39,45,52,54,20,22,33,38,46,51,55,60,21,34,37,47,50,56,59,61,35,36,48,49,57,58,62,63 };
 
-static void stbiw__jpg_writeBits(stbi__write_context *s, int *bitBufP, int *bitCntP, const unsigned short *bs) {
-   int bitBuf = *bitBufP, bitCnt = *bitCntP;
-   bitCnt += bs[1];
-   bitBuf |= bs[0] << (24 - bitCnt);
-   while(bitCnt >= 8) {
-      unsigned char c = (bitBuf >> 16) & 255;
-      stbiw__putc(s, c);
-      if(c == 255) {
-         stbiw__putc(s, 0);
-      }
-      bitBuf <<= 8;
-      bitCnt -= 8;
-   }
-   *bitBufP = bitBuf;
-   *bitCntP = bitCnt;
+// Entropy-coded data: bits collect in a 64-bit word and go out eight bytes
+// at a time into 'buf', which is handed to the write callback when full
+#define STBIW__JPG_BUF_SIZE 4096
+
+typedef struct
+{
+   stbi__write_context *s;
+   stbiw_uint64 acc;
+   int free;      // bits of 'acc' not yet holding data
+   int used;      // bytes of 'buf'
+   unsigned char buf[STBIW__JPG_BUF_SIZE];
+} stbiw__jpg_bits;
+
+static void stbiw__jpg_bitsStart(stbiw__jpg_bits *b, stbi__write_context *s) {
+   b->s = s;
+   b->acc = 0;
+   b->free = 64;
+   b->used = 0;
 }
 
-static void stbiw__jpg_DCT(float *d0p, float *d1p, float *d2p, float *d3p, float *d4p, float *d5p, float *d6p, float *d7p) {
+static void stbiw__jpg_putWord(stbiw__jpg_bits *b, stbiw_uint64 w) {
+   unsigned char *p;
+   // room for the worst case, where every byte is 0xFF and gets a 0 after it
+   if(b->used > STBIW__JPG_BUF_SIZE - 16) {
+      b->s->func(b->s->context, b->buf, b->used);
+      b->used = 0;
+   }
+   p = b->buf + b->used;
+   // An 0xFF byte in w is a zero byte in ~w. Most words have none and are
+   // stored whole.
+   if(((~w - 0x0101010101010101ull) & w & 0x8080808080808080ull) == 0) {
+      p[0] = (unsigned char) (w >> 56); p[1] = (unsigned char) (w >> 48);
+      p[2] = (unsigned char) (w >> 40); p[3] = (unsigned char) (w >> 32);
+      p[4] = (unsigned char) (w >> 24); p[5] = (unsigned char) (w >> 16);
+      p[6] = (unsigned char) (w >>  8); p[7] = (unsigned char) w;
+      b->used += 8;
+   } else {
+      int i;
+      for(i = 56; i >= 0; i -= 8) {
+         unsigned char c = (unsigned char) (w >> i);
+         *p++ = c;
+         if(c == 255) *p++ = 0;
+      }
+      b->used = (int) (p - b->buf);
+   }
+}
+
+// 'size' (up to 32) bits of 'code', most significant first
+static void stbiw__jpg_putBits(stbiw__jpg_bits *b, unsigned int code, int size) {
+   if(size < b->free) {
+      b->acc = (b->acc << size) | code;
+      b->free -= size;
+   } else {
+      // bits of 'code' above the ones left over stay in 'acc' but are
+      // shifted out before the next word is written
+      int over = size - b->free;
+      stbiw__jpg_putWord(b, (b->acc << b->free) | (code >> over));
+      b->acc = code;
+      b->free = 64 - over;
+   }
+}
+
+// Pad the last byte with 1s and hand everything to the write callback
+static void stbiw__jpg_bitsEnd(stbiw__jpg_bits *b) {
+   stbiw_uint64 w;
+   int n;
+   stbiw__jpg_putBits(b, 0x7F, 7);
+   // free == 64 when the pad just filled a word: nothing left to flush, and
+   // a 64-bit shift would be undefined
+   w = b->free < 64 ? b->acc << b->free : 0;
+   // the last putWord may have left the buffer nearly full
+   if(b->used > STBIW__JPG_BUF_SIZE - 16) {
+      b->s->func(b->s->context, b->buf, b->used);
+      b->used = 0;
+   }
+   for(n = (64 - b->free) / 8; n > 0; --n, w <<= 8) {
+      unsigned char c = (unsigned char) (w >> 56);
+      b->buf[b->used++] = c;
+      if(c == 255) b->buf[b->used++] = 0;
+   }
+   b->s->func(b->s->context, b->buf, b->used);
+   b->used = 0;
+}
+
+static void stbiw__jpg_DCT(float *d0p, float *d1p, float *d2p, float *d3p, float *d4p, float *d5p, float *d6p, float *d7p) {
    float d0 = *d0p, d1 = *d1p, d2 = *d2p, d3 = *d3p, d4 = *d4p, d5 = *d5p, d6 = *d6p, d7 = *d7p;
    float z1, z2, z3, z4, z5, z11, z13;
 
@@ -1315,21 +2144,94 @@ static void stbiw__jpg_DCT(float *d0p, float *d1p, float *d2p, float *d3p, float
    *d0p = d0;  *d2p = d2;  *d4p = d4;  *d6p = d6;
 }
 
+// val != 0
 static void stbiw__jpg_calcBits(int val, unsigned short bits[2]) {
    int tmp1 = val < 0 ? -val : val;
    val = val < 0 ? val-1 : val;
+#if defined(__GNUC__) || defined(__clang__)
+   bits[1] = (unsigned short) (32 - __builtin_clz((unsigned int) tmp1));
+#else
    bits[1] = 1;
    while(tmp1 >>= 1) {
       ++bits[1];
    }
+#endif
    bits[0] = val & ((1<<bits[1])-1);
 }
 
-static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, int du_stride, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
-   const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
-   const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
-   int dataOff, i, j, n, diff, end0pos, x, y;
-   int DU[64];
+// Standard Huffman tables (JPEG spec, Annex K.3), as they go in the DHT segment
+static const unsigned char stbiw__jpg_std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
+static const unsigned char stbiw__jpg_std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const unsigned char stbiw__jpg_std_ac_luminance_nrcodes[] = {0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
+static const unsigned char stbiw__jpg_std_ac_luminance_values[] = {
+   0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
+   0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+   0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
+   0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+   0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
+   0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+   0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
+};
+static const unsigned char stbiw__jpg_std_dc_chrominance_nrcodes[] = {0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
+static const unsigned char stbiw__jpg_std_dc_chrominance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const unsigned char stbiw__jpg_std_ac_chrominance_nrcodes[] = {0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
+static const unsigned char stbiw__jpg_std_ac_chrominance_values[] = {
+   0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
+   0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+   0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
+   0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+   0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
+   0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+   0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
+};
+
+// Huffman tables as {code, length}, indexed by symbol
+static const unsigned short stbiw__jpg_YDC_HT[256][2] = { {0,2},{2,3},{3,3},{4,3},{5,3},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9}};
+static const unsigned short stbiw__jpg_UVDC_HT[256][2] = { {0,2},{1,2},{2,2},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9},{1022,10},{2046,11}};
+static const unsigned short stbiw__jpg_YAC_HT[256][2] = {
+   {10,4},{0,2},{1,2},{4,3},{11,4},{26,5},{120,7},{248,8},{1014,10},{65410,16},{65411,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {12,4},{27,5},{121,7},{502,9},{2038,11},{65412,16},{65413,16},{65414,16},{65415,16},{65416,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {28,5},{249,8},{1015,10},{4084,12},{65417,16},{65418,16},{65419,16},{65420,16},{65421,16},{65422,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {58,6},{503,9},{4085,12},{65423,16},{65424,16},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {59,6},{1016,10},{65430,16},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {122,7},{2039,11},{65438,16},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {123,7},{4086,12},{65446,16},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {250,8},{4087,12},{65454,16},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {504,9},{32704,15},{65462,16},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {505,9},{65470,16},{65471,16},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {506,9},{65479,16},{65480,16},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {1017,10},{65488,16},{65489,16},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {1018,10},{65497,16},{65498,16},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {2040,11},{65506,16},{65507,16},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {65515,16},{65516,16},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {2041,11},{65525,16},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
+};
+static const unsigned short stbiw__jpg_UVAC_HT[256][2] = {
+   {0,2},{1,2},{4,3},{10,4},{24,5},{25,5},{56,6},{120,7},{500,9},{1014,10},{4084,12},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {11,4},{57,6},{246,8},{501,9},{2038,11},{4085,12},{65416,16},{65417,16},{65418,16},{65419,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {26,5},{247,8},{1015,10},{4086,12},{32706,15},{65420,16},{65421,16},{65422,16},{65423,16},{65424,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {27,5},{248,8},{1016,10},{4087,12},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{65430,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {58,6},{502,9},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{65438,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {59,6},{1017,10},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{65446,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {121,7},{2039,11},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{65454,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {122,7},{2040,11},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{65462,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {249,8},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{65470,16},{65471,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {503,9},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{65479,16},{65480,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {504,9},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{65488,16},{65489,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {505,9},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{65497,16},{65498,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {506,9},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{65506,16},{65507,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {2041,11},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{65515,16},{65516,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {16352,14},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{65525,16},{0,0},{0,0},{0,0},{0,0},{0,0},
+   {1018,10},{32707,15},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
+};
+// AAN scale factors folded into the quantizer (stbiw__jpg_DCT output is unscaled)
+static const float stbiw__jpg_aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+                                         1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
+
+// Forward DCT of one block in place; the output is unscaled (stbiw__jpg_aasf
+// is folded into the quantizer)
+static void stbiw__jpg_fdctDU(float *CDU, int du_stride) {
+   int dataOff, n;
 
    // DCT rows
    for(dataOff=0, n=du_stride*8; dataOff<n; dataOff+=du_stride) {
@@ -1340,6 +2242,12 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
       stbiw__jpg_DCT(&CDU[dataOff], &CDU[dataOff+du_stride], &CDU[dataOff+du_stride*2], &CDU[dataOff+du_stride*3], &CDU[dataOff+du_stride*4],
                      &CDU[dataOff+du_stride*5], &CDU[dataOff+du_stride*6], &CDU[dataOff+du_stride*7]);
    }
+}
+
+// Quantize one DCT'd block; DU comes out in zigzag order
+static void stbiw__jpg_quantizeDU(const float *CDU, int du_stride, const float *fdtbl, int DU[64]) {
+   int i, j, x, y;
+
    // Quantize/descale/zigzag the coefficients
    for(y = 0, j=0; y < 8; ++y) {
       for(x = 0; x < 8; ++x,++j) {
@@ -1348,19 +2256,224 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
          v = CDU[i]*fdtbl[j];
          // DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
          // ceilf() and floorf() are C99, not C89, but I /think/ they're not needed here anyway?
-         DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+         // Same rounding as (v < 0 ? v - 0.5f : v + 0.5f), but picking the
+         // constant instead of the expression keeps the sign test off a branch
+         DU[stbiw__jpg_ZigZag[j]] = (int)(v + (v < 0 ? -0.5f : 0.5f));
       }
    }
+}
+
+// Fixed-point forward DCT: the "islow" algorithm of IJG libjpeg (jfdctint.c).
+// Samples come in with STBIW__JPG_SAMPLE_BITS fractional bits and the
+// coefficients come out scaled up by 8, which the quantizer's divisors take
+// back out. With these shifts every intermediate fits in 16 bits, so the SSE2
+// version keeps eight int16 lanes per register and the two give the same
+// bits; output does not depend on the compiler or its float settings.
+#define STBIW__JPG_CONST_BITS  13
+#define STBIW__JPG_PASS1_BITS  0
+#define STBIW__JPG_SAMPLE_BITS 2
+
+#define STBIW__JPG_FIX_0_298631336  2446
+#define STBIW__JPG_FIX_0_390180644  3196
+#define STBIW__JPG_FIX_0_541196100  4433
+#define STBIW__JPG_FIX_0_765366865  6270
+#define STBIW__JPG_FIX_0_899976223  7373
+#define STBIW__JPG_FIX_1_175875602  9633
+#define STBIW__JPG_FIX_1_501321110  12299
+#define STBIW__JPG_FIX_1_847759065  15137
+#define STBIW__JPG_FIX_1_961570560  16069
+#define STBIW__JPG_FIX_2_053119869  16819
+#define STBIW__JPG_FIX_2_562915447  20995
+#define STBIW__JPG_FIX_3_072711026  25172
+
+#ifdef STBIW_SSE2
+// rows in, columns out
+static void stbiw__jpg_transpose8(__m128i *r) {
+   __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+   __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+   __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+   __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+   __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+   __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+   __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+   __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+   r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+   r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+   r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+   r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+#define STBIW__JPG_K(k0, k1) _mm_set_epi16((short) (k1), (short) (k0), (short) (k1), (short) (k0), (short) (k1), (short) (k0), (short) (k1), (short) (k0))
+
+// a*k0 + b*k1 in 32 bits, for the low and high four lanes of an (a,b) pair
+#define STBIW__JPG_MADD(lo, hi, pl, ph, k) \
+   lo = _mm_madd_epi16(pl, k); \
+   hi = _mm_madd_epi16(ph, k)
+
+static __m128i stbiw__jpg_descale32(__m128i lo, __m128i hi, __m128i bias, __m128i shift) {
+   lo = _mm_sra_epi32(_mm_add_epi32(lo, bias), shift);
+   hi = _mm_sra_epi32(_mm_add_epi32(hi, bias), shift);
+   return _mm_packs_epi32(lo, hi);
+}
+
+// One 8-point pass across registers (each lane is a separate vector). Pass 1
+// shifts the DC/Nyquist terms up by 'up', pass 2 rounds them down by 'down';
+// the rotations are descaled by 'shift'.
+static void stbiw__jpg_fdct_pass_sse2(__m128i *d, int up, int down, int shift) {
+   __m128i tmp0 = _mm_add_epi16(d[0], d[7]), tmp7 = _mm_sub_epi16(d[0], d[7]);
+   __m128i tmp1 = _mm_add_epi16(d[1], d[6]), tmp6 = _mm_sub_epi16(d[1], d[6]);
+   __m128i tmp2 = _mm_add_epi16(d[2], d[5]), tmp5 = _mm_sub_epi16(d[2], d[5]);
+   __m128i tmp3 = _mm_add_epi16(d[3], d[4]), tmp4 = _mm_sub_epi16(d[3], d[4]);
+   __m128i tmp10 = _mm_add_epi16(tmp0, tmp3), tmp13 = _mm_sub_epi16(tmp0, tmp3);
+   __m128i tmp11 = _mm_add_epi16(tmp1, tmp2), tmp12 = _mm_sub_epi16(tmp1, tmp2);
+   __m128i z3 = _mm_add_epi16(tmp4, tmp6), z4 = _mm_add_epi16(tmp5, tmp7);
+   __m128i bias = _mm_set1_epi32(1 << (shift - 1)), sh = _mm_cvtsi32_si128(shift);
+   __m128i pl, ph, lo, hi, z3l, z3h, z4l, z4h;
+
+   if(down) {
+      __m128i b = _mm_set1_epi16((short) (1 << (down - 1))), s = _mm_cvtsi32_si128(down);
+      d[0] = _mm_sra_epi16(_mm_add_epi16(_mm_add_epi16(tmp10, tmp11), b), s);
+      d[4] = _mm_sra_epi16(_mm_add_epi16(_mm_sub_epi16(tmp10, tmp11), b), s);
+   } else {
+      __m128i u = _mm_cvtsi32_si128(up);
+      d[0] = _mm_sll_epi16(_mm_add_epi16(tmp10, tmp11), u);
+      d[4] = _mm_sll_epi16(_mm_sub_epi16(tmp10, tmp11), u);
+   }
+
+   pl = _mm_unpacklo_epi16(tmp13, tmp12); ph = _mm_unpackhi_epi16(tmp13, tmp12);
+   STBIW__JPG_MADD(lo, hi, pl, ph, STBIW__JPG_K(STBIW__JPG_FIX_0_541196100 + STBIW__JPG_FIX_0_765366865, STBIW__JPG_FIX_0_541196100));
+   d[2] = stbiw__jpg_descale32(lo, hi, bias, sh);
+   STBIW__JPG_MADD(lo, hi, pl, ph, STBIW__JPG_K(STBIW__JPG_FIX_0_541196100, STBIW__JPG_FIX_0_541196100 - STBIW__JPG_FIX_1_847759065));
+   d[6] = stbiw__jpg_descale32(lo, hi, bias, sh);
+
+   pl = _mm_unpacklo_epi16(z3, z4); ph = _mm_unpackhi_epi16(z3, z4);
+   STBIW__JPG_MADD(z3l, z3h, pl, ph, STBIW__JPG_K(STBIW__JPG_FIX_1_175875602 - STBIW__JPG_FIX_1_961570560, STBIW__JPG_FIX_1_175875602));
+   STBIW__JPG_MADD(z4l, z4h, pl, ph, STBIW__JPG_K(STBIW__JPG_FIX_1_175875602, STBIW__JPG_FIX_1_175875602 - STBIW__JPG_FIX_0_390180644));
+
+   pl = _mm_unpacklo_epi16(tmp4, tmp7); ph = _mm_unpackhi_epi16(tmp4, tmp7);
+   STBIW__JPG_MADD(lo, hi, pl, ph, STBIW__JPG_K(STBIW__JPG_FIX_0_298631336 - STBIW__JPG_FIX_0_899976223, -STBIW__JPG_FIX_0_899976223));
+   d[7] = stbiw__jpg_descale32(_mm_add_epi32(lo, z3l), _mm_add_epi32(hi, z3h), bias, sh);
+   STBIW__JPG_MADD(lo, hi, pl, ph, STBIW__JPG_K(-STBIW__JPG_FIX_0_899976223, STBIW__JPG_FIX_1_501321110 - STBIW__JPG_FIX_0_899976223));
+   d[1] = stbiw__jpg_descale32(_mm_add_epi32(lo, z4l), _mm_add_epi32(hi, z4h), bias, sh);
+
+   pl = _mm_unpacklo_epi16(tmp5, tmp6); ph = _mm_unpackhi_epi16(tmp5, tmp6);
+   STBIW__JPG_MADD(lo, hi, pl, ph, STBIW__JPG_K(STBIW__JPG_FIX_2_053119869 - STBIW__JPG_FIX_2_562915447, -STBIW__JPG_FIX_2_562915447));
+   d[5] = stbiw__jpg_descale32(_mm_add_epi32(lo, z4l), _mm_add_epi32(hi, z4h), bias, sh);
+   STBIW__JPG_MADD(lo, hi, pl, ph, STBIW__JPG_K(-STBIW__JPG_FIX_2_562915447, STBIW__JPG_FIX_3_072711026 - STBIW__JPG_FIX_2_562915447));
+   d[3] = stbiw__jpg_descale32(_mm_add_epi32(lo, z3l), _mm_add_epi32(hi, z3h), bias, sh);
+}
+
+static void stbiw__jpg_fdct_fixed(short *data) {
+   __m128i d[8];
+   int i;
+   for(i = 0; i < 8; ++i) d[i] = _mm_loadu_si128((const __m128i *) (data + i*8));
+   stbiw__jpg_transpose8(d);
+   stbiw__jpg_fdct_pass_sse2(d, STBIW__JPG_PASS1_BITS, 0, STBIW__JPG_CONST_BITS - STBIW__JPG_PASS1_BITS);
+   stbiw__jpg_transpose8(d);
+   stbiw__jpg_fdct_pass_sse2(d, 0, STBIW__JPG_PASS1_BITS + STBIW__JPG_SAMPLE_BITS, STBIW__JPG_CONST_BITS + STBIW__JPG_PASS1_BITS + STBIW__JPG_SAMPLE_BITS);
+   for(i = 0; i < 8; ++i) _mm_storeu_si128((__m128i *) (data + i*8), d[i]);
+}
+#else
+// Same arithmetic as stbiw__jpg_fdct_pass_sse2, one 8-point vector at d[0], d[step], ...
+static void stbiw__jpg_fdct_pass(short *d, int step, int up, int down, int shift) {
+   int tmp0 = d[0] + d[7*step], tmp7 = d[0] - d[7*step];
+   int tmp1 = d[step] + d[6*step], tmp6 = d[step] - d[6*step];
+   int tmp2 = d[2*step] + d[5*step], tmp5 = d[2*step] - d[5*step];
+   int tmp3 = d[3*step] + d[4*step], tmp4 = d[3*step] - d[4*step];
+   int tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+   int tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+   int z3 = tmp4 + tmp6, z4 = tmp5 + tmp7, bias = 1 << (shift - 1);
+   int z3r = z3 * (STBIW__JPG_FIX_1_175875602 - STBIW__JPG_FIX_1_961570560) + z4 * STBIW__JPG_FIX_1_175875602;
+   int z4r = z3 * STBIW__JPG_FIX_1_175875602 + z4 * (STBIW__JPG_FIX_1_175875602 - STBIW__JPG_FIX_0_390180644);
+
+   if(down) {
+      d[0]      = (short) ((tmp10 + tmp11 + (1 << (down - 1))) >> down);
+      d[4*step] = (short) ((tmp10 - tmp11 + (1 << (down - 1))) >> down);
+   } else {
+      d[0]      = (short) ((tmp10 + tmp11) * (1 << up));
+      d[4*step] = (short) ((tmp10 - tmp11) * (1 << up));
+   }
+   d[2*step] = (short) ((tmp13 * (STBIW__JPG_FIX_0_541196100 + STBIW__JPG_FIX_0_765366865) + tmp12 * STBIW__JPG_FIX_0_541196100 + bias) >> shift);
+   d[6*step] = (short) ((tmp13 * STBIW__JPG_FIX_0_541196100 + tmp12 * (STBIW__JPG_FIX_0_541196100 - STBIW__JPG_FIX_1_847759065) + bias) >> shift);
+
+   d[7*step] = (short) ((tmp4 * (STBIW__JPG_FIX_0_298631336 - STBIW__JPG_FIX_0_899976223) - tmp7 * STBIW__JPG_FIX_0_899976223 + z3r + bias) >> shift);
+   d[1*step] = (short) ((tmp7 * (STBIW__JPG_FIX_1_501321110 - STBIW__JPG_FIX_0_899976223) - tmp4 * STBIW__JPG_FIX_0_899976223 + z4r + bias) >> shift);
+   d[5*step] = (short) ((tmp5 * (STBIW__JPG_FIX_2_053119869 - STBIW__JPG_FIX_2_562915447) - tmp6 * STBIW__JPG_FIX_2_562915447 + z4r + bias) >> shift);
+   d[3*step] = (short) ((tmp6 * (STBIW__JPG_FIX_3_072711026 - STBIW__JPG_FIX_2_562915447) - tmp5 * STBIW__JPG_FIX_2_562915447 + z3r + bias) >> shift);
+}
+
+static void stbiw__jpg_fdct_fixed(short *data) {
+   int i;
+   for(i = 0; i < 8; ++i)
+      stbiw__jpg_fdct_pass(data + i*8, 1, STBIW__JPG_PASS1_BITS, 0, STBIW__JPG_CONST_BITS - STBIW__JPG_PASS1_BITS);
+   for(i = 0; i < 8; ++i)
+      stbiw__jpg_fdct_pass(data + i, 8, 0, STBIW__JPG_PASS1_BITS + STBIW__JPG_SAMPLE_BITS, STBIW__JPG_CONST_BITS + STBIW__JPG_PASS1_BITS + STBIW__JPG_SAMPLE_BITS);
+}
+#endif
 
-   // Encode DC
+// Divide by 'divisor' and round half away from zero with two 16x16->high-16
+// multiplies, as libjpeg-turbo's quantizer does: |x| + corr, times recip,
+// times scale. Exact for every |x| < 32768.
+static void stbiw__jpg_reciprocal(unsigned int divisor, unsigned short *recip, unsigned short *corr, unsigned short *scale) {
+   unsigned int fq, fr, c;
+   int b = 0, r;
+   while((2u << b) <= divisor) ++b;
+   r = 16 + b;
+   fq = (1u << r) / divisor;
+   fr = (1u << r) % divisor;
+   c = divisor / 2;
+   if(fr == 0) {
+      fq >>= 1;
+      --r;
+   } else if(fr <= divisor / 2) {
+      ++c;
+   } else {
+      ++fq;
+   }
+   *recip = (unsigned short) fq;
+   *corr = (unsigned short) c;
+   *scale = (unsigned short) (1u << (32 - r));
+}
+
+// Quantize one fixed-point DCT'd block (natural order); DU comes out in zigzag order
+static void stbiw__jpg_quantize_fixed(const short *coef, const unsigned short *recip, const unsigned short *corr, const unsigned short *scale, int DU[64]) {
+   short out[64];
+   int i;
+#ifdef STBIW_SSE2
+   for(i = 0; i < 64; i += 8) {
+      __m128i x = _mm_loadu_si128((const __m128i *) (coef + i));
+      __m128i sign = _mm_srai_epi16(x, 15);
+      __m128i a = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+      a = _mm_add_epi16(a, _mm_loadu_si128((const __m128i *) (corr + i)));
+      a = _mm_mulhi_epu16(a, _mm_loadu_si128((const __m128i *) (recip + i)));
+      a = _mm_mulhi_epu16(a, _mm_loadu_si128((const __m128i *) (scale + i)));
+      _mm_storeu_si128((__m128i *) (out + i), _mm_sub_epi16(_mm_xor_si128(a, sign), sign));
+   }
+#else
+   for(i = 0; i < 64; ++i) {
+      int x = coef[i];
+      unsigned int a = (unsigned int) (x < 0 ? -x : x);
+      a = ((((a + corr[i]) * recip[i]) >> 16) * scale[i]) >> 16;
+      out[i] = (short) (x < 0 ? -(int) a : (int) a);
+   }
+#endif
+   for(i = 0; i < 64; ++i)
+      DU[stbiw__jpg_ZigZag[i]] = out[i];
+}
+
+// Huffman-code one block of quantized coefficients (zigzag order) against
+// the previous DC value; returns this block's DC
+static int stbiw__jpg_encodeDU(stbiw__jpg_bits *b, const int *DU, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
+   int i, diff, end0pos;
+
+   // Encode DC; a symbol's code and the value bits after it go out together
    diff = DU[0] - DC;
    if (diff == 0) {
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, HTDC[0]);
+      stbiw__jpg_putBits(b, HTDC[0][0], HTDC[0][1]);
    } else {
       unsigned short bits[2];
       stbiw__jpg_calcBits(diff, bits);
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, HTDC[bits[1]]);
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, bits);
+      stbiw__jpg_putBits(b, ((unsigned int) HTDC[bits[1]][0] << bits[1]) | bits[0], HTDC[bits[1]][1] + bits[1]);
    }
    // Encode ACs
    end0pos = 63;
@@ -1368,7 +2481,7 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
    }
    // end0pos = first element in reverse order !=0
    if(end0pos == 0) {
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, EOB);
+      stbiw__jpg_putBits(b, HTAC[0x00][0], HTAC[0x00][1]);
       return DU[0];
    }
    for(i = 1; i <= end0pos; ++i) {
@@ -1382,101 +2495,54 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
          int lng = nrzeroes>>4;
          int nrmarker;
          for (nrmarker=1; nrmarker <= lng; ++nrmarker)
-            stbiw__jpg_writeBits(s, bitBuf, bitCnt, M16zeroes);
+            stbiw__jpg_putBits(b, HTAC[0xF0][0], HTAC[0xF0][1]);
          nrzeroes &= 15;
       }
       stbiw__jpg_calcBits(DU[i], bits);
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, HTAC[(nrzeroes<<4)+bits[1]]);
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, bits);
+      stbiw__jpg_putBits(b, ((unsigned int) HTAC[(nrzeroes<<4)+bits[1]][0] << bits[1]) | bits[0], HTAC[(nrzeroes<<4)+bits[1]][1] + bits[1]);
    }
    if(end0pos != 63) {
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, EOB);
+      stbiw__jpg_putBits(b, HTAC[0x00][0], HTAC[0x00][1]);
    }
    return DU[0];
 }
 
-static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int quality) {
-   // Constants that don't pollute global namespace
-   static const unsigned char std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
-   static const unsigned char std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
-   static const unsigned char std_ac_luminance_nrcodes[] = {0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
-   static const unsigned char std_ac_luminance_values[] = {
-      0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
-      0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
-      0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
-      0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
-      0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
-      0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
-      0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
-   };
-   static const unsigned char std_dc_chrominance_nrcodes[] = {0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
-   static const unsigned char std_dc_chrominance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
-   static const unsigned char std_ac_chrominance_nrcodes[] = {0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
-   static const unsigned char std_ac_chrominance_values[] = {
-      0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
-      0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
-      0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
-      0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
-      0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
-      0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
-      0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
-   };
-   // Huffman tables
-   static const unsigned short YDC_HT[256][2] = { {0,2},{2,3},{3,3},{4,3},{5,3},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9}};
-   static const unsigned short UVDC_HT[256][2] = { {0,2},{1,2},{2,2},{6,3},{14,4},{30,5},{62,6},{126,7},{254,8},{510,9},{1022,10},{2046,11}};
-   static const unsigned short YAC_HT[256][2] = {
-      {10,4},{0,2},{1,2},{4,3},{11,4},{26,5},{120,7},{248,8},{1014,10},{65410,16},{65411,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {12,4},{27,5},{121,7},{502,9},{2038,11},{65412,16},{65413,16},{65414,16},{65415,16},{65416,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {28,5},{249,8},{1015,10},{4084,12},{65417,16},{65418,16},{65419,16},{65420,16},{65421,16},{65422,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {58,6},{503,9},{4085,12},{65423,16},{65424,16},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {59,6},{1016,10},{65430,16},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {122,7},{2039,11},{65438,16},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {123,7},{4086,12},{65446,16},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {250,8},{4087,12},{65454,16},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {504,9},{32704,15},{65462,16},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {505,9},{65470,16},{65471,16},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {506,9},{65479,16},{65480,16},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {1017,10},{65488,16},{65489,16},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {1018,10},{65497,16},{65498,16},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {2040,11},{65506,16},{65507,16},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {65515,16},{65516,16},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {2041,11},{65525,16},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
-   };
-   static const unsigned short UVAC_HT[256][2] = {
-      {0,2},{1,2},{4,3},{10,4},{24,5},{25,5},{56,6},{120,7},{500,9},{1014,10},{4084,12},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {11,4},{57,6},{246,8},{501,9},{2038,11},{4085,12},{65416,16},{65417,16},{65418,16},{65419,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {26,5},{247,8},{1015,10},{4086,12},{32706,15},{65420,16},{65421,16},{65422,16},{65423,16},{65424,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {27,5},{248,8},{1016,10},{4087,12},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{65430,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {58,6},{502,9},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{65438,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {59,6},{1017,10},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{65446,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {121,7},{2039,11},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{65454,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {122,7},{2040,11},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{65462,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {249,8},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{65470,16},{65471,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {503,9},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{65479,16},{65480,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {504,9},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{65488,16},{65489,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {505,9},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{65497,16},{65498,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {506,9},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{65506,16},{65507,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {2041,11},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{65515,16},{65516,16},{0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {16352,14},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{65525,16},{0,0},{0,0},{0,0},{0,0},{0,0},
-      {1018,10},{32707,15},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},{0,0},{0,0},{0,0},{0,0},{0,0}
-   };
+// DHT segment with the four standard tables: 0 = luma, 1 = chroma
+static void stbiw__jpg_writeDHT(stbi__write_context *s, int chroma) {
+   const unsigned char head[] = { 0xFF,0xC4,(unsigned char)(chroma?0x01:0),(unsigned char)(chroma?0xA2:0xD2),0 }; // HTYDCinfo
+   s->func(s->context, (void*)head, sizeof(head));
+   s->func(s->context, (void*)(stbiw__jpg_std_dc_luminance_nrcodes+1), sizeof(stbiw__jpg_std_dc_luminance_nrcodes)-1);
+   s->func(s->context, (void*)stbiw__jpg_std_dc_luminance_values, sizeof(stbiw__jpg_std_dc_luminance_values));
+   stbiw__putc(s, 0x10); // HTYACinfo
+   s->func(s->context, (void*)(stbiw__jpg_std_ac_luminance_nrcodes+1), sizeof(stbiw__jpg_std_ac_luminance_nrcodes)-1);
+   s->func(s->context, (void*)stbiw__jpg_std_ac_luminance_values, sizeof(stbiw__jpg_std_ac_luminance_values));
+   if(!chroma) return;
+   stbiw__putc(s, 1); // HTUDCinfo
+   s->func(s->context, (void*)(stbiw__jpg_std_dc_chrominance_nrcodes+1), sizeof(stbiw__jpg_std_dc_chrominance_nrcodes)-1);
+   s->func(s->context, (void*)stbiw__jpg_std_dc_chrominance_values, sizeof(stbiw__jpg_std_dc_chrominance_values));
+   stbiw__putc(s, 0x11); // HTUACinfo
+   s->func(s->context, (void*)(stbiw__jpg_std_ac_chrominance_nrcodes+1), sizeof(stbiw__jpg_std_ac_chrominance_nrcodes)-1);
+   s->func(s->context, (void*)stbiw__jpg_std_ac_chrominance_values, sizeof(stbiw__jpg_std_ac_chrominance_values));
+}
+
+// Quantizer for one quality: the float multipliers for stbiw__jpg_quantizeDU
+// and the fixed-point reciprocals for stbiw__jpg_quantize_fixed.
+// [0] is luma, [1] chroma; natural order.
+typedef struct
+{
+   float fdtbl[2][64];
+   unsigned short recip[2][64], corr[2][64], scale[2][64];
+} stbiw__jpg_quant;
+
+// Quantization tables for a quality setting (1..100), zigzag order as they go
+// in the DQT segment, and the matching quantizer
+static void stbiw__jpg_tables(int quality, unsigned char YTable[64], unsigned char UVTable[64], stbiw__jpg_quant *q) {
    static const int YQT[] = {16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,18,22,
                              37,56,68,109,103,77,24,35,55,64,81,104,113,92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99};
    static const int UVQT[] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,
                               99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99};
-   static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
-                                 1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
+   int row, col, i, k;
 
-   int row, col, i, k, subsample;
-   float fdtbl_Y[64], fdtbl_UV[64];
-   unsigned char YTable[64], UVTable[64];
-
-   if(!data || !width || !height || comp > 4 || comp < 1) {
-      return 0;
-   }
-
-   quality = quality ? quality : 90;
-   subsample = quality <= 90 ? 1 : 0;
    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
    quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
 
@@ -1489,135 +2555,1286 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
 
    for(row = 0, k = 0; row < 8; ++row) {
       for(col = 0; col < 8; ++col, ++k) {
-         fdtbl_Y[k]  = 1 / (YTable [stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
-         fdtbl_UV[k] = 1 / (UVTable[stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+         q->fdtbl[0][k] = 1 / (YTable [stbiw__jpg_ZigZag[k]] * stbiw__jpg_aasf[row] * stbiw__jpg_aasf[col]);
+         q->fdtbl[1][k] = 1 / (UVTable[stbiw__jpg_ZigZag[k]] * stbiw__jpg_aasf[row] * stbiw__jpg_aasf[col]);
+         // the integer DCT's output is 8x too big
+         stbiw__jpg_reciprocal(YTable [stbiw__jpg_ZigZag[k]] * 8, &q->recip[0][k], &q->corr[0][k], &q->scale[0][k]);
+         stbiw__jpg_reciprocal(UVTable[stbiw__jpg_ZigZag[k]] * 8, &q->recip[1][k], &q->corr[1][k], &q->scale[1][k]);
       }
    }
+}
 
-   // Write Headers
-   {
-      static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
-      static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
-      const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,(unsigned char)(height>>8),STBIW_UCHAR(height),(unsigned char)(width>>8),STBIW_UCHAR(width),
-                                      3,1,(unsigned char)(subsample?0x22:0x11),0,2,0x11,1,3,0x11,1,0xFF,0xC4,0x01,0xA2,0 };
-      s->func(s->context, (void*)head0, sizeof(head0));
-      s->func(s->context, (void*)YTable, sizeof(YTable));
+// MCU size in pixels for a subsampling mode
+#define STBIW__JPG_MCU_W(mode) ((mode) == STBIW_JPG_444 ? 8 : 16)
+#define STBIW__JPG_MCU_H(mode) ((mode) == STBIW_JPG_420 ? 16 : 8)
+
+// Headers with width and height left at 0. Grey images are a single Y
+// component, with only the luma tables.
+static void stbiw__jpg_writeHeaders(stbi__write_context *s, int gray, int subsample, const unsigned char *YTable, const unsigned char *UVTable) {
+   static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
+   static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
+   static const unsigned char head2gray[] = { 0xFF,0xDA,0,0x8,1,1,0,0,0x3F,0 };
+   const unsigned char head1[] = { 0xFF,0xC0,0,(unsigned char)(gray?0xB:0x11),8,0,0,0,0,
+                                   (unsigned char)(gray?1:3),1,(unsigned char)((STBIW__JPG_MCU_W(subsample)/8 << 4) | STBIW__JPG_MCU_H(subsample)/8),0,2,0x11,1,3,0x11,1 };
+   s->func(s->context, (void*)head0, sizeof(head0) - 2);
+   stbiw__putc(s, gray ? 0x43 : 0x84);
+   stbiw__putc(s, 0);
+   s->func(s->context, (void*)YTable, 64);
+   if(!gray) {
       stbiw__putc(s, 1);
-      s->func(s->context, UVTable, sizeof(UVTable));
-      s->func(s->context, (void*)head1, sizeof(head1));
-      s->func(s->context, (void*)(std_dc_luminance_nrcodes+1), sizeof(std_dc_luminance_nrcodes)-1);
-      s->func(s->context, (void*)std_dc_luminance_values, sizeof(std_dc_luminance_values));
-      stbiw__putc(s, 0x10); // HTYACinfo
-      s->func(s->context, (void*)(std_ac_luminance_nrcodes+1), sizeof(std_ac_luminance_nrcodes)-1);
-      s->func(s->context, (void*)std_ac_luminance_values, sizeof(std_ac_luminance_values));
-      stbiw__putc(s, 1); // HTUDCinfo
-      s->func(s->context, (void*)(std_dc_chrominance_nrcodes+1), sizeof(std_dc_chrominance_nrcodes)-1);
-      s->func(s->context, (void*)std_dc_chrominance_values, sizeof(std_dc_chrominance_values));
-      stbiw__putc(s, 0x11); // HTUACinfo
-      s->func(s->context, (void*)(std_ac_chrominance_nrcodes+1), sizeof(std_ac_chrominance_nrcodes)-1);
-      s->func(s->context, (void*)std_ac_chrominance_values, sizeof(std_ac_chrominance_values));
+      s->func(s->context, (void*)UVTable, 64);
+   }
+   s->func(s->context, (void*)head1, gray ? 13 : sizeof(head1));
+   stbiw__jpg_writeDHT(s, !gray);
+   if(gray)
+      s->func(s->context, (void*)head2gray, sizeof(head2gray));
+   else
       s->func(s->context, (void*)head2, sizeof(head2));
+}
+
+// SOI through SOS (APP0, DQT, SOF0, DHT, SOS) for colour and for grey
+// images, where their SOF0 segments start (19 and 13 bytes) and where the
+// height and width sit in those
+#define STBIW__JPG_HEADER_SIZE 607
+#define STBIW__JPG_HEADER_SOF  154
+#define STBIW__JPG_GRAY_SIZE   324
+#define STBIW__JPG_GRAY_SOF    89
+#define STBIW__JPG_SOF_DIMS    5
+
+struct stbi_write_jpg_encoder
+{
+   stbiw__jpg_quant q;
+   int subsample;   // STBIW_JPG_444, _420 or _422
+   unsigned char header[STBIW__JPG_HEADER_SIZE];  // dimensions left at 0
+   unsigned char gray[STBIW__JPG_GRAY_SIZE];
+};
+
+typedef struct
+{
+   unsigned char *data;
+   int used, size;
+} stbiw__jpg_header_sink;
+
+static void stbiw__jpg_header_write(void *context, void *data, int size)
+{
+   stbiw__jpg_header_sink *h = (stbiw__jpg_header_sink *) context;
+   if(h->used + size <= h->size)
+      memcpy(h->data + h->used, data, size);
+   h->used += size;
+}
+
+// What stbi_write_jpg does by default: 4:2:0 up to quality 90, 4:4:4 above
+static int stbiw__jpg_subsampling(int mode, int quality) {
+   if(mode == STBIW_JPG_444 || mode == STBIW_JPG_420 || mode == STBIW_JPG_422) return mode;
+   return (quality ? quality : 90) <= 90 ? STBIW_JPG_420 : STBIW_JPG_444;
+}
+
+// Any other positive 'subsample' is 4:2:0 (it used to be a flag)
+static void stbiw__jpg_encoder_init(stbi_write_jpg_encoder *e, int quality, int subsample) {
+   unsigned char YTable[64], UVTable[64];
+   stbiw__jpg_header_sink sink;
+   stbi__write_context s = { 0 };
+   s.func = stbiw__jpg_header_write;
+   s.context = &sink;
+   e->subsample = subsample > 0 && subsample != STBIW_JPG_422 ? STBIW_JPG_420 : stbiw__jpg_subsampling(subsample, quality);
+   stbiw__jpg_tables(quality ? quality : 90, YTable, UVTable, &e->q);
+
+   sink.data = e->header;
+   sink.used = 0;
+   sink.size = STBIW__JPG_HEADER_SIZE;
+   stbiw__jpg_writeHeaders(&s, 0, e->subsample, YTable, UVTable);
+   STBIW_ASSERT(sink.used == STBIW__JPG_HEADER_SIZE);
+
+   sink.data = e->gray;
+   sink.used = 0;
+   sink.size = STBIW__JPG_GRAY_SIZE;
+   stbiw__jpg_writeHeaders(&s, 1, STBIW_JPG_444, YTable, UVTable);
+   STBIW_ASSERT(sink.used == STBIW__JPG_GRAY_SIZE);
+}
+
+// Header of an image through its frame header (SOF0, or SOF2 if
+// progressive) into 'out'; returns the size. Everything the template has
+// after the frame header follows at that offset.
+static int stbiw__jpg_frameHeader(const stbi_write_jpg_encoder *e, int gray, int progressive, int width, int height, unsigned char *out) {
+   int sof = gray ? STBIW__JPG_GRAY_SOF : STBIW__JPG_HEADER_SOF;
+   int len = sof + (gray ? 13 : 19);
+   memcpy(out, gray ? e->gray : e->header, len);
+   if(progressive) out[sof+1] = 0xC2;
+   out[sof+STBIW__JPG_SOF_DIMS+0] = (unsigned char) (height >> 8);
+   out[sof+STBIW__JPG_SOF_DIMS+1] = STBIW_UCHAR(height);
+   out[sof+STBIW__JPG_SOF_DIMS+2] = (unsigned char) (width >> 8);
+   out[sof+STBIW__JPG_SOF_DIMS+3] = STBIW_UCHAR(width);
+   return len;
+}
+
+// The pixels being encoded. comp == 2 is grey+alpha (alpha is ignored);
+// grey images are written as a single Y component.
+typedef struct
+{
+   const unsigned char *data;
+   int width, height, comp, flip, fixed;
+} stbiw__jpg_source;
+
+// Offset of pixel (col,row) of the image, repeating the last row and column
+// past the edges
+static int stbiw__jpg_pixel(const stbiw__jpg_source *src, int col, int row) {
+   // row >= height => use last input row
+   int clamped_row = (row < src->height) ? row : src->height - 1;
+   int base_p = (src->flip ? (src->height-1-clamped_row) : clamped_row)*src->width*src->comp;
+   // if col >= width => use pixel from last input column
+   return base_p + ((col < src->width) ? col : (src->width-1))*src->comp;
+}
+
+// Colour-convert the w x h pixels at (x,y); grey images (U == NULL) only
+// give Y
+static void stbiw__jpg_loadMCU(const stbiw__jpg_source *src, int x, int y, int w, int h, float *Y, float *U, float *V) {
+   int ofsG = src->comp > 2 ? 1 : 0, ofsB = src->comp > 2 ? 2 : 0;
+   const unsigned char *dataR = src->data;
+   const unsigned char *dataG = dataR + ofsG;
+   const unsigned char *dataB = dataR + ofsB;
+   int row, col, pos;
+   if(!U) {
+      for(row = y, pos = 0; row < y+h; ++row)
+         for(col = x; col < x+w; ++col, ++pos)
+            Y[pos] = dataR[stbiw__jpg_pixel(src, col, row)] - 128.0f;
+      return;
+   }
+   for(row = y, pos = 0; row < y+h; ++row) {
+      for(col = x; col < x+w; ++col, ++pos) {
+         int p = stbiw__jpg_pixel(src, col, row);
+         float r = dataR[p], g = dataG[p], b = dataB[p];
+         Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
+         U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
+         V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
+      }
    }
+}
+
+// The same in fixed point for stbiw__jpg_fdct_fixed: the colour matrix in
+// 16.16, pre-scaled by 1 << STBIW__JPG_SAMPLE_BITS (each row sums to 0 or 4.0
+// exactly), so samples come out with that many fractional bits
+static void stbiw__jpg_loadMCU_fixed(const stbiw__jpg_source *src, int x, int y, int w, int h, short *Y, short *U, short *V) {
+   int ofsG = src->comp > 2 ? 1 : 0, ofsB = src->comp > 2 ? 2 : 0;
+   const unsigned char *dataR = src->data;
+   const unsigned char *dataG = dataR + ofsG;
+   const unsigned char *dataB = dataR + ofsB;
+   int row, col, pos;
+   if(!U) {
+      for(row = y, pos = 0; row < y+h; ++row)
+         for(col = x; col < x+w; ++col, ++pos)
+            Y[pos] = (short) ((dataR[stbiw__jpg_pixel(src, col, row)] - 128) * (1 << STBIW__JPG_SAMPLE_BITS));
+      return;
+   }
+   for(row = y, pos = 0; row < y+h; ++row) {
+      for(col = x; col < x+w; ++col, ++pos) {
+         int p = stbiw__jpg_pixel(src, col, row);
+         int r = dataR[p], g = dataG[p], b = dataB[p];
+         Y[pos] = (short) ((( 78381*r + 153879*g + 29884*b + 32768) >> 16) - (128 << STBIW__JPG_SAMPLE_BITS));
+         U[pos] = (short) ((-44234*r - 86838*g + 131072*b + 32768) >> 16);
+         V[pos] = (short) ((131072*r - 109757*g - 21315*b + 32768) >> 16);
+      }
+   }
+}
+
+// Box filter of 16-wide chroma down to one 8x8 block: 2x2 (4:2:0, 16 rows
+// in) when 'tall', else 2x1 (4:2:2, 8 rows in). The SSE2 version adds in
+// the same order as the scalar one, so both give the same floats.
+static void stbiw__jpg_subsample(const float *in, int tall, float *out) {
+   int yy, xx, step = tall ? 32 : 16;
+#ifdef STBIW_SSE2
+   __m128 quarter = _mm_set1_ps(0.25f), half = _mm_set1_ps(0.5f);
+   for(yy = 0; yy < 8; ++yy, in += step, out += 8) {
+      for(xx = 0; xx < 8; xx += 4) {
+         __m128 a = _mm_loadu_ps(in + xx*2), b = _mm_loadu_ps(in + xx*2 + 4);
+         __m128 sum = _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1)));
+         if(tall) {
+            a = _mm_loadu_ps(in + 16 + xx*2);
+            b = _mm_loadu_ps(in + 16 + xx*2 + 4);
+            sum = _mm_add_ps(sum, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0)));
+            sum = _mm_add_ps(sum, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1)));
+            _mm_storeu_ps(out + xx, _mm_mul_ps(sum, quarter));
+         } else {
+            _mm_storeu_ps(out + xx, _mm_mul_ps(sum, half));
+         }
+      }
+   }
+#else
+   for(yy = 0; yy < 8; ++yy, in += step, out += 8) {
+      for(xx = 0; xx < 8; ++xx) {
+         const float *p = in + xx*2;
+         out[xx] = tall ? (p[0] + p[1] + p[16] + p[17]) * 0.25f : (p[0] + p[1]) * 0.5f;
+      }
+   }
+#endif
+}
+
+static void stbiw__jpg_subsample_fixed(const short *in, int tall, short *out) {
+   int yy, step = tall ? 32 : 16;
+#ifdef STBIW_SSE2
+   // pmaddwd against 1s adds each horizontal pair into 32 bits
+   __m128i ones = _mm_set1_epi16(1), round = _mm_set1_epi32(tall ? 2 : 1);
+   for(yy = 0; yy < 8; ++yy, in += step, out += 8) {
+      __m128i lo = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) in), ones);
+      __m128i hi = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (in + 8)), ones);
+      if(tall) {
+         lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (in + 16)), ones));
+         hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (in + 24)), ones));
+         lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 2);
+         hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 2);
+      } else {
+         lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 1);
+         hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 1);
+      }
+      _mm_storeu_si128((__m128i *) out, _mm_packs_epi32(lo, hi));
+   }
+#else
+   int xx;
+   for(yy = 0; yy < 8; ++yy, in += step, out += 8) {
+      for(xx = 0; xx < 8; ++xx) {
+         const short *p = in + xx*2;
+         out[xx] = (short) (tall ? (p[0] + p[1] + p[16] + p[17] + 2) >> 2 : (p[0] + p[1] + 1) >> 1);
+      }
+   }
+#endif
+}
+
+// One DCT'd 8x8 block from either pipeline, natural order
+typedef union
+{
+   float f[64];
+   short i[64];
+} stbiw__jpg_block;
+
+// Colour-convert the w x h area (8 or 16 each way) at (x,y) and DCT its
+// blocks: the luma blocks into Y (row by row, up to 4), and when asked
+//   sub  - the 2x2-subsampled Cb, Cr (w = h = 16)
+//   half - the 2x1-subsampled Cb, Cr of each 8 rows (w = 16): Cb, Cr, Cb, Cr
+//   full - the full-resolution ones (Cb blocks, then Cr)
+// Grey images only fill Y.
+static void stbiw__jpg_dctArea(const stbiw__jpg_source *src, int x, int y, int w, int h, stbiw__jpg_block *Y,
+                               stbiw__jpg_block *sub, stbiw__jpg_block *half, stbiw__jpg_block *full) {
+   int n = w / 8, blocks = n * (h / 8), b, r, row, chroma = src->comp > 2;
+   if(!chroma) sub = half = full = NULL;
+   if(src->fixed) {
+      short Yp[256], Up[256], Vp[256];
+      stbiw__jpg_loadMCU_fixed(src, x, y, w, h, Yp, chroma ? Up : NULL, Vp);
+      for(b = 0; b < blocks; ++b) {
+         int ofs = (b / n) * 8 * w + (b % n) * 8;
+         for(row = 0; row < 8; ++row) {
+            memcpy(Y[b].i + row*8, Yp + ofs + row*w, 8 * sizeof(short));
+            if(full) {
+               memcpy(full[b].i + row*8, Up + ofs + row*w, 8 * sizeof(short));
+               memcpy(full[blocks+b].i + row*8, Vp + ofs + row*w, 8 * sizeof(short));
+            }
+         }
+         stbiw__jpg_fdct_fixed(Y[b].i);
+         if(full) {
+            stbiw__jpg_fdct_fixed(full[b].i);
+            stbiw__jpg_fdct_fixed(full[blocks+b].i);
+         }
+      }
+      if(sub) {
+         stbiw__jpg_subsample_fixed(Up, 1, sub[0].i);
+         stbiw__jpg_subsample_fixed(Vp, 1, sub[1].i);
+         stbiw__jpg_fdct_fixed(sub[0].i);
+         stbiw__jpg_fdct_fixed(sub[1].i);
+      }
+      for(r = 0; half && r < h / 8; ++r) {
+         stbiw__jpg_subsample_fixed(Up + r*128, 0, half[2*r].i);
+         stbiw__jpg_subsample_fixed(Vp + r*128, 0, half[2*r+1].i);
+         stbiw__jpg_fdct_fixed(half[2*r].i);
+         stbiw__jpg_fdct_fixed(half[2*r+1].i);
+      }
+   } else {
+      float Yp[256], Up[256], Vp[256];
+      stbiw__jpg_loadMCU(src, x, y, w, h, Yp, chroma ? Up : NULL, Vp);
+      for(b = 0; b < blocks; ++b) {
+         int ofs = (b / n) * 8 * w + (b % n) * 8;
+         for(row = 0; row < 8; ++row) {
+            memcpy(Y[b].f + row*8, Yp + ofs + row*w, 8 * sizeof(float));
+            if(full) {
+               memcpy(full[b].f + row*8, Up + ofs + row*w, 8 * sizeof(float));
+               memcpy(full[blocks+b].f + row*8, Vp + ofs + row*w, 8 * sizeof(float));
+            }
+         }
+         stbiw__jpg_fdctDU(Y[b].f, 8);
+         if(full) {
+            stbiw__jpg_fdctDU(full[b].f, 8);
+            stbiw__jpg_fdctDU(full[blocks+b].f, 8);
+         }
+      }
+      if(sub) {
+         stbiw__jpg_subsample(Up, 1, sub[0].f);
+         stbiw__jpg_subsample(Vp, 1, sub[1].f);
+         stbiw__jpg_fdctDU(sub[0].f, 8);
+         stbiw__jpg_fdctDU(sub[1].f, 8);
+      }
+      for(r = 0; half && r < h / 8; ++r) {
+         stbiw__jpg_subsample(Up + r*128, 0, half[2*r].f);
+         stbiw__jpg_subsample(Vp + r*128, 0, half[2*r+1].f);
+         stbiw__jpg_fdctDU(half[2*r].f, 8);
+         stbiw__jpg_fdctDU(half[2*r+1].f, 8);
+      }
+   }
+}
+
+// One JPEG being written: its encoder, DC predictors and bit buffer
+typedef struct
+{
+   stbi__write_context *s;
+   const stbi_write_jpg_encoder *e;
+   int fixed, DC[3];
+   stbiw__jpg_bits bits;
+} stbiw__jpg_stream;
+
+// 'fixed' says which member of the blocks is filled in
+static void stbiw__jpg_begin(stbiw__jpg_stream *o, stbi__write_context *s, const stbi_write_jpg_encoder *e, int width, int height, int fixed, int gray) {
+   unsigned char header[STBIW__JPG_HEADER_SIZE];
+   int size = gray ? STBIW__JPG_GRAY_SIZE : STBIW__JPG_HEADER_SIZE;
+   int n = stbiw__jpg_frameHeader(e, gray, 0, width, height, header);
+   o->s = s;
+   o->e = e;
+   o->fixed = fixed;
+   o->DC[0] = o->DC[1] = o->DC[2] = 0;
+   memcpy(header + n, (gray ? e->gray : e->header) + n, size - n);
+   s->func(s->context, header, size);
+   stbiw__jpg_bitsStart(&o->bits, s);
+}
+
+// Quantize a DCT'd block with table t (0 = luma); DU comes out in zigzag order
+static void stbiw__jpg_quantizeBlock(const stbi_write_jpg_encoder *e, int fixed, const stbiw__jpg_block *b, int t, int DU[64]) {
+   const stbiw__jpg_quant *q = &e->q;
+   if(fixed)
+      stbiw__jpg_quantize_fixed(b->i, q->recip[t], q->corr[t], q->scale[t], DU);
+   else
+      stbiw__jpg_quantizeDU(b->f, 8, q->fdtbl[t], DU);
+}
+
+// Quantize and code one DCT'd block of component i (0 = Y)
+static void stbiw__jpg_streamDU(stbiw__jpg_stream *o, const stbiw__jpg_block *b, int i) {
+   int DU[64], t = i ? 1 : 0;
+   stbiw__jpg_quantizeBlock(o->e, o->fixed, b, t, DU);
+   o->DC[i] = stbiw__jpg_encodeDU(&o->bits, DU, o->DC[i],
+                                 t ? stbiw__jpg_UVDC_HT : stbiw__jpg_YDC_HT, t ? stbiw__jpg_UVAC_HT : stbiw__jpg_YAC_HT);
+}
+
+static void stbiw__jpg_end(stbiw__jpg_stream *o) {
+   // Do the bit alignment of the EOI marker
+   stbiw__jpg_bitsEnd(&o->bits);
+   stbiw__putc(o->s, 0xFF);
+   stbiw__putc(o->s, 0xD9);
+}
+
+static int stbi_write_jpg_encode_core(stbi__write_context *s, const stbi_write_jpg_encoder *e, int width, int height, int comp, const void* data) {
+   stbiw__jpg_stream o;
+   stbiw__jpg_source src;
+   int x, y;
+
+   if(!e || !data || !width || !height || comp > 4 || comp < 1) {
+      return 0;
+   }
+
+   src.data = (const unsigned char *) data;
+   src.width = width;
+   src.height = height;
+   src.comp = comp;
+   src.flip = s->settings.flip_vertically;
+   src.fixed = s->settings.jpg_fixed_point;
+   stbiw__jpg_begin(&o, s, e, width, height, src.fixed, comp <= 2);
 
    // Encode 8x8 macroblocks
-   {
-      static const unsigned short fillBits[] = {0x7F, 7};
-      int DCY=0, DCU=0, DCV=0;
-      int bitBuf=0, bitCnt=0;
-      // comp == 2 is grey+alpha (alpha is ignored)
-      int ofsG = comp > 2 ? 1 : 0, ofsB = comp > 2 ? 2 : 0;
-      const unsigned char *dataR = (const unsigned char *)data;
-      const unsigned char *dataG = dataR + ofsG;
-      const unsigned char *dataB = dataR + ofsB;
-      int x, y, pos;
-      if(subsample) {
-         for(y = 0; y < height; y += 16) {
-            for(x = 0; x < width; x += 16) {
-               float Y[256], U[256], V[256];
-               for(row = y, pos = 0; row < y+16; ++row) {
-                  // row >= height => use last input row
-                  int clamped_row = (row < height) ? row : height - 1;
-                  int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
-                  for(col = x; col < x+16; ++col, ++pos) {
-                     // if col >= width => use pixel from last input column
-                     int p = base_p + ((col < width) ? col : (width-1))*comp;
-                     float r = dataR[p], g = dataG[p], b = dataB[p];
-                     Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
-                     U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
-                     V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
+   if(comp <= 2) {
+      for(y = 0; y < height; y += 8) {
+         for(x = 0; x < width; x += 8) {
+            stbiw__jpg_block Y;
+            stbiw__jpg_dctArea(&src, x, y, 8, 8, &Y, NULL, NULL, NULL);
+            stbiw__jpg_streamDU(&o, &Y, 0);
+         }
+      }
+   } else {
+      int mw = STBIW__JPG_MCU_W(e->subsample), mh = STBIW__JPG_MCU_H(e->subsample), nY = (mw / 8) * (mh / 8), b;
+      for(y = 0; y < height; y += mh) {
+         for(x = 0; x < width; x += mw) {
+            stbiw__jpg_block Y[4], UV[2];
+            stbiw__jpg_dctArea(&src, x, y, mw, mh, Y,
+                               e->subsample == STBIW_JPG_420 ? UV : NULL,
+                               e->subsample == STBIW_JPG_422 ? UV : NULL,
+                               e->subsample == STBIW_JPG_444 ? UV : NULL);
+            for(b = 0; b < nY; ++b)
+               stbiw__jpg_streamDU(&o, &Y[b], 0);
+            stbiw__jpg_streamDU(&o, &UV[0], 1);
+            stbiw__jpg_streamDU(&o, &UV[1], 2);
+         }
+      }
+   }
+
+   stbiw__jpg_end(&o);
+   return 1;
+}
+
+static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int quality) {
+   stbi_write_jpg_encoder e;
+   stbiw__jpg_encoder_init(&e, quality, stbiw__jpg_subsampling(s->settings.jpg_subsampling, quality));
+   return stbi_write_jpg_encode_core(s, &e, width, height, comp, data);
+}
+
+STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality)
+{
+   stbi__write_context s = { 0 };
+   stbi__start_write_callbacks(&s, func, context);
+   return stbi_write_jpg_core(&s, x, y, comp, (void *) data, quality);
+}
+
+// Works in 16-pixel stripes. Subsampled outputs take each 16x16 MCU as it is
+// produced; the others code the stripe's two rows of 8x8 MCUs at its end.
+// The Y blocks are the same in both layouts and are only transformed once.
+static int stbi_write_jpg_multi_core(stbi__write_context *s, const int *qualities, int count, int width, int height, int comp, const void *data) {
+   stbiw__jpg_stream *out;
+   stbi_write_jpg_encoder *enc;
+   stbiw__jpg_source src;
+   // Outputs whose MCUs are 8 rows high wait for the whole 16-row stripe:
+   stbiw__jpg_block *stripe = NULL;   // 4:4:4: [row][8x8 column][Y,Cb,Cr]
+   stbiw__jpg_block *stripe2 = NULL;  // 4:2:2: [row][16x8 column][Y,Y,Cb,Cr]
+   int any[3] = { 0, 0, 0 };          // by mode
+   int mcus_x = (width + 15) / 16, x, y, n, r, bx, i;
+
+   if(count <= 0 || !data || width <= 0 || height <= 0 || comp > 4 || comp < 1) {
+      return 0;
+   }
+   out = (stbiw__jpg_stream *) STBIW_MALLOC(count * (sizeof(*out) + sizeof(*enc)));
+   if(!out) return 0;
+   enc = (stbi_write_jpg_encoder *) (out + count);
+   src.data = (const unsigned char *) data;
+   src.width = width;
+   src.height = height;
+   src.comp = comp;
+   src.flip = s[0].settings.flip_vertically;
+   src.fixed = s[0].settings.jpg_fixed_point;
+   for(n = 0; n < count; ++n) {
+      stbiw__jpg_encoder_init(&enc[n], qualities[n], stbiw__jpg_subsampling(s[n].settings.jpg_subsampling, qualities[n]));
+      any[enc[n].subsample] = 1;
+   }
+   if(comp > 2) {
+      if(any[STBIW_JPG_444])
+         stripe = (stbiw__jpg_block *) STBIW_MALLOC((size_t) 2 * mcus_x * 2 * 3 * sizeof(*stripe));
+      if(any[STBIW_JPG_422])
+         stripe2 = (stbiw__jpg_block *) STBIW_MALLOC((size_t) 2 * mcus_x * 4 * sizeof(*stripe2));
+      if((any[STBIW_JPG_444] && !stripe) || (any[STBIW_JPG_422] && !stripe2)) {
+         STBIW_FREE(stripe2);
+         STBIW_FREE(stripe);
+         STBIW_FREE(out);
+         return 0;
+      }
+   }
+   for(n = 0; n < count; ++n)
+      stbiw__jpg_begin(&out[n], &s[n], &enc[n], width, height, src.fixed, comp <= 2);
+
+   if(comp <= 2) {
+      // grey: every quality takes the same single Y block per MCU
+      for(y = 0; y < height; y += 8) {
+         for(x = 0; x < width; x += 8) {
+            stbiw__jpg_block Y;
+            stbiw__jpg_dctArea(&src, x, y, 8, 8, &Y, NULL, NULL, NULL);
+            for(n = 0; n < count; ++n)
+               stbiw__jpg_streamDU(&out[n], &Y, 0);
+         }
+      }
+   } else {
+      for(y = 0; y < height; y += 16) {
+         for(x = 0; x < width; x += 16) {
+            stbiw__jpg_block Y[4], sub[2], half[4], full[8];
+            int b;
+            stbiw__jpg_dctArea(&src, x, y, 16, 16, Y, any[STBIW_JPG_420] ? sub : NULL,
+                               any[STBIW_JPG_422] ? half : NULL, any[STBIW_JPG_444] ? full : NULL);
+            for(n = 0; n < count; ++n) {
+               if(enc[n].subsample != STBIW_JPG_420) continue;
+               for(b = 0; b < 4; ++b)
+                  stbiw__jpg_streamDU(&out[n], &Y[b], 0);
+               stbiw__jpg_streamDU(&out[n], &sub[0], 1);
+               stbiw__jpg_streamDU(&out[n], &sub[1], 2);
+            }
+            if(stripe) {
+               for(b = 0; b < 4; ++b) {
+                  stbiw__jpg_block *dst = stripe + (size_t) ((b >> 1) * mcus_x * 2 + x / 8 + (b & 1)) * 3;
+                  dst[0] = Y[b];
+                  dst[1] = full[b];
+                  dst[2] = full[4+b];
+               }
+            }
+            if(stripe2) {
+               for(r = 0; r < 2; ++r) {
+                  stbiw__jpg_block *dst = stripe2 + (size_t) (r * mcus_x + x / 16) * 4;
+                  dst[0] = Y[2*r];
+                  dst[1] = Y[2*r+1];
+                  dst[2] = half[2*r];
+                  dst[3] = half[2*r+1];
+               }
+            }
+         }
+         // the stripe's blocks past the right or bottom edge are padding only
+         for(n = 0; n < count; ++n) {
+            if(enc[n].subsample == STBIW_JPG_444) {
+               for(r = 0; r < 2 && y + r*8 < height; ++r) {
+                  for(bx = 0; bx*8 < width; ++bx) {
+                     const stbiw__jpg_block *blk = stripe + (size_t) (r * mcus_x * 2 + bx) * 3;
+                     for(i = 0; i < 3; ++i)
+                        stbiw__jpg_streamDU(&out[n], &blk[i], i);
                   }
                }
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+0,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+8,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+128, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+136, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-
-               // subsample U,V
-               {
-                  float subU[64], subV[64];
-                  int yy, xx;
-                  for(yy = 0, pos = 0; yy < 8; ++yy) {
-                     for(xx = 0; xx < 8; ++xx, ++pos) {
-                        int j = yy*32+xx*2;
-                        subU[pos] = (U[j+0] + U[j+1] + U[j+16] + U[j+17]) * 0.25f;
-                        subV[pos] = (V[j+0] + V[j+1] + V[j+16] + V[j+17]) * 0.25f;
-                     }
+            } else if(enc[n].subsample == STBIW_JPG_422) {
+               for(r = 0; r < 2 && y + r*8 < height; ++r) {
+                  for(bx = 0; bx < mcus_x; ++bx) {
+                     const stbiw__jpg_block *blk = stripe2 + (size_t) (r * mcus_x + bx) * 4;
+                     for(i = 0; i < 4; ++i)
+                        stbiw__jpg_streamDU(&out[n], &blk[i], i < 2 ? 0 : i - 1);
                   }
-                  DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subU, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-                  DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subV, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
                }
             }
          }
-      } else {
-         for(y = 0; y < height; y += 8) {
-            for(x = 0; x < width; x += 8) {
-               float Y[64], U[64], V[64];
-               for(row = y, pos = 0; row < y+8; ++row) {
-                  // row >= height => use last input row
-                  int clamped_row = (row < height) ? row : height - 1;
-                  int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
-                  for(col = x; col < x+8; ++col, ++pos) {
-                     // if col >= width => use pixel from last input column
-                     int p = base_p + ((col < width) ? col : (width-1))*comp;
-                     float r = dataR[p], g = dataG[p], b = dataB[p];
-                     Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
-                     U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
-                     V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
+      }
+   }
+
+   for(n = 0; n < count; ++n)
+      stbiw__jpg_end(&out[n]);
+   STBIW_FREE(stripe2);
+   STBIW_FREE(stripe);
+   STBIW_FREE(out);
+   return 1;
+}
+
+STBIWDEF int stbi_write_jpg_multi_to_func(const stbi_write_jpg_output *outputs, int count, int x, int y, int comp, const void *data)
+{
+   stbi__write_context *s;
+   int *qualities;
+   int n, r;
+
+   if(!outputs || count <= 0) return 0;
+   s = (stbi__write_context *) STBIW_MALLOC(count * (sizeof(*s) + sizeof(int)));
+   if(!s) return 0;
+   qualities = (int *) (s + count);
+   for(n = 0; n < count; ++n) {
+      stbi__start_write_callbacks(&s[n], outputs[n].func, outputs[n].context);
+      qualities[n] = outputs[n].quality;
+   }
+   r = stbi_write_jpg_multi_core(s, qualities, count, x, y, comp, data);
+   STBIW_FREE(s);
+   return r;
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const void *data, int quality)
+{
+   stbi__write_context s = { 0 };
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbi_write_jpg_core(&s, x, y, comp, data, quality);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+
+STBIWDEF int stbi_write_jpg_multi(char const * const *filenames, const int *qualities, int count, int x, int y, int comp, const void *data)
+{
+   stbi__write_context *s;
+   int n, opened, r = 0;
+
+   if(!filenames || !qualities || count <= 0) return 0;
+   s = (stbi__write_context *) STBIW_MALLOC(count * sizeof(*s));
+   if(!s) return 0;
+   for(opened = 0; opened < count; ++opened) {
+      if(!stbi__start_write_file(&s[opened], filenames[opened])) break;
+   }
+   if(opened == count)
+      r = stbi_write_jpg_multi_core(s, qualities, count, x, y, comp, data);
+   for(n = 0; n < opened; ++n)
+      stbi__end_write_file(&s[n]);
+   STBIW_FREE(s);
+   return r;
+}
+#endif
+
+STBIWDEF stbi_write_jpg_encoder *stbi_write_jpg_encoder_create(int quality, int subsample)
+{
+   stbi_write_jpg_encoder *e = (stbi_write_jpg_encoder *) STBIW_MALLOC(sizeof(*e));
+   if(e) stbiw__jpg_encoder_init(e, quality, subsample);
+   return e;
+}
+
+STBIWDEF void stbi_write_jpg_encoder_free(stbi_write_jpg_encoder *enc)
+{
+   STBIW_FREE(enc);
+}
+
+STBIWDEF int stbi_write_jpg_encoder_to_func(stbi_write_func *func, void *context, const stbi_write_jpg_encoder *enc, int x, int y, int comp, const void *data)
+{
+   stbi__write_context s = { 0 };
+   stbi__start_write_callbacks(&s, func, context);
+   return stbi_write_jpg_encode_core(&s, enc, x, y, comp, data);
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_jpg_with_encoder(char const *filename, const stbi_write_jpg_encoder *enc, int x, int y, int comp, const void *data)
+{
+   stbi__write_context s = { 0 };
+   if(!enc) return 0;
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbi_write_jpg_encode_core(&s, enc, x, y, comp, data);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+#endif
+
+// ---- Progressive JPEG ----
+
+// Every quantized block of the image, kept for the scans to go over
+typedef struct
+{
+   short *coef[3];     // per component: 64 shorts per block in zigzag order, rows of bw[i]
+   int bw[3], bh[3];   // blocks per row and column, MCU padding included
+   int nw[3], nh[3];   // the blocks a single-component scan codes
+   int mh, mv;         // luma blocks per MCU across and down: 2 when chroma is halved that way
+   int ncomp;          // 1 for grey, else 3
+} stbiw__jpg_coefs;
+
+// Each scan runs twice: first symbols are only counted to build the scan's
+// Huffman tables, then they are coded with them. Everything else (EOB runs,
+// correction bits) goes the same way both times, so the counts match.
+typedef struct
+{
+   stbiw__jpg_bits *bits;          // NULL while counting
+   int freq[2][257];
+   unsigned short ht[2][256][2];   // {code, length} per symbol
+   int eobrun, be;                 // blocks in the pending EOB run, and its correction bits
+   unsigned char corr[1000];
+} stbiw__jpg_prog;
+
+// Floor of v / 2^n
+static int stbiw__jpg_shr(int v, int n) {
+   return v < 0 ? ~(~v >> n) : v >> n;
+}
+
+static void stbiw__jpg_progSymbol(stbiw__jpg_prog *p, int t, int sym) {
+   if(p->bits)
+      stbiw__jpg_putBits(p->bits, p->ht[t][sym][0], p->ht[t][sym][1]);
+   else
+      ++p->freq[t][sym];
+}
+
+static void stbiw__jpg_progBits(stbiw__jpg_prog *p, unsigned int v, int n) {
+   if(p->bits && n)
+      stbiw__jpg_putBits(p->bits, v & ((1u << n) - 1), n);
+}
+
+static void stbiw__jpg_progCorr(stbiw__jpg_prog *p, const unsigned char *c, int n) {
+   if(p->bits)
+      while(n-- > 0) stbiw__jpg_putBits(p->bits, *c++, 1);
+}
+
+static void stbiw__jpg_progEOBRun(stbiw__jpg_prog *p) {
+   if(p->eobrun > 0) {
+      int nbits = 0, t = p->eobrun;
+      while(t >>= 1) ++nbits;
+      stbiw__jpg_progSymbol(p, 0, nbits << 4);
+      stbiw__jpg_progBits(p, (unsigned int) p->eobrun, nbits);
+      p->eobrun = 0;
+      stbiw__jpg_progCorr(p, p->corr, p->be);
+      p->be = 0;
+   }
+}
+
+static void stbiw__jpg_progDCFirst(stbiw__jpg_prog *p, const short *b, int t, int *last, int Al) {
+   int v = stbiw__jpg_shr(b[0], Al), diff = v - *last;
+   *last = v;
+   if(diff == 0) {
+      stbiw__jpg_progSymbol(p, t, 0);
+   } else {
+      unsigned short bits[2];
+      stbiw__jpg_calcBits(diff, bits);
+      stbiw__jpg_progSymbol(p, t, bits[1]);
+      stbiw__jpg_progBits(p, bits[0], bits[1]);
+   }
+}
+
+static void stbiw__jpg_progACFirst(stbiw__jpg_prog *p, const short *b, int Ss, int Se, int Al) {
+   int k, r = 0;
+   for(k = Ss; k <= Se; ++k) {
+      unsigned short bits[2];
+      int v = b[k];
+      v = v < 0 ? -(-v >> Al) : v >> Al;
+      if(v == 0) {
+         ++r;
+         continue;
+      }
+      stbiw__jpg_progEOBRun(p);
+      for(; r > 15; r -= 16)
+         stbiw__jpg_progSymbol(p, 0, 0xF0);
+      stbiw__jpg_calcBits(v, bits);
+      stbiw__jpg_progSymbol(p, 0, (r << 4) + bits[1]);
+      stbiw__jpg_progBits(p, bits[0], bits[1]);
+      r = 0;
+   }
+   if(r > 0 && ++p->eobrun == 0x7FFF)
+      stbiw__jpg_progEOBRun(p);
+}
+
+// Refinement of the AC band: one more bit of every coefficient. Ones that
+// become nonzero are coded like first-scan values of magnitude 1; the others
+// just send their bit, held back until the next symbol (or the EOB run) they
+// belong to.
+static void stbiw__jpg_progACRefine(stbiw__jpg_prog *p, const short *b, int Ss, int Se, int Al) {
+   int absv[64], k, r = 0, eob = 0, br = 0;
+   unsigned char *corr = p->corr + p->be;
+
+   for(k = Ss; k <= Se; ++k) {
+      int v = b[k];
+      absv[k] = (v < 0 ? -v : v) >> Al;
+      if(absv[k] == 1) eob = k;   // last newly nonzero coefficient
+   }
+   for(k = Ss; k <= Se; ++k) {
+      if(absv[k] == 0) {
+         ++r;
+         continue;
+      }
+      // ZRLs, unless the run can go into the EOB
+      while(r > 15 && k <= eob) {
+         stbiw__jpg_progEOBRun(p);
+         stbiw__jpg_progSymbol(p, 0, 0xF0);
+         r -= 16;
+         stbiw__jpg_progCorr(p, corr, br);
+         corr = p->corr;
+         br = 0;
+      }
+      if(absv[k] > 1) {
+         corr[br++] = (unsigned char) (absv[k] & 1);
+         continue;
+      }
+      stbiw__jpg_progEOBRun(p);
+      stbiw__jpg_progSymbol(p, 0, (r << 4) + 1);
+      stbiw__jpg_progBits(p, b[k] < 0 ? 0 : 1, 1);
+      stbiw__jpg_progCorr(p, corr, br);
+      corr = p->corr;
+      br = 0;
+      r = 0;
+   }
+   if(r > 0 || br > 0) {
+      ++p->eobrun;
+      p->be += br;
+      if(p->eobrun == 0x7FFF || p->be > (int) sizeof(p->corr) - 64)
+         stbiw__jpg_progEOBRun(p);
+   }
+}
+
+// One pass over a scan's blocks. Ss == 0 is a DC scan of all components,
+// interleaved in MCUs; otherwise the AC band Ss..Se of component ci.
+static void stbiw__jpg_progPass(stbiw__jpg_prog *p, const stbiw__jpg_coefs *c, int ci, int Ss, int Se, int Ah, int Al) {
+   int x, y, i, bx, by;
+   p->eobrun = p->be = 0;
+   if(Ss == 0) {
+      int last[3] = { 0, 0, 0 };
+      // the chroma block grid is the MCU grid
+      for(y = 0; y < c->bh[1]; ++y) {
+         for(x = 0; x < c->bw[1]; ++x) {
+            for(i = 0; i < c->ncomp; ++i) {
+               int nh = i ? 1 : c->mh, nv = i ? 1 : c->mv;
+               for(by = 0; by < nv; ++by) {
+                  for(bx = 0; bx < nh; ++bx) {
+                     const short *b = c->coef[i] + ((size_t) (y*nv + by) * c->bw[i] + x*nh + bx) * 64;
+                     if(Ah)
+                        stbiw__jpg_progBits(p, (unsigned int) stbiw__jpg_shr(b[0], Al), 1);
+                     else
+                        stbiw__jpg_progDCFirst(p, b, i ? 1 : 0, &last[i], Al);
                   }
                }
-
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y, 8, fdtbl_Y,  DCY, YDC_HT, YAC_HT);
-               DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, U, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-               DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, V, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
             }
          }
       }
+   } else {
+      for(y = 0; y < c->nh[ci]; ++y) {
+         for(x = 0; x < c->nw[ci]; ++x) {
+            const short *b = c->coef[ci] + ((size_t) y * c->bw[ci] + x) * 64;
+            if(Ah)
+               stbiw__jpg_progACRefine(p, b, Ss, Se, Al);
+            else
+               stbiw__jpg_progACFirst(p, b, Ss, Se, Al);
+         }
+      }
+   }
+   stbiw__jpg_progEOBRun(p);
+}
 
-      // Do the bit alignment of the EOI marker
-      stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, fillBits);
+// Code lengths from symbol counts, at most 16 bits (JPEG spec K.2, the way
+// libjpeg's jpeg_gen_optimal_table does it). Symbol 256 holds back one code
+// point so no code is all 1s. Fills counts[1..16] and vals; returns how
+// many symbols there are.
+static int stbiw__jpg_huffLengths(int freq[257], unsigned char counts[17], unsigned char vals[256]) {
+   int codesize[257], others[257], bits[33];
+   int i, j, n = 0;
+
+   memset(codesize, 0, sizeof(codesize));
+   memset(bits, 0, sizeof(bits));
+   for(i = 0; i < 257; ++i) others[i] = -1;
+   freq[256] = 1;
+
+   for(;;) {
+      // the two least frequent; ties go to the higher symbol
+      int c1 = -1, c2 = -1, v = 0x7FFFFFFF;
+      for(i = 0; i <= 256; ++i)
+         if(freq[i] && freq[i] <= v) { v = freq[i]; c1 = i; }
+      v = 0x7FFFFFFF;
+      for(i = 0; i <= 256; ++i)
+         if(freq[i] && freq[i] <= v && i != c1) { v = freq[i]; c2 = i; }
+      if(c2 < 0) break;
+
+      freq[c1] += freq[c2];
+      freq[c2] = 0;
+      ++codesize[c1];
+      while(others[c1] >= 0) {
+         c1 = others[c1];
+         ++codesize[c1];
+      }
+      others[c1] = c2;
+      ++codesize[c2];
+      while(others[c2] >= 0) {
+         c2 = others[c2];
+         ++codesize[c2];
+      }
+   }
+
+   for(i = 0; i <= 256; ++i)
+      if(codesize[i]) ++bits[codesize[i] > 32 ? 32 : codesize[i]];
+   // move codes longer than 16 bits up the tree
+   for(i = 32; i > 16; --i) {
+      while(bits[i] > 0) {
+         j = i - 2;
+         while(bits[j] == 0) --j;
+         bits[i] -= 2;
+         ++bits[i-1];
+         bits[j+1] += 2;
+         --bits[j];
+      }
+   }
+   // drop the reserved code point, which is the longest
+   for(i = 16; bits[i] == 0; --i) {
+   }
+   --bits[i];
+
+   for(i = 1; i <= 16; ++i) counts[i] = (unsigned char) bits[i];
+   for(i = 1; i <= 32; ++i)
+      for(j = 0; j < 256; ++j)
+         if(codesize[j] == i) vals[n++] = (unsigned char) j;
+   return n;
+}
+
+// Build table t from this scan's counts and write it as DHT (class 0 = DC, 1 = AC)
+static void stbiw__jpg_progTable(stbi__write_context *s, stbiw__jpg_prog *p, int t, int cls) {
+   unsigned char counts[17], vals[256], head[5];
+   int n = stbiw__jpg_huffLengths(p->freq[t], counts, vals), len, i, k = 0;
+   unsigned int code = 0;
+
+   for(len = 1; len <= 16; ++len, code <<= 1) {
+      for(i = 0; i < counts[len]; ++i, ++k) {
+         p->ht[t][vals[k]][0] = (unsigned short) code++;
+         p->ht[t][vals[k]][1] = (unsigned short) len;
+      }
+   }
+   len = 2 + 1 + 16 + n;
+   head[0] = 0xFF; head[1] = 0xC4;
+   head[2] = (unsigned char) (len >> 8); head[3] = STBIW_UCHAR(len);
+   head[4] = (unsigned char) ((cls << 4) | t);
+   s->func(s->context, head, 5);
+   s->func(s->context, counts + 1, 16);
+   s->func(s->context, vals, n);
+}
+
+static void stbiw__jpg_progScan(stbi__write_context *s, stbiw__jpg_prog *p, const stbiw__jpg_coefs *c, int ci, int Ss, int Se, int Ah, int Al) {
+   stbiw__jpg_bits bits;
+   unsigned char sos[14];
+   int i, n = 0, ncomp = Ss ? 1 : c->ncomp;
+
+   // DC refinement is plain bits; everything else needs this scan's tables
+   if(Ss || !Ah) {
+      memset(p->freq, 0, sizeof(p->freq));
+      p->bits = NULL;
+      stbiw__jpg_progPass(p, c, ci, Ss, Se, Ah, Al);
+      stbiw__jpg_progTable(s, p, 0, Ss ? 1 : 0);
+      if(!Ss && c->ncomp > 1) stbiw__jpg_progTable(s, p, 1, 0);
+   }
+
+   sos[n++] = 0xFF; sos[n++] = 0xDA;
+   sos[n++] = 0; sos[n++] = (unsigned char) (6 + 2 * ncomp);
+   sos[n++] = (unsigned char) ncomp;
+   for(i = 0; i < ncomp; ++i) {
+      int id = Ss ? ci : i;
+      sos[n++] = (unsigned char) (id + 1);
+      sos[n++] = (unsigned char) (!Ss && id ? 0x10 : 0x00);   // DC scans: table 1 for chroma
+   }
+   sos[n++] = (unsigned char) Ss;
+   sos[n++] = (unsigned char) Se;
+   sos[n++] = (unsigned char) ((Ah << 4) | Al);
+   s->func(s->context, sos, n);
+
+   stbiw__jpg_bitsStart(&bits, s);
+   p->bits = &bits;
+   stbiw__jpg_progPass(p, c, ci, Ss, Se, Ah, Al);
+   stbiw__jpg_bitsEnd(&bits);
+}
+
+static int stbi_write_jpg_progressive_core(stbi__write_context *s, int width, int height, int comp, const void *data, int quality)
+{
+   // {component (-1 = all, DC), Ss, Se, Ah, Al}: luma first and finest,
+   // chroma in two scans each, the largest scan (luma's last bit) at the end.
+   // Grey images skip the chroma scans.
+   static const signed char script[10][5] = {
+      { -1, 0,  0, 0, 1 }, { 0, 1,  5, 0, 2 }, { 2, 1, 63, 0, 1 }, { 1, 1, 63, 0, 1 }, { 0, 6, 63, 0, 2 },
+      {  0, 1, 63, 2, 1 }, { -1, 0, 0, 1, 0 }, { 2, 1, 63, 1, 0 }, { 1, 1, 63, 1, 0 }, { 0, 1, 63, 1, 0 } };
+   stbi_write_jpg_encoder e;
+   stbiw__jpg_source src;
+   stbiw__jpg_coefs c;
+   stbiw__jpg_prog *p;
+   unsigned char header[STBIW__JPG_HEADER_SOF + 19];
+   size_t nY, nC;
+   int x, y, i, k, mw, mh, gray = comp <= 2;
+
+   if(!data || width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF || comp > 4 || comp < 1) {
+      return 0;
+   }
+   src.data = (const unsigned char *) data;
+   src.width = width;
+   src.height = height;
+   src.comp = comp;
+   src.flip = s->settings.flip_vertically;
+   src.fixed = s->settings.jpg_fixed_point;
+   stbiw__jpg_encoder_init(&e, quality, stbiw__jpg_subsampling(s->settings.jpg_subsampling, quality));
+
+   mw = gray ? 8 : STBIW__JPG_MCU_W(e.subsample);
+   mh = gray ? 8 : STBIW__JPG_MCU_H(e.subsample);
+   c.mh = mw / 8;
+   c.mv = mh / 8;
+   c.ncomp = gray ? 1 : 3;
+   c.bw[1] = c.bw[2] = (width + mw - 1) / mw;
+   c.bh[1] = c.bh[2] = (height + mh - 1) / mh;
+   c.bw[0] = c.bw[1] * c.mh;
+   c.bh[0] = c.bh[1] * c.mv;
+   c.nw[0] = (width + 7) / 8;
+   c.nh[0] = (height + 7) / 8;
+   c.nw[1] = c.nw[2] = ((width + c.mh - 1) / c.mh + 7) / 8;
+   c.nh[1] = c.nh[2] = ((height + c.mv - 1) / c.mv + 7) / 8;
+   nY = (size_t) c.bw[0] * c.bh[0];
+   nC = gray ? 0 : (size_t) c.bw[1] * c.bh[1];
+
+   // one allocation: the coder state, then the blocks
+   p = (stbiw__jpg_prog *) STBIW_MALLOC(sizeof(*p) + (nY + 2 * nC) * 64 * sizeof(short));
+   if(!p) return 0;
+   c.coef[0] = (short *) (p + 1);
+   c.coef[1] = c.coef[0] + nY * 64;
+   c.coef[2] = c.coef[1] + nC * 64;
+
+   for(y = 0; y < c.bh[1]; ++y) {
+      for(x = 0; x < c.bw[1]; ++x) {
+         stbiw__jpg_block Y[4], UV[2];
+         const stbiw__jpg_block *blk[6];
+         short *dst[6];
+         int nb = c.mh * c.mv;
+         stbiw__jpg_dctArea(&src, x * mw, y * mh, mw, mh, Y,
+                            e.subsample == STBIW_JPG_420 ? UV : NULL,
+                            e.subsample == STBIW_JPG_422 ? UV : NULL,
+                            e.subsample == STBIW_JPG_444 ? UV : NULL);
+         for(i = 0; i < nb; ++i) {
+            blk[i] = &Y[i];
+            dst[i] = c.coef[0] + ((size_t) (y * c.mv + i / c.mh) * c.bw[0] + x * c.mh + i % c.mh) * 64;
+         }
+         if(!gray) {
+            blk[nb] = &UV[0];
+            blk[nb+1] = &UV[1];
+            dst[nb] = c.coef[1] + ((size_t) y * c.bw[1] + x) * 64;
+            dst[nb+1] = c.coef[2] + ((size_t) y * c.bw[2] + x) * 64;
+            nb += 2;
+         }
+         for(i = 0; i < nb; ++i) {
+            int DU[64];
+            stbiw__jpg_quantizeBlock(&e, src.fixed, blk[i], i < c.mh * c.mv ? 0 : 1, DU);
+            for(k = 0; k < 64; ++k) dst[i][k] = (short) DU[k];
+         }
+      }
+   }
+
+   // APP0, DQT and the frame header from the template, as SOF2
+   s->func(s->context, header, stbiw__jpg_frameHeader(&e, gray, 1, width, height, header));
+
+   for(i = 0; i < 10; ++i)
+      if(!gray || script[i][0] <= 0)
+         stbiw__jpg_progScan(s, p, &c, script[i][0], script[i][1], script[i][2], script[i][3], script[i][4]);
+
+   stbiw__putc(s, 0xFF);
+   stbiw__putc(s, 0xD9);
+   STBIW_FREE(p);
+   return 1;
+}
+
+STBIWDEF int stbi_write_jpg_progressive_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality)
+{
+   stbi__write_context s = { 0 };
+   stbi__start_write_callbacks(&s, func, context);
+   return stbi_write_jpg_progressive_core(&s, x, y, comp, data, quality);
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_jpg_progressive(char const *filename, int x, int y, int comp, const void *data, int quality)
+{
+   stbi__write_context s = { 0 };
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbi_write_jpg_progressive_core(&s, x, y, comp, data, quality);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+#endif
+
+STBIWDEF void stbi_write_jpg_quantize_block(const float samples[64], const unsigned short quant[64], short out[64])
+{
+   float CDU[64], fdtbl[64];
+   int DU[64];
+   int row, col, k;
+   for(row = 0, k = 0; row < 8; ++row) {
+      for(col = 0; col < 8; ++col, ++k) {
+         CDU[k] = samples[k];
+         fdtbl[k] = 1 / (quant[k] * stbiw__jpg_aasf[row] * stbiw__jpg_aasf[col]);
+      }
+   }
+   stbiw__jpg_fdctDU(CDU, 8);
+   stbiw__jpg_quantizeDU(CDU, 8, fdtbl, DU);
+   for(k = 0; k < 64; ++k)
+      out[k] = (short) DU[stbiw__jpg_ZigZag[k]];
+}
+
+static int stbi_write_jpg_coefficients_core(stbi__write_context *s, int width, int height, int comp, const stbi_write_jpg_component *c)
+{
+   static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0 };
+   int i, k, sixteen = 0, hmax = 1, vmax = 1;
+   int DC[3] = { 0, 0, 0 };
+   stbiw__jpg_bits bits;
+
+   if(!c || width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF || (comp != 1 && comp != 3)) {
+      return 0;
+   }
+   for(i = 0; i < comp; ++i) {
+      if(!c[i].coeff || !c[i].quant || c[i].h < 1 || c[i].h > 4 || c[i].v < 1 || c[i].v > 4) return 0;
+      for(k = 0; k < 64; ++k) {
+         if(c[i].quant[k] == 0) return 0;
+         if(c[i].quant[k] > 255) sixteen = 1;
+      }
+      if(c[i].h > hmax) hmax = c[i].h;
+      if(c[i].v > vmax) vmax = c[i].v;
+   }
+   if(comp == 1) hmax = vmax = 1; // a single component is never interleaved
+
+   // Headers: one quantization table per component, 16-bit ones need SOF1
+   s->func(s->context, (void*)head0, sizeof(head0));
+   for(i = 0; i < comp; ++i) {
+      int len = 2 + 1 + 64 * (sixteen ? 2 : 1);
+      unsigned short zz[64];
+      stbiw__putc(s, 0xFF); stbiw__putc(s, 0xDB);
+      stbiw__putc(s, (unsigned char) (len >> 8)); stbiw__putc(s, STBIW_UCHAR(len));
+      stbiw__putc(s, (unsigned char) ((sixteen << 4) | i));
+      for(k = 0; k < 64; ++k)
+         zz[stbiw__jpg_ZigZag[k]] = c[i].quant[k];
+      for(k = 0; k < 64; ++k) {
+         if(sixteen) stbiw__putc(s, (unsigned char) (zz[k] >> 8));
+         stbiw__putc(s, STBIW_UCHAR(zz[k]));
+      }
+   }
+   {
+      int len = 8 + 3 * comp;
+      const unsigned char sof[] = { 0xFF,(unsigned char)(sixteen ? 0xC1 : 0xC0),(unsigned char)(len>>8),STBIW_UCHAR(len),8,
+                                    (unsigned char)(height>>8),STBIW_UCHAR(height),(unsigned char)(width>>8),STBIW_UCHAR(width),(unsigned char)comp };
+      s->func(s->context, (void*)sof, sizeof(sof));
+      for(i = 0; i < comp; ++i) {
+         stbiw__putc(s, (unsigned char) (i+1));
+         stbiw__putc(s, (unsigned char) (comp == 1 ? 0x11 : (c[i].h << 4) | c[i].v));
+         stbiw__putc(s, (unsigned char) i);
+      }
+   }
+   stbiw__jpg_writeDHT(s, 1);
+   {
+      int len = 6 + 2 * comp;
+      stbiw__putc(s, 0xFF); stbiw__putc(s, 0xDA);
+      stbiw__putc(s, (unsigned char) (len >> 8)); stbiw__putc(s, STBIW_UCHAR(len));
+      stbiw__putc(s, (unsigned char) comp);
+      for(i = 0; i < comp; ++i) {
+         stbiw__putc(s, (unsigned char) (i+1));
+         stbiw__putc(s, (unsigned char) (i ? 0x11 : 0x00));
+      }
+      stbiw__putc(s, 0); stbiw__putc(s, 0x3F); stbiw__putc(s, 0);
+   }
+
+   // Entropy-code the blocks in MCU order
+   stbiw__jpg_bitsStart(&bits, s);
+   {
+      int mcux = (width  + 8*hmax - 1) / (8*hmax);
+      int mcuy = (height + 8*vmax - 1) / (8*vmax);
+      int mx, my, bx, by;
+      for(my = 0; my < mcuy; ++my) {
+         for(mx = 0; mx < mcux; ++mx) {
+            for(i = 0; i < comp; ++i) {
+               int bh = comp == 1 ? 1 : c[i].h, bv = comp == 1 ? 1 : c[i].v;
+               for(by = 0; by < bv; ++by) {
+                  for(bx = 0; bx < bh; ++bx) {
+                     const short *b = c[i].coeff + 64 * ((size_t)(my*bv + by) * c[i].blocks_w + mx*bh + bx);
+                     int DU[64];
+                     for(k = 0; k < 64; ++k) {
+                        // the standard tables stop at 10 bits for AC (11 for DC differences)
+                        int v = b[k];
+                        DU[stbiw__jpg_ZigZag[k]] = v < -1023 ? -1023 : v > 1023 ? 1023 : v;
+                     }
+                     DC[i] = stbiw__jpg_encodeDU(&bits, DU, DC[i],
+                                                 i ? stbiw__jpg_UVDC_HT : stbiw__jpg_YDC_HT, i ? stbiw__jpg_UVAC_HT : stbiw__jpg_YAC_HT);
+                  }
+               }
+            }
+         }
+      }
+      stbiw__jpg_bitsEnd(&bits);
    }
 
    // EOI
    stbiw__putc(s, 0xFF);
    stbiw__putc(s, 0xD9);
+   return 1;
+}
+
+STBIWDEF int stbi_write_jpg_coefficients_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const stbi_write_jpg_component *components)
+{
+   stbi__write_context s = { 0 };
+   stbi__start_write_callbacks(&s, func, context);
+   return stbi_write_jpg_coefficients_core(&s, w, h, comp, components);
+}
 
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_jpg_coefficients(char const *filename, int w, int h, int comp, const stbi_write_jpg_component *components)
+{
+   stbi__write_context s = { 0 };
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbi_write_jpg_coefficients_core(&s, w, h, comp, components);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+#endif
+
+struct stbi_write_jpg_cache
+{
+   int width, height, subsample, fixed, gray;
+   int blocks;                // per MCU: the Y blocks (4, 2 or 1), then Cb and Cr unless grey
+   size_t mcus;
+   stbiw__jpg_block *coeff;   // mcus * blocks DCT'd blocks, MCU order
+};
+
+STBIWDEF stbi_write_jpg_cache *stbi_write_jpg_cache_create(int w, int h, int comp, const void *data, int subsample)
+{
+   stbi_write_jpg_cache *c;
+   stbi_write_settings settings;
+   stbiw__jpg_source src;
+   int mw, mh, x, y;
+   size_t mcus;
+   stbiw__jpg_block *out;
+
+   if(!data || w <= 0 || h <= 0 || w > 0xFFFF || h > 0xFFFF || comp > 4 || comp < 1) {
+      return NULL;
+   }
+   // any other non-zero 'subsample' is 4:2:0 (it used to be a flag)
+   subsample = comp <= 2 ? STBIW_JPG_444 : subsample == STBIW_JPG_422 ? STBIW_JPG_422 : subsample ? STBIW_JPG_420 : STBIW_JPG_444;
+   mw = STBIW__JPG_MCU_W(subsample);
+   mh = STBIW__JPG_MCU_H(subsample);
+   mcus = (size_t) ((w + mw - 1) / mw) * ((h + mh - 1) / mh);
+   // one allocation: the blocks follow the header
+   c = (stbi_write_jpg_cache *) STBIW_MALLOC(sizeof(*c) + mcus * ((mw / 8) * (mh / 8) + (comp <= 2 ? 0 : 2)) * sizeof(stbiw__jpg_block));
+   if(!c) return NULL;
+   stbi_write_get_settings(&settings);
+   src.data = (const unsigned char *) data;
+   src.width = w;
+   src.height = h;
+   src.comp = comp;
+   src.flip = settings.flip_vertically;
+   src.fixed = settings.jpg_fixed_point;
+   c->width = w;
+   c->height = h;
+   c->subsample = subsample;
+   c->fixed = src.fixed;
+   c->gray = comp <= 2;
+   c->blocks = (mw / 8) * (mh / 8) + (c->gray ? 0 : 2);
+   c->mcus = mcus;
+   c->coeff = (stbiw__jpg_block *) (c + 1);
+
+   // Same blocks as stbi_write_jpg_core produces, stored in coding order
+   out = c->coeff;
+   for(y = 0; y < h; y += mh) {
+      for(x = 0; x < w; x += mw) {
+         stbiw__jpg_block *uv = out + (mw / 8) * (mh / 8);
+         stbiw__jpg_dctArea(&src, x, y, mw, mh, out,
+                            subsample == STBIW_JPG_420 ? uv : NULL,
+                            subsample == STBIW_JPG_422 ? uv : NULL,
+                            subsample == STBIW_JPG_444 ? uv : NULL);
+         out += c->blocks;
+      }
+   }
+   return c;
+}
+
+STBIWDEF void stbi_write_jpg_cache_free(stbi_write_jpg_cache *cache)
+{
+   STBIW_FREE(cache);
+}
+
+static int stbi_write_jpg_cache_core(stbi__write_context *s, const stbi_write_jpg_cache *c, int quality)
+{
+   stbiw__jpg_stream o;
+   stbi_write_jpg_encoder e;
+   int nY = c->blocks - 2, b;
+   const stbiw__jpg_block *in = c->coeff;
+   size_t m;
+
+   stbiw__jpg_encoder_init(&e, quality, c->subsample);
+   stbiw__jpg_begin(&o, s, &e, c->width, c->height, c->fixed, c->gray);
+   for(m = 0; m < c->mcus; ++m) {
+      for(b = 0; b < c->blocks; ++b, ++in)
+         stbiw__jpg_streamDU(&o, in, c->gray || b < nY ? 0 : b - nY + 1);
+   }
+   stbiw__jpg_end(&o);
    return 1;
 }
 
-STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality)
+STBIWDEF int stbi_write_jpg_cache_to_func(stbi_write_func *func, void *context, const stbi_write_jpg_cache *cache, int quality)
 {
    stbi__write_context s = { 0 };
+   if(!cache) return 0;
    stbi__start_write_callbacks(&s, func, context);
-   return stbi_write_jpg_core(&s, x, y, comp, (void *) data, quality);
+   return stbi_write_jpg_cache_core(&s, cache, quality);
+}
+
+static void stbiw__count_bytes(void *context, void *data, int size)
+{
+   (void) data;
+   *(size_t *) context += size;
 }
 
+STBIWDEF size_t stbi_write_jpg_cache_size(const stbi_write_jpg_cache *cache, int quality)
+{
+   size_t bytes = 0;
+   if(!stbi_write_jpg_cache_to_func(stbiw__count_bytes, &bytes, cache, quality)) return 0;
+   return bytes;
+}
 
 #ifndef STBI_WRITE_NO_STDIO
-STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const void *data, int quality)
+STBIWDEF int stbi_write_jpg_from_cache(char const *filename, const stbi_write_jpg_cache *cache, int quality)
 {
    stbi__write_context s = { 0 };
+   if(!cache) return 0;
    if (stbi__start_write_file(&s,filename)) {
-      int r = stbi_write_jpg_core(&s, x, y, comp, data, quality);
+      int r = stbi_write_jpg_cache_core(&s, cache, quality);
       stbi__end_write_file(&s);
       return r;
    } else
@@ -0,0 +1,23 @@
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include "stb_image_write.h"
+
+// How the 8x8 block groups (MCUs) of the picture were handled
+typedef struct {
+    int kept;       // no background: coefficients copied unchanged
+    int filled;     // all background: replaced by a flat target-color block
+    int reencoded;  // both: repainted and run through the DCT again
+} TranscodeStats;
+
+// JPEG in, JPEG out, working on the DCT coefficients instead of pixels.
+// Blocks without background keep their original coefficients (and quantization
+// tables), so the subject comes through with no generation loss.
+// The new file goes out through 'func' (as with stbi_write_jpg_to_func).
+// Returns 1 when it was written, 0 when the input is not a grayscale or
+// YCbCr JPEG and the caller should use the pixel path; nothing has been
+// written then.
+int transcode_jpeg(const unsigned char *file, int file_len, stbi_write_func *func, void *context, double threshold,
+                   TranscodeStats *stats);
+
+#endif
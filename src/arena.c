@@ -0,0 +1,274 @@
+#include "../include/arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Smallest block we ask the system for
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+// Requests this big are malloc'd one by one (see Large), so freeing them
+// gives the memory back instead of leaving a hole in a block
+#define ARENA_LARGE_SIZE (ARENA_BLOCK_SIZE / 4)
+
+// Every pointer handed out is 16-byte aligned (SSE loads in stb_image).
+#define ARENA_ALIGN 16
+#define ROUND_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+#if defined(_MSC_VER)
+#define ARENA_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define ARENA_THREAD_LOCAL __thread
+#else
+#define ARENA_THREAD_LOCAL _Thread_local
+#endif
+
+typedef struct Block {
+    struct Block *next;
+    size_t size;  // usable bytes after the header
+    size_t used;
+} Block;
+
+// A large allocation's own chunk. Freed ones are kept as spares for the
+// next request they fit. A request that none fits first gives back the
+// spares freed during this image, so the footprint stays what was live at
+// once, as with malloc. Spares left from the last image are kept for the
+// requests of this one (a stream of same-sized images keeps reusing the
+// same pages), and given back by arena_reset() if they went unused.
+typedef struct Large {
+    struct Large *prev, *next;
+    size_t size;  // usable bytes after the headers
+    int idle;     // a spare since before the last arena_reset()
+} Large;
+
+// Each allocation is prefixed with its size so realloc knows what to copy.
+typedef struct {
+    size_t size;
+    Large *large;  // its chunk, or NULL when it is in a block
+} AllocHeader;
+
+#define BLOCK_HEADER ROUND_UP(sizeof(Block))
+#define LARGE_HEADER ROUND_UP(sizeof(Large))
+#define ALLOC_HEADER ROUND_UP(sizeof(AllocHeader))
+#define BLOCK_DATA(b) ((unsigned char *)(b) + BLOCK_HEADER)
+
+typedef struct {
+    Block *head;   // all blocks, in the order they get filled
+    Block *cur;    // block currently being bumped
+    void *last;    // latest allocation; the only one that can grow or be popped in place
+    Large *live;   // large allocations not yet freed
+    Large *spare;  // freed ones, kept for reuse
+} Arena;
+
+static ARENA_THREAD_LOCAL Arena arena;
+
+static Block *new_block(size_t size) {
+    Block *b = (Block *)malloc(BLOCK_HEADER + size);
+    if (!b) return NULL;
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+    return b;
+}
+
+// Gives back the spares that cannot serve a 'size' request: the ones
+// freed during this image and the ones too small. 0 gives back the idle
+// ones instead.
+static void free_spares(size_t size) {
+    Large **s = &arena.spare;
+    while (*s) {
+        Large *l = *s;
+        if (size ? !l->idle || l->size < size : l->idle) {
+            *s = l->next;
+            free(l);
+        } else {
+            s = &l->next;
+        }
+    }
+}
+
+static void *large_data(Large *l, size_t size) {
+    l->prev = NULL;
+    l->next = arena.live;
+    if (arena.live) arena.live->prev = l;
+    arena.live = l;
+
+    AllocHeader *h = (AllocHeader *)((unsigned char *)l + LARGE_HEADER);
+    h->size = size;
+    h->large = l;
+    return (unsigned char *)h + ALLOC_HEADER;
+}
+
+static void large_unlink(Large *l) {
+    if (l->prev) l->prev->next = l->next;
+    else arena.live = l->next;
+    if (l->next) l->next->prev = l->prev;
+}
+
+static void *large_alloc(size_t size) {
+    // Smallest spare that fits without wasting more than half of it
+    Large **best = NULL;
+    for (Large **s = &arena.spare; *s; s = &(*s)->next) {
+        if ((*s)->size >= size && (*s)->size / 2 <= size && (!best || (*s)->size < (*best)->size)) best = s;
+    }
+    Large *l;
+    if (best) {
+        l = *best;
+        *best = l->next;
+    } else {
+        free_spares(size);
+        l = (Large *)malloc(LARGE_HEADER + ALLOC_HEADER + size);
+        if (!l) return NULL;
+        l->size = size;
+    }
+    return large_data(l, size);
+}
+
+void *arena_alloc(size_t size) {
+    if (size >= ARENA_LARGE_SIZE) return large_alloc(size);
+
+    size_t need = ALLOC_HEADER + ROUND_UP(size);
+    Block *b = arena.cur;
+
+    // Blocks after 'cur' are left over from earlier images and still empty
+    while (b && b->used + need > b->size) b = b->next;
+
+    if (!b) {
+        b = new_block(ARENA_BLOCK_SIZE);
+        if (!b) return NULL;
+        if (!arena.head) {
+            arena.head = b;
+        } else {
+            Block *tail = arena.cur ? arena.cur : arena.head;
+            while (tail->next) tail = tail->next;
+            tail->next = b;
+        }
+    }
+    arena.cur = b;
+
+    AllocHeader *h = (AllocHeader *)(BLOCK_DATA(b) + b->used);
+    h->size = size;
+    h->large = NULL;
+    b->used += need;
+    arena.last = (unsigned char *)h + ALLOC_HEADER;
+    return arena.last;
+}
+
+void *arena_realloc(void *p, size_t new_size) {
+    if (!p) return arena_alloc(new_size);
+
+    AllocHeader *h = (AllocHeader *)((unsigned char *)p - ALLOC_HEADER);
+    size_t old_size = h->size;
+
+    // A large allocation grows in its own chunk (in place when the chunk
+    // was a bigger spare or realloc can extend it)
+    if (h->large) {
+        Large *l = h->large;
+        if (new_size <= l->size) {
+            h->size = new_size;
+            return p;
+        }
+        free_spares(new_size);
+        large_unlink(l);
+        Large *grown = (Large *)realloc(l, LARGE_HEADER + ALLOC_HEADER + new_size);
+        if (!grown) {
+            large_data(l, old_size);
+            return NULL;
+        }
+        grown->size = new_size;
+        return large_data(grown, new_size);
+    }
+
+    // Growing the newest allocation (zlib output buffers) just moves the top
+    if (p == arena.last) {
+        Block *b = arena.cur;
+        size_t used = b->used - ROUND_UP(old_size) + ROUND_UP(new_size);
+        if (used <= b->size) {
+            b->used = used;
+            h->size = new_size;
+            return p;
+        }
+    }
+    if (new_size <= old_size) {
+        h->size = new_size;
+        return p;
+    }
+
+    void *q = arena_alloc(new_size);
+    if (!q) return NULL;
+    memcpy(q, p, old_size);
+    arena_free(p);
+    return q;
+}
+
+void arena_free(void *p) {
+    if (!p) return;
+    AllocHeader *h = (AllocHeader *)((unsigned char *)p - ALLOC_HEADER);
+    if (h->large) {
+        large_unlink(h->large);
+        h->large->next = arena.spare;
+        h->large->idle = 0;
+        arena.spare = h->large;
+        return;
+    }
+
+    // In a block, only the newest allocation can be handed back early;
+    // everything else waits for arena_reset()
+    if (p == arena.last) {
+        arena.cur->used -= ALLOC_HEADER + ROUND_UP(h->size);
+        arena.last = NULL;
+    }
+}
+
+// Large allocations still live become spares for the next image
+static void retire_live(void) {
+    while (arena.live) {
+        Large *l = arena.live;
+        arena.live = l->next;
+        l->next = arena.spare;
+        arena.spare = l;
+    }
+}
+
+void arena_reset(void) {
+    free_spares(0);
+    retire_live();
+    for (Large *l = arena.spare; l; l = l->next) l->idle = 1;
+
+    Block *b = arena.head;
+    if (!b) return;
+
+    // If the last image needed more than one block, replace them with a
+    // single block of the combined size so the next one fits without
+    // going back to the system.
+    if (b->next) {
+        size_t total = 0;
+        while (b) {
+            Block *next = b->next;
+            total += b->size;
+            free(b);
+            b = next;
+        }
+        arena.head = new_block(total);
+    }
+
+    arena.cur = arena.head;
+    arena.last = NULL;
+    if (arena.head) arena.head->used = 0;
+}
+
+void arena_release(void) {
+    retire_live();
+    while (arena.spare) {
+        Large *next = arena.spare->next;
+        free(arena.spare);
+        arena.spare = next;
+    }
+
+    Block *b = arena.head;
+    while (b) {
+        Block *next = b->next;
+        free(b);
+        b = next;
+    }
+    arena.head = arena.cur = NULL;
+    arena.last = NULL;
+}
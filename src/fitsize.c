@@ -0,0 +1,55 @@
+#include "../include/fitsize.h"
+
+// Binary search for the highest quality in [lo, hi] that fits. File size
+// grows with quality as long as the chroma layout stays the same.
+static int search(JpegFit *fit, stbi_write_jpg_cache *cache, int lo, int hi, size_t max_bytes) {
+    int found = 0;
+    while (lo <= hi) {
+        int q = lo + (hi - lo) / 2;
+        size_t bytes = stbi_write_jpg_cache_size(cache, q);
+        if (bytes && bytes <= max_bytes) {
+            fit->quality = q;
+            fit->bytes = bytes;
+            found = 1;
+            lo = q + 1;
+        } else {
+            hi = q - 1;
+        }
+    }
+    return found;
+}
+
+int jpeg_fit(JpegFit *fit, const unsigned char *img, int width, int height, int channels,
+             int max_quality, size_t max_bytes) {
+    int top = max_quality < 1 ? 1 : max_quality > 100 ? 100 : max_quality;
+
+    stbi_write_settings settings;
+    stbi_write_get_settings(&settings);
+    int mode = settings.jpg_subsampling;
+
+    // By default stbi_write_jpg drops chroma subsampling above quality 90, so
+    // that range needs its own cache. Try it first: if anything there fits we
+    // are done. A fixed mode needs just the one cache below.
+    if (mode == STBIW_JPG_AUTO) {
+        if (top > 90) {
+            fit->cache = stbi_write_jpg_cache_create(width, height, channels, img, STBIW_JPG_444);
+            if (!fit->cache) return 0;
+            if (search(fit, fit->cache, 91, top, max_bytes)) {
+                fit->fits = 1;
+                return 1;
+            }
+            stbi_write_jpg_cache_free(fit->cache);
+            top = 90;
+        }
+        mode = STBIW_JPG_420;
+    }
+
+    fit->cache = stbi_write_jpg_cache_create(width, height, channels, img, mode);
+    if (!fit->cache) return 0;
+    fit->fits = search(fit, fit->cache, 1, top, max_bytes);
+    if (!fit->fits) {
+        fit->quality = 1;
+        fit->bytes = stbi_write_jpg_cache_size(fit->cache, 1);
+    }
+    return 1;
+}
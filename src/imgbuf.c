@@ -0,0 +1,58 @@
+// MAP_ANONYMOUS is not in C99 or POSIX; ask for it before any header
+#define _DEFAULT_SOURCE
+#include "../include/imgbuf.h"
+#include "../include/config.h"
+#include <stdlib.h>
+
+#if defined(__linux__) && USE_HUGE_PAGES
+#include <sys/mman.h>
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#endif
+
+static void release(ImageBuffer *buf) {
+#ifdef HUGE_PAGE_SIZE
+    if (buf->huge) {
+        munmap(buf->data, buf->size);
+        return;
+    }
+#endif
+    free(buf->data);
+}
+
+int imgbuf_reserve(ImageBuffer *buf, size_t size) {
+    if (buf->data && buf->size >= size) return 1;
+
+    release(buf);
+    buf->data = NULL;
+    buf->size = 0;
+    buf->huge = 0;
+
+#ifdef HUGE_PAGE_SIZE
+    // Only worth it once the image spans at least one huge page
+    if (size >= HUGE_PAGE_SIZE) {
+        size_t rounded = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void *p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+            madvise(p, rounded, MADV_HUGEPAGE);
+#endif
+            buf->data = (unsigned char *)p;
+            buf->size = rounded;
+            buf->huge = 1;
+            return 1;
+        }
+    }
+#endif
+
+    buf->data = (unsigned char *)malloc(size);
+    if (!buf->data) return 0;
+    buf->size = size;
+    return 1;
+}
+
+void imgbuf_free(ImageBuffer *buf) {
+    if (buf->data) release(buf);
+    buf->data = NULL;
+    buf->size = 0;
+    buf->huge = 0;
+}
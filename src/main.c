@@ -5,37 +5,83 @@
 #include "../include/stb_image_write.h"
 #include "../include/process.h"
 #include "../include/config.h"
+#include "../include/arena.h"
+#include "../include/imgbuf.h"
+#include "../include/transcode.h"
+#include "../include/fitsize.h"
+#include "../include/pngout.h"
+#include "../include/pnm.h"
+#include "../include/outofcore.h"
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: whitebg <image_path> [threshold] [quality]\n");
-        return 1;
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// Reads the rest of a file or pipe into the arena
+static unsigned char *read_stream(FILE *f, int *len) {
+    // Files: size up front. Pipes can't seek; start small and grow.
+    size_t cap = (size_t)1 << 16, n = 0;
+    long pos = ftell(f);
+    if (pos >= 0 && fseek(f, 0, SEEK_END) == 0) {
+        long end = ftell(f);
+        if (end > pos) cap = (size_t)(end - pos) + 1; // +1 sees EOF in one read
+        fseek(f, pos, SEEK_SET);
     }
+    if (cap > 0x7fffffff) return NULL;
 
-    // 1. Setup Defaults (from config.h)
-    double threshold = COLOR_THRESHOLD; 
-    int quality = JPEG_QUALITY;
+    unsigned char *data = (unsigned char *)arena_alloc(cap);
+    size_t got;
+    while (data && (got = fread(data + n, 1, cap - n, f)) > 0) {
+        n += got;
+        if (n == cap) {
+            if (cap >= 0x7fffffff / 2) return NULL;
+            cap *= 2;
+            data = (unsigned char *)arena_realloc(data, cap);
+        }
+    }
+    if (!data || ferror(f) || n == 0) return NULL;
 
-    // 2. Overwrite if user typed extra numbers
-    if (argc >= 3) threshold = atof(argv[2]);
-    if (argc >= 4) quality = atoi(argv[3]);
+    *len = (int)n;
+    return data;
+}
 
-    printf("Processing with Threshold: %.0f, Quality: %d\n", threshold, quality);
+// Where an encoded image goes: a file, or stdout for the path "-". The file
+// is only created by the first write, so a writer that gives up before
+// writing (--dct on a PNG) leaves nothing behind.
+typedef struct {
+    const char *path;
+    FILE *f;
+    int failed;
+} Output;
 
-    // 3. Load
-    int width, height, channels;
-    unsigned char *img = stbi_load(argv[1], &width, &height, &channels, 0);
-    if (img == NULL) {
-        printf("Error loading image.\n");
-        return 1;
+static void write_output(void *context, void *data, int size) {
+    Output *out = (Output *)context;
+    if (!out->f && !out->failed) {
+        out->f = strcmp(out->path, "-") == 0 ? stdout : fopen(out->path, "wb");
+        if (!out->f) out->failed = 1;
     }
+    if (out->f && fwrite(data, 1, (size_t)size, out->f) != (size_t)size) out->failed = 1;
+}
 
-    // 4. Process (Pass the threshold!)
-    remove_background(img, width, height, channels, threshold);
+// Ends one image: flushes it, so the next stage of a pipeline gets it now,
+// and closes the file unless it's the -o stream shared by every frame.
+// Returns 0 if anything failed on the way.
+static int finish_output(Output *out, int keep_open) {
+    int ok = out->f && !out->failed && fflush(out->f) == 0;
+    if (!keep_open) {
+        if (out->f && out->f != stdout) ok = fclose(out->f) == 0 && ok;
+        out->f = NULL;
+    }
+    return ok;
+}
 
-    // 5. Generate New Filename
-    char out_name[1024];
-    strcpy(out_name, argv[1]);
+// Progress messages: stdout, or stderr when stdout carries the images
+static FILE *messages;
+
+// "dir/photo.jpg" -> "dir/white_T80_Q90_photo.jpg" (tag is "Q90", "DCT", ...)
+static void make_output_name(char *out_name, const char *input, double threshold, const char *tag) {
+    strcpy(out_name, input);
 
     char *last_slash = strrchr(out_name, '\\');
     if (!last_slash) last_slash = strrchr(out_name, '/');
@@ -44,19 +90,428 @@ int main(int argc, char *argv[]) {
     if (last_slash) {
         strcpy(temp_filename, last_slash + 1); // Copy just "photo.jpg"
         // Write new name AFTER the slash: "C:\path\white_T50_Q90_photo.jpg"
-        sprintf(last_slash + 1, "%sT%.0f_Q%d_%s", OUTPUT_PREFIX, threshold, quality, temp_filename);
+        sprintf(last_slash + 1, "%sT%.0f_%s_%s", OUTPUT_PREFIX, threshold, tag, temp_filename);
     } else {
         strcpy(temp_filename, out_name);
-        sprintf(out_name, "%sT%.0f_Q%d_%s", OUTPUT_PREFIX, threshold, quality, temp_filename);
+        sprintf(out_name, "%sT%.0f_%s_%s", OUTPUT_PREFIX, threshold, tag, temp_filename);
     }
+}
 
-    // 6. Save (Pass the quality!)
-    if (stbi_write_jpg(out_name, width, height, channels, img, quality) == 0) {
-        printf("FAILED to save image!\n");
+// "dir/photo.jpg" -> "dir/photo.png"
+static void set_extension(char *name, const char *ext) {
+    char *dot = strrchr(name, '.');
+    if (!dot || strchr(dot, '/') || strchr(dot, '\\')) dot = name + strlen(name);
+    strcpy(dot, ext);
+}
+
+// "95,80,60" -> {95, 80, 60}; returns how many, 0 if the list is malformed
+#define MAX_QUALITIES 8
+static int parse_qualities(const char *s, int *qualities) {
+    int n = 0;
+    while (n < MAX_QUALITIES) {
+        char *end;
+        qualities[n++] = (int)strtol(s, &end, 10);
+        if (end == s) return 0;
+        if (*end != ',') return *end ? 0 : n;
+        s = end + 1;
+    }
+    return 0;
+}
+
+// 444 / 422 / 420 -> STBIW_JPG_*; 0 (config.h default) -> STBIW_JPG_AUTO; -2 if unknown
+static int parse_subsampling(long mode) {
+    switch (mode) {
+    case 0:   return STBIW_JPG_AUTO;
+    case 444: return STBIW_JPG_444;
+    case 422: return STBIW_JPG_422;
+    case 420: return STBIW_JPG_420;
+    default:  return -2;
+    }
+}
+
+// "1920x1080" -> 1920, 1080; 0 if malformed or too big for one frame
+static int parse_size(const char *s, int *width, int *height) {
+    char *end;
+    long w = strtol(s, &end, 10);
+    if (end == s || *end != 'x') return 0;
+    s = end + 1;
+    long h = strtol(s, &end, 10);
+    if (end == s || *end || w <= 0 || h <= 0 || w > 0x7fffffff / 3 / h) return 0;
+    *width = (int)w;
+    *height = (int)h;
+    return 1;
+}
+
+static void usage(void) {
+    printf("Usage: whitebg [--dct] [--progressive] [--max-bytes N] [--subsample 444|422|420]\n");
+    printf("               [--png [--threads N]] [--pnm] [--raw WxH] [--out-of-core MB] [-o out_path]\n");
+    printf("               <image_path> [threshold] [quality[,quality...]]\n");
+    printf("  --dct          JPEG only: edit the DCT blocks in place; blocks without background\n");
+    printf("                 are copied untouched (quality is ignored, the file's tables are kept)\n");
+    printf("  --progressive  save progressive JPEG: viewers show a preview after the first scan\n");
+    printf("  --max-bytes N  save at the highest quality (up to [quality]) that fits in N bytes\n");
+    printf("  --subsample M  chroma resolution: 444 full, 422 half width, 420 half width and height\n");
+    printf("                 (default: 420 up to quality 90, 444 above)\n");
+    printf("  --png          save a PNG with a transparent background instead (quality is ignored)\n");
+    printf("  --threads N    compress the PNG in N bands of rows at once (0 = one per CPU core)\n");
+    printf("  --pnm          save raw PPM/PGM (PAM with alpha) frames instead of JPEG\n");
+    printf("  --raw WxH      the input is raw RGB video frames of this size (ffmpeg -f rawvideo\n");
+    printf("                 -pix_fmt rgb24); each frame's fill starts from the last one's\n");
+    printf("  --out-of-core MB\n");
+    printf("                 raw PPM/PGM/PAM in and out for images bigger than memory: read in bands\n");
+    printf("                 of about MB megabytes; the fill's bitmaps (2 bits per pixel, not counted\n");
+    printf("                 in MB) go in scratch files in $TMPDIR\n");
+    printf("  -o out_path    write here instead of next to the input; - = stdout\n");
+    printf("Several qualities (e.g. 95,80,60) save one file each from a single encode pass.\n");
+    printf("An image_path of - reads stdin and writes stdout (unless -o says otherwise). A stream\n");
+    printf("of raw PPM/PGM/PAM frames is processed frame by frame, one result per frame.\n");
+}
+
+typedef struct {
+    double threshold;
+    int qualities[MAX_QUALITIES];
+    int nqualities;
+    int dct;
+    int progressive;
+    long max_bytes;
+    int png;
+    int pnm;
+    int threads;
+    int raw_width, raw_height;  // --raw; 0 = the input says what it is
+    size_t budget;       // --out-of-core band size in bytes; 0 = the whole image in memory
+    const char *input;   // "-" = stdin
+    const char *output;  // -o; NULL = a new file next to the input
+} Options;
+
+// Saved / FAILED line for one image; nothing when it went to stdout
+static void report(const Output *out, int ok) {
+    if (!ok) fprintf(messages, "FAILED to save image!\n");
+    else if (strcmp(out->path, "-") != 0) fprintf(messages, "Saved: %s\n", out->path);
+}
+
+// --dct: JPEG in, JPEG out without going through pixels. Returns 0 when the
+// file isn't a JPEG it can edit (nothing written) and the pixel path is needed.
+static int save_dct(const Options *opt, Output *stream, const unsigned char *file, int file_len, int *ok) {
+    char out_name[1024];
+    Output named = {out_name, NULL, 0};
+    Output *out = stream ? stream : &named;
+    TranscodeStats stats;
+    make_output_name(out_name, opt->input, opt->threshold, "DCT");
+    if (!transcode_jpeg(file, file_len, write_output, out, opt->threshold, &stats)) {
+        fprintf(messages, "DCT mode needs a grayscale or YCbCr JPEG; using the normal path.\n");
+        return 0;
+    }
+    *ok = finish_output(out, stream != NULL);
+    if (*ok && strcmp(out->path, "-") != 0)
+        fprintf(messages, "Saved: %s (%d blocks kept, %d filled, %d re-encoded)\n", out->path, stats.kept, stats.filled, stats.reencoded);
+    else report(out, *ok);
+    return 1;
+}
+
+// Processes one decoded image and saves it to 'stream' (-o), or to a new
+// file named after the input when stream is NULL. 'mask' is the background
+// when the caller already has it, NULL to find it here. Returns 0 on failure.
+static int save_image(const Options *opt, Output *stream, unsigned char *img, int width, int height, int channels,
+                      const unsigned char *mask) {
+    char out_name[1024];
+    Output named = {out_name, NULL, 0};
+    Output *out = stream ? stream : &named;
+    int ok;
+
+    // PNG: background made transparent rather than painted
+    if (opt->png) {
+        int out_channels = channels < 3 ? 2 : 4;
+        unsigned char *cut = img;
+        if (out_channels != channels) cut = (unsigned char *)arena_alloc((size_t)width * height * out_channels);
+        make_output_name(out_name, opt->input, opt->threshold, "PNG");
+        set_extension(out_name, ".png");
+        if (cut && mask) cutout_background(img, mask, width, height, channels, cut);
+        ok = cut && (mask || cut_background(img, width, height, channels, opt->threshold, cut)) &&
+             save_png(write_output, out, width, height, out_channels, cut, opt->threads);
+        ok = finish_output(out, stream != NULL) && ok;
+        report(out, ok);
+        return ok;
+    }
+
+    // Process (Pass the threshold!)
+    if (mask) paint_background(img, mask, width, height, channels);
+    else remove_background(img, width, height, channels, opt->threshold);
+
+    if (opt->pnm) {
+        make_output_name(out_name, opt->input, opt->threshold, "PNM");
+        set_extension(out_name, pnm_extension(channels));
+        ok = pnm_write_frame(write_output, out, img, width, height, channels);
+        ok = finish_output(out, stream != NULL) && ok;
+        report(out, ok);
+        return ok;
+    }
+
+    // Several qualities: one pass over the image writes all of them
+    if (opt->nqualities > 1) {
+        char names[MAX_QUALITIES][1024];
+        const char *paths[MAX_QUALITIES];
+        for (int i = 0; i < opt->nqualities; i++) {
+            char tag[16];
+            sprintf(tag, "Q%d", opt->qualities[i]);
+            make_output_name(names[i], opt->input, opt->threshold, tag);
+            paths[i] = names[i];
+        }
+        // Progressive files need every block before the first scan; one at a time
+        ok = 1;
+        if (opt->progressive) {
+            for (int i = 0; i < opt->nqualities && ok; i++)
+                ok = stbi_write_jpg_progressive(paths[i], width, height, channels, img, opt->qualities[i]);
+        } else {
+            ok = stbi_write_jpg_multi(paths, opt->qualities, opt->nqualities, width, height, channels, img);
+        }
+        if (!ok) {
+            fprintf(messages, "FAILED to save image!\n");
+        } else {
+            for (int i = 0; i < opt->nqualities; i++) fprintf(messages, "Saved: %s\n", names[i]);
+        }
+        return ok;
+    }
+
+    // With a size limit, pick the quality first (it goes in the name)
+    int quality = opt->qualities[0];
+    JpegFit fit = {0};
+    if (opt->max_bytes > 0) {
+        if (!jpeg_fit(&fit, img, width, height, channels, quality, (size_t)opt->max_bytes)) {
+            fprintf(messages, "FAILED to save image!\n");
+            return 0;
+        }
+        quality = fit.quality;
+    }
+
+    // Generate New Filename
+    char tag[16];
+    sprintf(tag, "Q%d", quality);
+    make_output_name(out_name, opt->input, opt->threshold, tag);
+
+    // Save (Pass the quality!)
+    ok = fit.cache        ? stbi_write_jpg_cache_to_func(write_output, out, fit.cache, quality)
+       : opt->progressive ? stbi_write_jpg_progressive_to_func(write_output, out, width, height, channels, img, quality)
+                          : stbi_write_jpg_to_func(write_output, out, width, height, channels, img, quality);
+    ok = finish_output(out, stream != NULL) && ok;
+    if (ok && fit.cache && strcmp(out->path, "-") != 0) {
+        fprintf(messages, "Saved: %s (%zu bytes at quality %d)\n", out->path, fit.bytes, quality);
+        if (!fit.fits) fprintf(messages, "Warning: %ld bytes is below the smallest possible file.\n", opt->max_bytes);
     } else {
-        printf("Saved: %s\n", out_name);
+        report(out, ok);
     }
+    return ok;
+}
 
-    stbi_image_free(img);
-    return 0;
-}
\ No newline at end of file
+int main(int argc, char *argv[]) {
+    // 1. Setup Defaults (from config.h)
+    Options opt = {0};
+    opt.threshold = COLOR_THRESHOLD;
+    opt.qualities[0] = JPEG_QUALITY;
+    opt.nqualities = 1;
+    opt.threads = PNG_THREADS;
+    int subsampling = parse_subsampling(JPEG_SUBSAMPLING);
+
+    // 2. Options may go anywhere; the rest are <image_path> [threshold] [quality]
+    const char *args[3] = {NULL, NULL, NULL};
+    int nargs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dct") == 0) {
+            opt.dct = 1;
+        } else if (strcmp(argv[i], "--progressive") == 0) {
+            opt.progressive = 1;
+        } else if (strcmp(argv[i], "--png") == 0) {
+            opt.png = 1;
+        } else if (strcmp(argv[i], "--pnm") == 0) {
+            opt.pnm = 1;
+        } else if (strcmp(argv[i], "--raw") == 0) {
+            if (i + 1 >= argc || !parse_size(argv[++i], &opt.raw_width, &opt.raw_height)) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--out-of-core") == 0) {
+            long mb;
+            if (i + 1 >= argc || (mb = atol(argv[++i])) <= 0) {
+                usage();
+                return 1;
+            }
+            opt.budget = (size_t)mb << 20;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 >= argc) {
+                usage();
+                return 1;
+            }
+            opt.output = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            if (i + 1 >= argc || (opt.threads = atoi(argv[++i])) < 0) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--subsample") == 0) {
+            if (i + 1 >= argc || (subsampling = parse_subsampling(atol(argv[++i]))) == -2) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-bytes") == 0) {
+            if (i + 1 >= argc || (opt.max_bytes = atol(argv[++i])) <= 0) {
+                usage();
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--", 2) == 0 || nargs == 3) {
+            usage();
+            return 1;
+        } else {
+            args[nargs++] = argv[i];
+        }
+    }
+    if (nargs < 1) {
+        usage();
+        return 1;
+    }
+
+    opt.input = args[0];
+    if (nargs >= 2) opt.threshold = atof(args[1]);
+    if (nargs >= 3) opt.nqualities = parse_qualities(args[2], opt.qualities);
+    // Nothing to name the result after when reading stdin
+    if (!opt.output && strcmp(opt.input, "-") == 0) opt.output = "-";
+    // A size limit picks a single quality (for baseline output); --dct keeps
+    // the input's coding; PNG and PNM have no quality at all; one output
+    // stream takes one result per image; raw frames are pixels, not a JPEG;
+    // out of core is PNM only
+    if (opt.budget && (opt.dct || opt.progressive || opt.max_bytes > 0 || opt.nqualities > 1 || opt.png ||
+                       opt.raw_width)) {
+        usage();
+        return 1;
+    }
+    if (opt.nqualities == 0 || subsampling == -2 || (opt.nqualities > 1 && opt.max_bytes > 0) ||
+        (opt.progressive && (opt.dct || opt.max_bytes > 0)) ||
+        ((opt.png || opt.pnm) && (opt.dct || opt.progressive || opt.max_bytes > 0 || opt.nqualities > 1)) ||
+        (opt.png && opt.pnm) || (opt.output && opt.nqualities > 1) || (opt.raw_width && opt.dct)) {
+        usage();
+        return 1;
+    }
+
+    messages = opt.output && strcmp(opt.output, "-") == 0 ? stderr : stdout;
+    if (opt.dct) fprintf(messages, "Processing with Threshold: %.0f, DCT mode\n", opt.threshold);
+    else if (opt.png) fprintf(messages, "Processing with Threshold: %.0f, PNG\n", opt.threshold);
+    else if (opt.budget) fprintf(messages, "Processing with Threshold: %.0f, PNM out of core\n", opt.threshold);
+    else if (opt.pnm) fprintf(messages, "Processing with Threshold: %.0f, PNM\n", opt.threshold);
+    else if (nargs >= 3) fprintf(messages, "Processing with Threshold: %.0f, Quality: %s\n", opt.threshold, args[2]);
+    else     fprintf(messages, "Processing with Threshold: %.0f, Quality: %d\n", opt.threshold, opt.qualities[0]);
+
+    // Give this thread its own stb settings so decode/encode never read the
+    // library-wide globals (safe to run several of these side by side)
+    stbi_set_flip_vertically_on_load_thread(0);
+    stbi_write_settings write_settings;
+    stbi_write_get_settings(&write_settings);
+    write_settings.jpg_fixed_point = JPEG_FIXED_POINT;
+    write_settings.jpg_subsampling = subsampling;
+    write_settings.png_compression_level = PNG_COMPRESSION_LEVEL;
+    stbi_write_set_thread_settings(&write_settings);
+
+    FILE *in = stdin;
+    if (strcmp(opt.input, "-") != 0) in = fopen(opt.input, "rb");
+#ifdef _WIN32
+    else _setmode(_fileno(stdin), _O_BINARY);
+    if (opt.output && strcmp(opt.output, "-") == 0) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    if (!in) {
+        fprintf(messages, "Error loading image.\n");
+        return 1;
+    }
+    Output stream = {opt.output, NULL, 0};
+    Output *out = opt.output ? &stream : NULL;
+    ImageBuffer buf = {0};
+    int width, height, channels;
+    int ok = 1;
+
+    // 3. Load. Raw PPM/PGM/PAM frames are read straight into the buffer, no
+    // decoding. With one output stream every frame in the input is
+    // processed; with files named after the input only the first, as stb
+    // would read it.
+    int first = getc(in);
+    if (first != EOF) ungetc(first, in);
+    if (opt.raw_width) {
+        // Video: consecutive frames differ a little, so each one's fill
+        // starts from the previous frame's mask, with a full fill every
+        // MASK_REFRESH_FRAMES frames
+        ImageBuffer mask = {0};
+        int frames = 0, r = -1;
+        width = opt.raw_width;
+        height = opt.raw_height;
+        channels = 3;
+        if (imgbuf_reserve(&mask, (size_t)width * height)) {
+            while ((r = pnm_read_raw_frame(in, &buf, width, height, channels)) > 0) {
+                if (!track_background(buf.data, width, height, channels, opt.threshold, mask.data,
+                                      frames % MASK_REFRESH_FRAMES != 0)) {
+                    fprintf(messages, "FAILED to save image!\n");
+                    ok = 0;
+                    break;
+                }
+                frames++;
+                ok = save_image(&opt, out, buf.data, width, height, channels, mask.data);
+                arena_reset();
+                if (!ok || !out) break;
+            }
+        }
+        if (r < 0 || frames == 0) {
+            fprintf(messages, "Error loading image.\n");
+            ok = 0;
+        }
+        imgbuf_free(&mask);
+    } else if (opt.budget) {
+        // Gigapixel PNM: never the whole image in memory
+        char out_name[1024];
+        Output named = {out_name, NULL, 0};
+        Output *o = out ? out : &named;
+        int maxval;
+        if (first != 'P' || pnm_read_header(in, &width, &height, &channels, &maxval) <= 0) {
+            fprintf(messages, "Out of core needs a raw PPM/PGM/PAM image.\n");
+            ok = 0;
+        } else {
+            make_output_name(out_name, opt.input, opt.threshold, "PNM");
+            set_extension(out_name, pnm_extension(channels));
+            ok = remove_background_out_of_core(in, width, height, channels, maxval, opt.threshold, opt.budget,
+                                               write_output, o);
+            ok = finish_output(o, out != NULL) && ok;
+            report(o, ok);
+        }
+    } else if (first == 'P') {
+        int frames = 0, r;
+        if (opt.dct) fprintf(messages, "DCT mode needs a grayscale or YCbCr JPEG; using the normal path.\n");
+        while ((r = pnm_read_frame(in, &buf, &width, &height, &channels)) > 0) {
+            frames++;
+            ok = save_image(&opt, out, buf.data, width, height, channels, NULL);
+            // Next frame reuses this frame's arena pages and buffer
+            arena_reset();
+            if (!ok || !out) break;
+        }
+        if (r < 0 || frames == 0) {
+            fprintf(messages, "Error loading image.\n");
+            ok = 0;
+        }
+    } else {
+        // Anything else stb_image reads: probe the size, then decode
+        // straight into our own buffer
+        int file_len;
+        unsigned char *file = read_stream(in, &file_len);
+        if (file == NULL || !stbi_info_from_memory(file, file_len, &width, &height, &channels)) {
+            fprintf(messages, "Error loading image.\n");
+            return 1;
+        }
+        if (!opt.dct || !save_dct(&opt, out, file, file_len, &ok)) {
+            int stride = width * channels;
+            if (!imgbuf_reserve(&buf, (size_t)stride * height) ||
+                !stbi_load_from_memory_into(file, file_len, buf.data, stride, buf.size, &width, &height, NULL, channels)) {
+                fprintf(messages, "Error loading image.\n");
+                return 1;
+            }
+            ok = save_image(&opt, out, buf.data, width, height, channels, NULL);
+        }
+    }
+    if (in != stdin) fclose(in);
+    if (out && stream.f) ok = finish_output(&stream, 0) && ok;
+
+    imgbuf_free(&buf);
+    arena_release();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+// mkstemp, ftruncate, fdopen and fseeko/ftello are POSIX, not C99; 64-bit
+// file offsets so 32-bit hosts can seek past 2 GiB. Before any header.
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include "../include/outofcore.h"
+#include "../include/process.h"
+#include "../include/pnm.h"
+#include "../include/imgbuf.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define ftell64 _ftelli64
+#define fseek64 _fseeki64
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#define ftell64 ftello
+#define fseek64 fseeko
+#endif
+
+// Band heights are a whole number of the fill's 16x16 tiles
+#define BAND_ALIGN 16
+
+#ifndef _WIN32
+// A new file in $TMPDIR, already unlinked: it goes away with the last
+// descriptor or mapping, however the process ends
+static int scratch_fd(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/whitebg-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd >= 0) unlink(path);
+    return fd;
+}
+#endif
+
+// 'size' zeroed bytes backed by a scratch file instead of RAM or swap
+static void *scratch_map(size_t size) {
+#ifdef _WIN32
+    return calloc(1, size);
+#else
+    int fd = scratch_fd();
+    if (fd < 0) return NULL;
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+static void scratch_unmap(void *p, size_t size) {
+    if (!p) return;
+#ifdef _WIN32
+    (void)size;
+    free(p);
+#else
+    munmap(p, size);
+#endif
+}
+
+// Somewhere to keep a piped image for the second pass
+static FILE *scratch_file(void) {
+#ifdef _WIN32
+    return tmpfile();
+#else
+    int fd = scratch_fd();
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "w+b");
+    if (!f && fd >= 0) close(fd);
+    return f;
+#endif
+}
+
+int remove_background_out_of_core(FILE *in, int width, int height, int channels, int maxval, double threshold,
+                                  size_t budget, stbi_write_func *func, void *context) {
+    size_t row = (size_t)width * channels, words = ((size_t)width + 63) / 64;
+    size_t bitmap = words * height;
+    size_t fit = budget / row / BAND_ALIGN * BAND_ALIGN;
+    int band = fit < BAND_ALIGN ? BAND_ALIGN : fit < (size_t)height ? (int)fit : height;
+
+    // Candidates, then the fill, in one mapping
+    uint64_t *cand = (uint64_t *)scratch_map(2 * bitmap * sizeof(uint64_t));
+    uint64_t *fill = cand + bitmap;
+    ImageBuffer buf = {0};
+    FILE *spill = NULL;
+    long long start = (long long)ftell64(in);
+    int seekable = start >= 0 && fseek64(in, start, SEEK_SET) == 0;
+    int ok = cand && imgbuf_reserve(&buf, row * band) && (seekable || (spill = scratch_file()));
+
+    // Pass 1: which pixels have the background color. It is the first
+    // pixel's, so it comes with the first band.
+    unsigned char bg[4];
+    for (int y = 0; ok && y < height; y += band) {
+        int rows = height - y < band ? height - y : band;
+        size_t size = row * rows;
+        ok = pnm_read_samples(in, buf.data, size, maxval);
+        if (ok && y == 0) memcpy(bg, buf.data, channels);
+        ok = ok && background_bits_band(buf.data, bg, width, rows, channels, threshold, cand + words * y) &&
+             (!spill || fwrite(buf.data, 1, size, spill) == size);
+    }
+
+    // The fill, over the whole image at once
+    ok = ok && connect_background(cand, fill, width, height);
+
+    // Pass 2: paint and send on a band at a time. The spilled copy is
+    // already stretched to 0-255.
+    FILE *src = spill ? spill : in;
+    ok = ok && fseek64(src, spill ? 0 : start, SEEK_SET) == 0 &&
+         pnm_write_header(func, context, width, height, channels);
+    for (int y = 0; ok && y < height; y += band) {
+        int rows = height - y < band ? height - y : band;
+        ok = pnm_read_samples(src, buf.data, row * rows, spill ? 255 : maxval) &&
+             paint_background_bits(buf.data, fill + words * y, width, rows, channels);
+        for (int r = 0; ok && r < rows; r++) func(context, buf.data + row * r, (int)row);
+    }
+
+    if (spill) fclose(spill);
+    imgbuf_free(&buf);
+    scratch_unmap(cand, 2 * bitmap * sizeof(uint64_t));
+    return ok;
+}
@@ -0,0 +1,94 @@
+#include "../include/pngout.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define MAX_THREADS 64
+
+// One band, compressed on its own thread. stbi_write_png_bands_begin() has
+// already allocated everything, so workers never touch the (per-thread) arena.
+typedef struct {
+    stbi_write_png_bands *png;
+    int band;
+    int ok;
+} BandJob;
+
+#ifdef _WIN32
+static DWORD WINAPI band_thread(LPVOID arg) {
+#else
+static void *band_thread(void *arg) {
+#endif
+    BandJob *job = (BandJob *)arg;
+    job->ok = stbi_write_png_band(job->png, job->band);
+    return 0;
+}
+
+static int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+int save_png(stbi_write_func *func, void *context, int width, int height, int channels, const unsigned char *img,
+             int threads) {
+    if (threads <= 0) threads = cpu_count();
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (threads > height) threads = height;
+    if (threads <= 1) return stbi_write_png_to_func(func, context, width, height, channels, img, 0);
+
+    stbi_write_png_bands *png = stbi_write_png_bands_begin(width, height, channels, img, 0, threads);
+    if (!png) return 0;
+
+    BandJob jobs[MAX_THREADS];
+#ifdef _WIN32
+    HANDLE handles[MAX_THREADS];
+#else
+    pthread_t handles[MAX_THREADS];
+#endif
+    int started[MAX_THREADS];
+
+    // Band 0 runs here; a band whose thread can't start runs here too
+    for (int i = 1; i < threads; i++) {
+        jobs[i].png = png;
+        jobs[i].band = i;
+        jobs[i].ok = 0;
+#ifdef _WIN32
+        handles[i] = CreateThread(NULL, 0, band_thread, &jobs[i], 0, NULL);
+        started[i] = handles[i] != NULL;
+#else
+        started[i] = pthread_create(&handles[i], NULL, band_thread, &jobs[i]) == 0;
+#endif
+        if (!started[i]) band_thread(&jobs[i]);
+    }
+    jobs[0].png = png;
+    jobs[0].band = 0;
+    band_thread(&jobs[0]);
+
+    int ok = jobs[0].ok;
+    for (int i = 1; i < threads; i++) {
+        if (started[i]) {
+#ifdef _WIN32
+            WaitForSingleObject(handles[i], INFINITE);
+            CloseHandle(handles[i]);
+#else
+            pthread_join(handles[i], NULL);
+#endif
+        }
+        ok = ok && jobs[i].ok;
+    }
+
+    ok = ok && stbi_write_png_bands_to_func(func, context, png);
+    stbi_write_png_bands_free(png);
+    return ok;
+}
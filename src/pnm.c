@@ -0,0 +1,180 @@
+#include "../include/pnm.h"
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+// Largest side accepted, as in stb_image
+#define PNM_MAX_SIDE (1 << 24)
+
+// Skips whitespace and '#' comments; returns the first character after them
+static int skip_space(FILE *f) {
+    int c = getc(f);
+    for (;;) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) c = getc(f);
+        } else if (c == EOF || !isspace(c)) {
+            return c;
+        }
+        c = getc(f);
+    }
+}
+
+// Next header number; the character after it is consumed into *next.
+// -1 if there is no number or it is out of range.
+static long read_number(FILE *f, int *next) {
+    int c = skip_space(f);
+    if (c == EOF || !isdigit(c)) return -1;
+    long v = 0;
+    for (; c != EOF && isdigit(c); c = getc(f)) {
+        v = v * 10 + (c - '0');
+        if (v > PNM_MAX_SIDE) return -1;
+    }
+    *next = c;
+    return v;
+}
+
+// Next PAM header token (e.g. "WIDTH"); 0 at the end of the stream. The
+// character after the token is left in the stream.
+static int read_token(FILE *f, char *token, int size) {
+    int c = skip_space(f), n = 0;
+    while (c != EOF && !isspace(c)) {
+        if (n < size - 1) token[n++] = (char)c;
+        c = getc(f);
+    }
+    token[n] = 0;
+    if (c != EOF) ungetc(c, f);
+    return n > 0;
+}
+
+// P7 header after the "P7": WIDTH/HEIGHT/DEPTH/MAXVAL lines up to ENDHDR
+static int read_pam_header(FILE *f, long *w, long *h, long *depth, long *maxval) {
+    char token[32];
+    int next;
+    *w = *h = *depth = *maxval = -1;
+    while (read_token(f, token, sizeof(token))) {
+        if (strcmp(token, "ENDHDR") == 0) {
+            int c = getc(f);
+            while (c == ' ' || c == '\t' || c == '\r') c = getc(f);
+            return c == '\n';
+        }
+        long *field = strcmp(token, "WIDTH") == 0  ? w
+                    : strcmp(token, "HEIGHT") == 0 ? h
+                    : strcmp(token, "DEPTH") == 0  ? depth
+                    : strcmp(token, "MAXVAL") == 0 ? maxval
+                    : NULL;
+        if (field) {
+            if ((*field = read_number(f, &next)) < 0) return 0;
+            if (next != EOF) ungetc(next, f);
+        } else {
+            // TUPLTYPE and anything else: DEPTH already says what we need
+            int c = getc(f);
+            while (c != '\n' && c != EOF) c = getc(f);
+        }
+    }
+    return 0;
+}
+
+int pnm_read_header(FILE *f, int *width, int *height, int *channels, int *maxval) {
+    int c = getc(f);
+    if (c == EOF) return 0;
+    int type = getc(f);
+    if (c != 'P' || (type != '5' && type != '6' && type != '7')) return -1;
+
+    long w, h, depth, mv;
+    if (type == '7') {
+        if (!read_pam_header(f, &w, &h, &depth, &mv)) return -1;
+    } else {
+        int next = EOF;
+        depth = type == '5' ? 1 : 3;
+        // read_number() only sets 'next' when it finds a number
+        if ((w = read_number(f, &next)) < 0 || (h = read_number(f, &next)) < 0 || (mv = read_number(f, &next)) < 0)
+            return -1;
+        // exactly one whitespace character separates the header from the samples
+        if (next == EOF || !isspace(next)) return -1;
+    }
+    if (w <= 0 || h <= 0 || depth < 1 || depth > 4 || mv < 1 || mv > 65535) return -1;
+
+    *width = (int)w;
+    *height = (int)h;
+    *channels = (int)depth;
+    *maxval = (int)mv;
+    return 1;
+}
+
+int pnm_read_samples(FILE *f, unsigned char *data, size_t size, int maxval) {
+    // 16-bit samples: two bytes each, most significant first, read through
+    // a chunk since 'data' only has room for the 8-bit result
+    if (maxval > 255) {
+        unsigned char chunk[1 << 13];
+        for (size_t i = 0; i < size;) {
+            size_t n = size - i < sizeof(chunk) / 2 ? size - i : sizeof(chunk) / 2;
+            if (fread(chunk, 2, n, f) != n) return 0;
+            for (size_t k = 0; k < n; k++, i++) {
+                unsigned v = (unsigned)chunk[2 * k] << 8 | chunk[2 * k + 1];
+                if (v > (unsigned)maxval) v = (unsigned)maxval;
+                data[i] = (unsigned char)((v * 255 + maxval / 2) / maxval);
+            }
+        }
+        return 1;
+    }
+
+    if (fread(data, 1, size, f) != size) return 0;
+
+    // Samples are relative to maxval; stretch them to 0-255
+    if (maxval != 255) {
+        for (size_t i = 0; i < size; i++) {
+            unsigned v = data[i] > maxval ? (unsigned)maxval : data[i];
+            data[i] = (unsigned char)((v * 255 + maxval / 2) / maxval);
+        }
+    }
+    return 1;
+}
+
+int pnm_read_frame(FILE *f, ImageBuffer *buf, int *width, int *height, int *channels) {
+    int w, h, depth, maxval;
+    int r = pnm_read_header(f, &w, &h, &depth, &maxval);
+    if (r <= 0) return r;
+    if ((size_t)w * h > (size_t)INT_MAX / depth) return -1;
+
+    size_t size = (size_t)w * h * depth;
+    if (!imgbuf_reserve(buf, size) || !pnm_read_samples(f, buf->data, size, maxval)) return -1;
+
+    *width = w;
+    *height = h;
+    *channels = depth;
+    return 1;
+}
+
+int pnm_read_raw_frame(FILE *f, ImageBuffer *buf, int width, int height, int channels) {
+    size_t size = (size_t)width * height * channels;
+    if (!imgbuf_reserve(buf, size)) return -1;
+    size_t got = fread(buf->data, 1, size, f);
+    return got == size ? 1 : got == 0 && !ferror(f) ? 0 : -1;
+}
+
+int pnm_write_header(stbi_write_func *func, void *context, int width, int height, int channels) {
+    char header[128];
+    int len;
+    if (channels == 1 || channels == 3) {
+        len = sprintf(header, "P%c\n%d %d\n255\n", channels == 1 ? '5' : '6', width, height);
+    } else if (channels == 2 || channels == 4) {
+        len = sprintf(header, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                      width, height, channels, channels == 2 ? "GRAYSCALE_ALPHA" : "RGB_ALPHA");
+    } else {
+        return 0;
+    }
+    func(context, header, len);
+    return 1;
+}
+
+int pnm_write_frame(stbi_write_func *func, void *context, const unsigned char *img, int width, int height,
+                    int channels) {
+    if (!pnm_write_header(func, context, width, height, channels)) return 0;
+    size_t row = (size_t)width * channels;
+    for (int y = 0; y < height; y++) func(context, (void *)(img + row * y), (int)row);
+    return 1;
+}
+
+const char *pnm_extension(int channels) {
+    return channels == 1 ? ".pgm" : channels == 3 ? ".ppm" : ".pam";
+}
@@ -1,68 +1,446 @@
 #include "../include/process.h"
 #include "../include/queue.h"
+#include "../include/arena.h"
 #include "../include/config.h" 
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
-#define IDX(x, y, w, c) (((y) * (w) + (x)) * (c))
-
 double color_distance(unsigned char r1, unsigned char g1, unsigned char b1,
                       unsigned char r2, unsigned char g2, unsigned char b2) {
     return sqrt(pow(r1 - r2, 2) + pow(g1 - g2, 2) + pow(b1 - b2, 2));
 }
 
-// Updated: Function signature now matches the header
-void remove_background(unsigned char *img, int width, int height, int channels, double threshold) {
-    unsigned char bg_r = img[0];
-    unsigned char bg_g = img[1];
-    unsigned char bg_b = img[2];
+// A grey pixel is (v, v, v), so this matches color_distance on the two greys
+// and the same threshold works for both kinds of image.
+static double gray_distance(unsigned char v1, unsigned char v2) {
+    return sqrt(3.0) * abs(v1 - v2);
+}
 
-    unsigned char *visited = (unsigned char *)calloc(width * height, sizeof(unsigned char));
-    if (!visited) return;
+// The fill first sorts the image into FILL_TILE x FILL_TILE tiles by their
+// color range: tiles that match the background throughout are filled whole,
+// tiles where nothing can match are skipped, and only the tiles in between
+// (the subject's outline) are filled pixel by pixel. A divisor of 64, so a
+// tile row is part of one word in the bit-parallel engine's bitmaps.
+#define FILL_TILE 16
+enum { TILE_NONE, TILE_MIXED, TILE_ALL, TILE_FILLED };
 
-    Queue* q = createQueue();
-    enqueue(q, 0, 0);
-    
-    visited[0] = 1; 
+// Marks every pixel of tile (tx, ty) as background
+static void fill_tile(unsigned char *visited, int width, int height, int tx, int ty) {
+    int x0 = tx * FILL_TILE, y0 = ty * FILL_TILE;
+    int n = width - x0 < FILL_TILE ? width - x0 : FILL_TILE;
+    int y1 = y0 + FILL_TILE < height ? y0 + FILL_TILE : height;
+    for (int y = y0; y < y1; y++) memset(visited + (size_t)y * width + x0, 1, n);
+}
 
-    int dx[] = {0, 0, -1, 1};
-    int dy[] = {-1, 1, 0, 0};
+// Index of word k (pixels 64k..64k+63) of row y in a bitmap 'words' words
+// wide. Row-major, or (tiled) in 64x64 blocks of 64 consecutive words, one
+// per row: there the rows above and below are the next words over rather
+// than a whole image row away.
+static size_t bit_word(size_t words, size_t k, int y, int tiled) {
+    if (!tiled) return (size_t)y * words + k;
+    return ((size_t)(y / 64) * words + k) * 64 + y % 64;
+}
 
-    while (!isQueueEmpty(q)) {
-        Point current = dequeue(q);
-        int cx = current.x;
-        int cy = current.y;
-
-        // Turn pixel WHITE using values from config.h
-        int index = IDX(cx, cy, width, channels);
-        img[index]     = TARGET_R; 
-        img[index + 1] = TARGET_G;
-        img[index + 2] = TARGET_B;
-        if (channels == 4) img[index + 3] = 255;
-
-        for (int i = 0; i < 4; i++) {
-            int nx = cx + dx[i];
-            int ny = cy + dy[i];
-
-            if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
-                int v_index = ny * width + nx;
-                
-                if (visited[v_index] == 0) {
-                    int n_pixel_index = IDX(nx, ny, width, channels);
-                    double dist = color_distance(img[n_pixel_index], img[n_pixel_index + 1], img[n_pixel_index + 2], bg_r, bg_g, bg_b);
-
-                    // Updated: Uses the 'threshold' variable passed from main
-                    if (dist < threshold) {
-                        enqueue(q, nx, ny);
-                        visited[v_index] = 1;
-                    }
+// paint() hands runs of at least PAINT_RUN background pixels to
+// fill_pattern(); images of PAINT_STREAM_BYTES or more (well past the
+// last-level cache) are painted with non-temporal stores, which skip
+// reading each line in before overwriting it and leave the cache alone.
+#define PAINT_RUN 16
+#define PAINT_STREAM_BYTES ((size_t)32 << 20)
+
+// Writes 'bytes' bytes of the 'period'-byte pixel 'px' repeated (period 1
+// to 4, so 48 bytes is always a whole number of pixels) from 'dst'. Every
+// 48-byte chunk at offset o is the same 48 bytes of 'pat' starting at
+// o % period, so the stores are whole vectors from a fixed buffer.
+static void fill_pattern(unsigned char *dst, size_t bytes, const unsigned char *px, int period, int stream) {
+    unsigned char pat[64];
+    for (int i = 0; i < 64; i++) pat[i] = px[i % period];
+    size_t o = 0;
+#ifdef __SSE2__
+    if (stream && bytes >= 256) {
+        // Up to a 16-byte boundary normally, then three streamed vectors
+        // per 48 bytes
+        o = (16 - ((uintptr_t)dst & 15)) & 15;
+        memcpy(dst, pat, o);
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(pat + o % period));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(pat + (o + 16) % period));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(pat + (o + 32) % period));
+        for (; o + 48 <= bytes; o += 48) {
+            _mm_stream_si128((__m128i *)(dst + o), v0);
+            _mm_stream_si128((__m128i *)(dst + o + 16), v1);
+            _mm_stream_si128((__m128i *)(dst + o + 32), v2);
+        }
+    }
+#else
+    (void)stream;
+#endif
+    for (; o + 48 <= bytes; o += 48) memcpy(dst + o, pat + o % period, 48);
+    memcpy(dst + o, pat + o % period, bytes - o);
+}
+
+// The kernels themselves: fill_mask_N(), paint_N() and cutout_N() for N channels
+#define CHANNELS 1
+#include "../include/fill_kernel.h"
+#define CHANNELS 2
+#include "../include/fill_kernel.h"
+#define CHANNELS 3
+#include "../include/fill_kernel.h"
+#define CHANNELS 4
+#include "../include/fill_kernel.h"
+
+// The kernels compare integers: the smallest |dv| (grey) or squared RGB
+// distance whose distance is not below the threshold. Same pixels as calling
+// gray_distance()/color_distance() on each one.
+static int distance_limit(int channels, double threshold) {
+    int lo = 0, hi;
+    if (channels < 3) {
+        while (lo < 256 && gray_distance((unsigned char)lo, 0) < threshold) lo++;
+        return lo;
+    }
+    hi = 3 * 255 * 255 + 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (sqrt((double)mid) < threshold) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// --- Bit-parallel engine (FILL_ENGINE 1) ---
+// The background is the part of the candidate bitmap that is connected to
+// the seed: a morphological reconstruction, done 64 pixels per word with
+// shifts and ANDs instead of a queue entry per pixel.
+
+// Spreads the set bits of 'x' through the runs of set bits in 'c', towards
+// higher (up) or lower (down) bit positions: six doubling shift steps
+// rather than one step per bit
+static uint64_t spread_up(uint64_t x, uint64_t c) {
+    x |= c & (x << 1);
+    c &= c << 1;
+    x |= c & (x << 2);
+    c &= c << 2;
+    x |= c & (x << 4);
+    c &= c << 4;
+    x |= c & (x << 8);
+    c &= c << 8;
+    x |= c & (x << 16);
+    c &= c << 16;
+    return x | (c & (x << 32));
+}
+
+static uint64_t spread_down(uint64_t x, uint64_t c) {
+    x |= c & (x >> 1);
+    c &= c >> 1;
+    x |= c & (x >> 2);
+    c &= c >> 2;
+    x |= c & (x >> 4);
+    c &= c >> 4;
+    x |= c & (x >> 8);
+    c &= c >> 8;
+    x |= c & (x >> 16);
+    c &= c >> 16;
+    return x | (c & (x >> 32));
+}
+
+// Closes one row of the fill under left/right steps, across word boundaries
+static void spread_row(uint64_t *fill, const uint64_t *cand, size_t words) {
+    uint64_t carry = 0;
+    for (size_t k = 0; k < words; k++) {
+        fill[k] = spread_up(fill[k] | (carry & cand[k]), cand[k]);
+        carry = fill[k] >> 63;
+    }
+    carry = 0;
+    for (size_t k = words; k-- > 0;) {
+        fill[k] = spread_down(fill[k] | ((carry << 63) & cand[k]), cand[k]);
+        carry = fill[k] & 1;
+    }
+}
+
+// Carries the fill into a row from its neighbour 'from' (the row above or
+// below). Returns 1 if the row gained any pixel.
+static int sweep_row(uint64_t *fill, const uint64_t *from, const uint64_t *cand, size_t words) {
+    uint64_t added = 0;
+    for (size_t k = 0; k < words; k++) {
+        uint64_t next = from[k] & cand[k] & ~fill[k];
+        added |= next;
+        fill[k] |= next;
+    }
+    if (!added) return 0;
+    spread_row(fill, cand, words);
+    return 1;
+}
+
+// Grows 'fill' (just the seed on entry) inside 'cand'. Rows are kept
+// closed under left/right steps, and the sweeps alternate top-down and
+// bottom-up until one adds nothing: then the fill is closed in every
+// direction. 'changed' holds the last sweep that grew each row; a row only
+// looks at a neighbour that has grown since it last did. Background that
+// winds up and down (a spiral) still takes a pair of sweeps per turn.
+static void reconstruct(const uint64_t *cand, uint64_t *fill, size_t words, int height, int *changed) {
+    for (int y = 0; y < height; y++) changed[y] = -2;
+    spread_row(fill, cand, words);
+    changed[0] = 0;
+    for (int sweep = 0;; sweep++) {
+        int grew = 0;
+        if (sweep % 2 == 0) {
+            for (int y = 1; y < height; y++) {
+                if (changed[y - 1] < sweep - 1) continue;
+                if (sweep_row(fill + y * words, fill + (y - 1) * words, cand + y * words, words)) {
+                    changed[y] = sweep;
+                    grew = 1;
+                }
+            }
+        } else {
+            for (int y = height - 2; y >= 0; y--) {
+                if (changed[y + 1] < sweep - 1) continue;
+                if (sweep_row(fill + y * words, fill + (y + 1) * words, cand + y * words, words)) {
+                    changed[y] = sweep;
+                    grew = 1;
                 }
             }
         }
+        if (!grew) break;
+    }
+}
+
+// --- Tiled word queue (FILL_ENGINE 2) ---
+// The same bitmaps in 64x64 blocks (see bit_word()), grown by a queue of
+// 64-pixel words instead of sweeps: only the words at the edge of the fill
+// are ever looked at, and stepping up or down stays inside a 512-byte block
+// instead of jumping a whole image row.
+
+// Takes the pixels 'from' into word n if they are candidates it does not
+// have yet, and queues n unless it is already waiting
+static void grow_word(const uint64_t *cand, uint64_t *fill, unsigned char *queued, Queue *q,
+                      size_t n, int k, int y, uint64_t from) {
+    uint64_t next = from & cand[n] & ~fill[n];
+    if (!next) return;
+    fill[n] |= next;
+    if (!queued[n]) {
+        queued[n] = 1;
+        enqueue(q, k, y);
+    }
+}
+
+// Grows 'fill' (the seed word queued) inside 'cand', both tiled. A dequeued
+// word is closed under left/right steps within itself, then hands its
+// pixels to the four words around it.
+static void reconstruct_tiled(const uint64_t *cand, uint64_t *fill, unsigned char *queued, size_t words,
+                              int height, Queue *q) {
+    while (!isQueueEmpty(q)) {
+        Point p = dequeue(q);
+        int k = p.x, y = p.y;
+        size_t n = bit_word(words, k, y, 1);
+        queued[n] = 0;
+        uint64_t f = spread_down(spread_up(fill[n], cand[n]), cand[n]);
+        fill[n] = f;
+
+        if (y > 0) grow_word(cand, fill, queued, q, y % 64 ? n - 1 : bit_word(words, k, y - 1, 1), k, y - 1, f);
+        if (y < height - 1)
+            grow_word(cand, fill, queued, q, (y + 1) % 64 ? n + 1 : bit_word(words, k, y + 1, 1), k, y + 1, f);
+        if (k > 0 && (f & 1)) grow_word(cand, fill, queued, q, n - 64, k - 1, y, (uint64_t)1 << 63);
+        if ((size_t)k + 1 < words && (f >> 63)) grow_word(cand, fill, queued, q, n + 64, k + 1, y, 1);
+    }
+}
+
+// Back to one byte per pixel for paint/cutout, a byte of bits at a time
+static void bits_to_mask(const uint64_t *fill, size_t words, unsigned char *mask, int width, int height,
+                         int tiled) {
+    unsigned char bytes[256][8];
+    for (int b = 0; b < 256; b++)
+        for (int i = 0; i < 8; i++) bytes[b][i] = (unsigned char)((b >> i) & 1);
+
+    size_t step = tiled ? 64 : 1;
+    for (int y = 0; y < height; y++) {
+        const uint64_t *f = fill + bit_word(words, 0, y, tiled);
+        unsigned char *m = mask + (size_t)y * width;
+        for (int x0 = 0; x0 < width; x0 += 64, f += step) {
+            uint64_t w = *f;
+            int n = width - x0 < 64 ? width - x0 : 64;
+            if (w == 0 || w == ~(uint64_t)0) {
+                memset(m + x0, (int)(w & 1), n);
+                continue;
+            }
+            int x = 0;
+            for (; x + 8 <= n; x += 8) memcpy(m + x0 + x, bytes[(w >> x) & 0xff], 8);
+            for (; x < n; x++) m[x0 + x] = (unsigned char)((w >> x) & 1);
+        }
+    }
+}
+
+// The bit-parallel fill into 'mask', sweeping row-major bitmaps or (tiled)
+// queueing words of tiled ones. Returns 0 when out of memory.
+static int fill_bitwise(const unsigned char *img, int width, int height, int channels, int limit,
+                        unsigned char *tiles, unsigned char *mask, int tiled) {
+    size_t words = (size_t)(width + 63) / 64;
+    // Tiled bitmaps are padded to whole blocks; the padding is never a candidate
+    size_t total = words * (tiled ? (size_t)(height + 63) / 64 * 64 : (size_t)height);
+    uint64_t *cand = (uint64_t *)arena_alloc(total * sizeof(uint64_t));
+    uint64_t *fill = (uint64_t *)arena_alloc(total * sizeof(uint64_t));
+    if (!cand || !fill) return 0;
+
+    memset(cand, 0, total * sizeof(uint64_t));
+    switch (channels) {
+    case 1: candidate_bits_1(img, img, width, height, limit, tiles, cand, words, tiled); break;
+    case 2: candidate_bits_2(img, img, width, height, limit, tiles, cand, words, tiled); break;
+    case 3: candidate_bits_3(img, img, width, height, limit, tiles, cand, words, tiled); break;
+    default: candidate_bits_4(img, img, width, height, limit, tiles, cand, words, tiled); break;
+    }
+    // The top-left pixel is background by definition
+    memset(fill, 0, total * sizeof(uint64_t));
+    cand[0] |= 1;
+    fill[0] = 1;
+    if (tiled) {
+        unsigned char *queued = (unsigned char *)arena_alloc(total);
+        Queue *q = createQueue();
+        if (!queued || !q) return 0;
+        memset(queued, 0, total);
+        queued[0] = 1;
+        enqueue(q, 0, 0);
+        reconstruct_tiled(cand, fill, queued, words, height, q);
+        freeQueue(q);
+    } else {
+        int *changed = (int *)arena_alloc((size_t)height * sizeof(int));
+        if (!changed) return 0;
+        reconstruct(cand, fill, words, height, changed);
+    }
+    bits_to_mask(fill, words, mask, width, height, tiled);
+    return 1;
+}
+
+// --- Out-of-core pieces (see process.h) ---
+
+int background_bits_band(const unsigned char *band, const unsigned char *bg, int width, int rows, int channels,
+                         double threshold, uint64_t *bits) {
+    size_t words = (size_t)(width + 63) / 64;
+    size_t columns = (size_t)(width + FILL_TILE - 1) / FILL_TILE, trows = (size_t)(rows + FILL_TILE - 1) / FILL_TILE;
+    unsigned char *tiles = (unsigned char *)arena_alloc(columns * trows);
+    if (!tiles) return 0;
+
+    int limit = distance_limit(channels, threshold);
+    switch (channels) {
+    case 1: candidate_bits_1(band, bg, width, rows, limit, tiles, bits, words, 0); break;
+    case 2: candidate_bits_2(band, bg, width, rows, limit, tiles, bits, words, 0); break;
+    case 3: candidate_bits_3(band, bg, width, rows, limit, tiles, bits, words, 0); break;
+    default: candidate_bits_4(band, bg, width, rows, limit, tiles, bits, words, 0); break;
     }
+    arena_free(tiles);
+    return 1;
+}
+
+int connect_background(uint64_t *cand, uint64_t *fill, int width, int height) {
+    int *changed = (int *)arena_alloc((size_t)height * sizeof(int));
+    if (!changed) return 0;
+
+    // The top-left pixel is background by definition
+    cand[0] |= 1;
+    fill[0] |= 1;
+    reconstruct(cand, fill, (size_t)(width + 63) / 64, height, changed);
+    arena_free(changed);
+    return 1;
+}
 
-    free(visited);
-    freeQueue(q); 
-}
\ No newline at end of file
+int paint_background_bits(unsigned char *band, const uint64_t *fill, int width, int rows, int channels) {
+    unsigned char *mask = (unsigned char *)arena_alloc((size_t)width * rows);
+    if (!mask) return 0;
+
+    bits_to_mask(fill, (size_t)(width + 63) / 64, mask, width, rows, 0);
+    paint_background(band, mask, width, rows, channels);
+    arena_free(mask);
+    return 1;
+}
+
+// Flood-fills from the top-left pixel over everything within 'threshold' of
+// its color. Returns a width*height map with 1 for background pixels
+// (allocated from the arena), or NULL when out of memory.
+unsigned char *background_mask(const unsigned char *img, int width, int height, int channels, double threshold) {
+    unsigned char *visited = (unsigned char *)arena_alloc((size_t)width * height);
+    if (!visited) return NULL;
+
+    if (!track_background(img, width, height, channels, threshold, visited, 0)) {
+        arena_free(visited);
+        return NULL;
+    }
+    return visited;
+}
+
+int track_background(const unsigned char *img, int width, int height, int channels, double threshold,
+                     unsigned char *mask, int reuse) {
+    size_t columns = (size_t)(width + FILL_TILE - 1) / FILL_TILE, rows = (size_t)(height + FILL_TILE - 1) / FILL_TILE;
+    unsigned char *tiles = (unsigned char *)arena_alloc(columns * rows);
+    if (!tiles) return 0;
+
+    // Pick the kernel once per image
+    int limit = distance_limit(channels, threshold);
+    if (!reuse && FILL_ENGINE != 0)
+        return fill_bitwise(img, width, height, channels, limit, tiles, mask, FILL_ENGINE == 2);
+    if (!reuse) {
+        memset(mask, 0, (size_t)width * height);
+        switch (channels) {
+        case 1: fill_mask_1(img, mask, width, height, limit, tiles); break;
+        case 2: fill_mask_2(img, mask, width, height, limit, tiles); break;
+        case 3: fill_mask_3(img, mask, width, height, limit, tiles); break;
+        default: fill_mask_4(img, mask, width, height, limit, tiles); break;
+        }
+    } else {
+        switch (channels) {
+        case 1: track_mask_1(img, mask, width, height, limit, tiles); break;
+        case 2: track_mask_2(img, mask, width, height, limit, tiles); break;
+        case 3: track_mask_3(img, mask, width, height, limit, tiles); break;
+        default: track_mask_4(img, mask, width, height, limit, tiles); break;
+        }
+    }
+    return 1;
+}
+
+void paint_background(unsigned char *img, const unsigned char *mask, int width, int height, int channels) {
+    // Turn background pixels WHITE using values from config.h
+    size_t count = (size_t)width * height;
+    int stream = count * channels >= PAINT_STREAM_BYTES;
+    switch (channels) {
+    case 1: paint_1(img, mask, count, stream); break;
+    case 2: paint_2(img, mask, count, stream); break;
+    case 3: paint_3(img, mask, count, stream); break;
+    default: paint_4(img, mask, count, stream); break;
+    }
+#ifdef __SSE2__
+    // Streamed stores are weakly ordered: finish them before anyone reads
+    if (stream) _mm_sfence();
+#endif
+}
+
+void cutout_background(const unsigned char *img, const unsigned char *mask, int width, int height, int channels,
+                       unsigned char *out) {
+    size_t count = (size_t)width * height;
+    switch (channels) {
+    case 1: cutout_1(img, mask, count, out); break;
+    case 2: cutout_2(img, mask, count, out); break;
+    case 3: cutout_3(img, mask, count, out); break;
+    default: cutout_4(img, mask, count, out); break;
+    }
+}
+
+// Updated: Function signature now matches the header
+void remove_background(unsigned char *img, int width, int height, int channels, double threshold) {
+    unsigned char *mask = background_mask(img, width, height, channels, threshold);
+    if (!mask) return;
+
+    paint_background(img, mask, width, height, channels);
+    arena_free(mask);
+}
+
+int cut_background(const unsigned char *img, int width, int height, int channels, double threshold,
+                   unsigned char *out) {
+    unsigned char *mask = background_mask(img, width, height, channels, threshold);
+    if (!mask) return 0;
+
+    cutout_background(img, mask, width, height, channels, out);
+    arena_free(mask);
+    return 1;
+}
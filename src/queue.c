@@ -1,14 +1,33 @@
 #include "../include/queue.h"
+#include "../include/arena.h"
 #include <stdlib.h>
 
+// Nodes are carved out of the arena this many at a time
+#define NODE_CHUNK 4096
+
 Queue* createQueue() {
-    Queue* q = (Queue*)malloc(sizeof(Queue));
+    Queue* q = (Queue*)arena_alloc(sizeof(Queue));
     q->front = q->rear = NULL;
+    q->free_list = NULL;
     return q;
 }
 
+static Node* allocNode(Queue* q) {
+    if (q->free_list == NULL) {
+        Node* chunk = (Node*)arena_alloc(NODE_CHUNK * sizeof(Node));
+        if (chunk == NULL) return NULL;
+        for (int i = 0; i < NODE_CHUNK - 1; i++) chunk[i].next = &chunk[i + 1];
+        chunk[NODE_CHUNK - 1].next = NULL;
+        q->free_list = chunk;
+    }
+    Node* n = q->free_list;
+    q->free_list = n->next;
+    return n;
+}
+
 void enqueue(Queue* q, int x, int y) {
-    Node* temp = (Node*)malloc(sizeof(Node));
+    Node* temp = allocNode(q);
+    if (temp == NULL) return;
     temp->p.x = x;
     temp->p.y = y;
     temp->next = NULL;
@@ -35,7 +54,8 @@ Point dequeue(Queue* q) {
         q->rear = NULL;
     }
 
-    free(temp);
+    temp->next = q->free_list;
+    q->free_list = temp;
     return p;
 }
 
@@ -43,15 +63,8 @@ int isQueueEmpty(Queue* q) {
     return (q->front == NULL);
 }
 
+// Node chunks live in the arena and go away with the next arena_reset()
 void freeQueue(Queue* q) {
     if (q == NULL) return;
-
-    Node* current = q->front;
-    while (current != NULL) {
-        Node* temp = current;
-        current = current->next;
-        free(temp);
-    }
-    
-    free(q);
+    arena_free(q);
 }
\ No newline at end of file
@@ -1,4 +1,14 @@
 // src/stb_lib.c
+#include "../include/arena.h"
+
+// All stb allocations come from the per-thread arena (see arena.h)
+#define STBI_MALLOC(sz)           arena_alloc(sz)
+#define STBI_REALLOC(p, newsz)    arena_realloc(p, newsz)
+#define STBI_FREE(p)              arena_free(p)
+#define STBIW_MALLOC(sz)          arena_alloc(sz)
+#define STBIW_REALLOC(p, newsz)   arena_realloc(p, newsz)
+#define STBIW_FREE(p)             arena_free(p)
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "../include/stb_image.h"
 
@@ -0,0 +1,143 @@
+#include "../include/transcode.h"
+#include "../include/process.h"
+#include "../include/arena.h"
+#include "../include/config.h"
+#include "../include/stb_image.h"
+#include "../include/stb_image_write.h"
+#include <string.h>
+
+// Quantized DC of a flat block at 'level' (0..255 for Y, centered for Cb/Cr).
+// A flat block's DC is 8x its centered sample value.
+static short flat_dc(float level, unsigned short q) {
+    float v = 8.0f * level / q;
+    short dc = (short)(v < 0 ? v - 0.5f : v + 0.5f);
+    // Round pure white up: anything past 255 clamps back to 255 in the decoder
+    if (level >= 127.0f && dc * q < 8 * 127) dc++;
+    return dc;
+}
+
+static void rgb_to_ycc(float r, float g, float b, float *y, float *cb, float *cr) {
+    *y  = +0.29900f * r + 0.58700f * g + 0.11400f * b - 128;
+    *cb = -0.16874f * r - 0.33126f * g + 0.50000f * b;
+    *cr = +0.50000f * r - 0.41869f * g - 0.08131f * b;
+}
+
+// Repaint one MCU from pixels (background -> target color) and re-quantize
+// every block of it with the file's own tables.
+static void reencode_mcu(stbi_jpeg_coefficients *jc, const unsigned char *img, const unsigned char *mask,
+                         int width, int height, int mx, int my) {
+    int mcu_w = 8 * jc->h_max, mcu_h = 8 * jc->v_max;
+    int x0 = mx * mcu_w, y0 = my * mcu_h;
+    float ycc[3][32 * 32]; // largest MCU is 4x4 blocks
+
+    for (int y = 0; y < mcu_h; y++) {
+        // Pixels past the edge repeat the last row/column
+        int sy = y0 + y < height ? y0 + y : height - 1;
+        for (int x = 0; x < mcu_w; x++) {
+            int sx = x0 + x < width ? x0 + x : width - 1;
+            size_t i = (size_t)sy * width + sx;
+            float r = TARGET_R, g = TARGET_G, b = TARGET_B;
+            if (!mask[i]) {
+                r = img[i * 3];
+                g = img[i * 3 + 1];
+                b = img[i * 3 + 2];
+            }
+            int o = y * mcu_w + x;
+            rgb_to_ycc(r, g, b, &ycc[0][o], &ycc[1][o], &ycc[2][o]);
+        }
+    }
+
+    for (int c = 0; c < jc->num_components; c++) {
+        stbi_jpeg_component *comp = &jc->comp[c];
+        int fx = jc->h_max / comp->h, fy = jc->v_max / comp->v;
+        float scale = 1.0f / (fx * fy);
+        for (int by = 0; by < comp->v; by++) {
+            for (int bx = 0; bx < comp->h; bx++) {
+                float samples[64];
+                // Subsampled components average fx*fy pixels per sample
+                for (int y = 0; y < 8; y++) {
+                    for (int x = 0; x < 8; x++) {
+                        int px = (bx * 8 + x) * fx, py = (by * 8 + y) * fy;
+                        float sum = 0;
+                        for (int j = 0; j < fy; j++)
+                            for (int k = 0; k < fx; k++)
+                                sum += ycc[c][(py + j) * mcu_w + px + k];
+                        samples[y * 8 + x] = sum * scale;
+                    }
+                }
+                short *block = comp->coeff + 64 * ((size_t)(my * comp->v + by) * comp->blocks_w + mx * comp->h + bx);
+                stbi_write_jpg_quantize_block(samples, comp->quant, block);
+            }
+        }
+    }
+}
+
+static void fill_mcu(stbi_jpeg_coefficients *jc, const float target[3], int mx, int my) {
+    for (int c = 0; c < jc->num_components; c++) {
+        stbi_jpeg_component *comp = &jc->comp[c];
+        short dc = flat_dc(target[c], comp->quant[0]);
+        for (int by = 0; by < comp->v; by++) {
+            for (int bx = 0; bx < comp->h; bx++) {
+                short *block = comp->coeff + 64 * ((size_t)(my * comp->v + by) * comp->blocks_w + mx * comp->h + bx);
+                memset(block, 0, 64 * sizeof(short));
+                block[0] = dc;
+            }
+        }
+    }
+}
+
+int transcode_jpeg(const unsigned char *file, int file_len, stbi_write_func *func, void *context, double threshold,
+                   TranscodeStats *stats) {
+    stbi_jpeg_coefficients jc;
+    int width, height, channels;
+    memset(stats, 0, sizeof(*stats));
+    // Always ask for RGB so the fill sees the same pixels as the normal path
+    unsigned char *img = stbi_load_jpeg_coefficients_from_memory(file, file_len, &width, &height, &channels, 3, &jc);
+    if (!img) return 0;
+
+    int ok = 0;
+    unsigned char *mask = background_mask(img, width, height, 3, threshold);
+    if (mask) {
+        float target[3];
+        rgb_to_ycc(TARGET_R, TARGET_G, TARGET_B, &target[0], &target[1], &target[2]);
+
+        int mcu_w = 8 * jc.h_max, mcu_h = 8 * jc.v_max;
+        int mcus_x = (width + mcu_w - 1) / mcu_w, mcus_y = (height + mcu_h - 1) / mcu_h;
+        for (int my = 0; my < mcus_y; my++) {
+            for (int mx = 0; mx < mcus_x; mx++) {
+                int x0 = mx * mcu_w, y0 = my * mcu_h;
+                int x1 = x0 + mcu_w < width ? x0 + mcu_w : width;
+                int y1 = y0 + mcu_h < height ? y0 + mcu_h : height;
+                int bg = 0;
+                for (int y = y0; y < y1; y++)
+                    for (int x = x0; x < x1; x++)
+                        bg += mask[(size_t)y * width + x];
+
+                if (bg == 0) {
+                    stats->kept++;
+                } else if (bg == (x1 - x0) * (y1 - y0)) {
+                    fill_mcu(&jc, target, mx, my);
+                    stats->filled++;
+                } else {
+                    reencode_mcu(&jc, img, mask, width, height, mx, my);
+                    stats->reencoded++;
+                }
+            }
+        }
+
+        stbi_write_jpg_component comps[3];
+        for (int c = 0; c < jc.num_components; c++) {
+            comps[c].h = jc.comp[c].h;
+            comps[c].v = jc.comp[c].v;
+            comps[c].blocks_w = jc.comp[c].blocks_w;
+            comps[c].coeff = jc.comp[c].coeff;
+            comps[c].quant = jc.comp[c].quant;
+        }
+        ok = stbi_write_jpg_coefficients_to_func(func, context, width, height, jc.num_components, comps);
+        arena_free(mask);
+    }
+
+    stbi_jpeg_coefficients_free(&jc);
+    stbi_image_free(img);
+    return ok;
+}
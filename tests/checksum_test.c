@@ -0,0 +1,95 @@
+// Checks the PNG writer's CRC-32 (PCLMULQDQ, slicing-by-8) and Adler-32
+// (SSE2) against plain byte-at-a-time loops, for every length up to 6000
+// at every start offset up to 16, on random bytes and on all-0xFF bytes
+// (the largest Adler sums). Build it three times to reach every path:
+//
+//   cc -std=c99 -O2 -Iinclude tests/checksum_test.c -lm -o checksum_test
+//   cc -std=c99 -O2 -Iinclude -DSTBIW_NO_PCLMUL tests/checksum_test.c -lm -o checksum_test_nopclmul
+//   cc -std=c99 -O2 -Iinclude -DSTBIW_NO_SIMD tests/checksum_test.c -lm -o checksum_test_nosimd
+//
+// Returns 0 when every checksum matches.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The checksums are static; take the implementation into this file
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../include/stb_image_write.h"
+
+#define MAX_LEN 6000
+#define MAX_OFFSET 16
+
+static unsigned int ref_table[256];
+
+static unsigned int ref_crc32(const unsigned char *data, int len) {
+    unsigned int crc = ~0u;
+    for (int i = 0; i < len; i++) crc = (crc >> 8) ^ ref_table[(crc ^ data[i]) & 0xff];
+    return ~crc;
+}
+
+static unsigned int ref_adler32(unsigned int adler, const unsigned char *data, int len) {
+    unsigned int s1 = adler & 0xffff, s2 = adler >> 16;
+    for (int i = 0; i < len; i++) {
+        s1 = (s1 + data[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+int main(void) {
+    for (unsigned int n = 0; n < 256; n++) {
+        unsigned int c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        ref_table[n] = c;
+    }
+
+    unsigned char *buf = (unsigned char *)malloc(MAX_LEN + MAX_OFFSET);
+    unsigned int state = 1;
+    int failed = 0;
+
+    for (int pattern = 0; pattern < 2; pattern++) {
+        for (int i = 0; i < MAX_LEN + MAX_OFFSET; i++) {
+            state = state * 1103515245u + 12345u;
+            buf[i] = pattern ? 0xFF : (unsigned char)(state >> 24);
+        }
+        for (int offset = 0; offset <= MAX_OFFSET; offset++) {
+            unsigned char *data = buf + offset;
+            for (int len = 0; len <= MAX_LEN; len++) {
+                // a fresh sum, or one already near the modulus
+                unsigned int start = len % 2 ? 1 : 65000u << 16 | 54321u;
+                unsigned int crc = stbiw__crc32(data, len), want_crc = ref_crc32(data, len);
+                unsigned int adler = stbiw__zlib_adler32(start, data, len);
+                unsigned int want_adler = ref_adler32(start, data, len);
+                if (crc != want_crc || adler != want_adler) {
+                    fprintf(stderr, "%s, offset %d, length %d: crc %08x (want %08x), adler %08x (want %08x)\n",
+                            pattern ? "0xFF" : "random", offset, len, crc, want_crc, adler, want_adler);
+                    failed = 1;
+                }
+            }
+        }
+    }
+
+    // The PNG band writer joins per-band Adler sums
+    for (int split = 0; split <= MAX_LEN; split += 37) {
+        unsigned int a = stbiw__zlib_adler32(1, buf, split);
+        unsigned int b = stbiw__zlib_adler32(1, buf + split, MAX_LEN - split);
+        if (stbiw__zlib_adler32_combine(a, b, MAX_LEN - split) != ref_adler32(1, buf, MAX_LEN)) {
+            fprintf(stderr, "adler32_combine wrong at split %d\n", split);
+            failed = 1;
+        }
+    }
+    free(buf);
+
+#if defined(STBIW_PCLMUL)
+    const char *crc_path = stbiw__pclmul_available() ? "PCLMULQDQ" : "slicing-by-8 (no PCLMULQDQ on this CPU)";
+#else
+    const char *crc_path = "slicing-by-8";
+#endif
+#ifdef STBIW_SSE2
+    const char *adler_path = "SSE2";
+#else
+    const char *adler_path = "scalar";
+#endif
+    if (!failed) printf("checksum: CRC-32 (%s) and Adler-32 (%s) match the byte loops\n", crc_path, adler_path);
+    return failed;
+}
@@ -0,0 +1,89 @@
+// Decodes JPEGs into caller buffers of exactly width * height * channels
+// bytes, so any store past the end shows up under AddressSanitizer:
+//
+//   cc -std=c99 -g -fsanitize=address
+//      -Iinclude tests/decode_into_test.c src/stb_lib.c src/arena.c
+//      -lm -lpthread -o decode_into_test
+//   ./decode_into_test [more.jpg ...]
+//
+// Returns 0 when every decode succeeds.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/stb_image.h"
+#include "../include/stb_image_write.h"
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+} Bytes;
+
+static void append(void *context, void *data, int size) {
+    Bytes *b = (Bytes *)context;
+    unsigned char *grown = (unsigned char *)realloc(b->data, b->size + size);
+    if (!grown) return;
+    memcpy(grown + b->size, data, (size_t)size);
+    b->data = grown;
+    b->size += size;
+}
+
+// Decodes 'file' into a buffer of exactly the image's size
+static int decode_exact(const unsigned char *file, int len, int channels, const char *what) {
+    int w, h, c;
+    if (!stbi_info_from_memory(file, len, &w, &h, &c)) {
+        fprintf(stderr, "%s: not an image\n", what);
+        return 0;
+    }
+    size_t size = (size_t)w * h * channels;
+    unsigned char *out = (unsigned char *)malloc(size);
+    int ok = out && stbi_load_from_memory_into(file, len, out, w * channels, size, &w, &h, NULL, channels);
+    if (!ok) fprintf(stderr, "%s: decode into %dx%dx%d failed\n", what, w, h, channels);
+    free(out);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    // Odd and even sizes, so the SIMD color kernels' scalar tails run too
+    static const int sizes[][2] = {{1, 1}, {7, 5}, {16, 16}, {33, 17}, {64, 48}, {101, 77}};
+    int failed = 0;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int w = sizes[s][0], h = sizes[s][1];
+        for (int comp = 1; comp <= 3; comp += 2) {
+            unsigned char *img = (unsigned char *)malloc((size_t)w * h * comp);
+            for (int i = 0; i < w * h * comp; i++) img[i] = (unsigned char)(i * 37 + s);
+            Bytes jpg = {NULL, 0};
+            for (int q = 50; q <= 100; q += 50) {
+                jpg.size = 0;
+                if (!stbi_write_jpg_to_func(append, &jpg, w, h, comp, img, q)) {
+                    fprintf(stderr, "encode %dx%dx%d failed\n", w, h, comp);
+                    failed = 1;
+                    continue;
+                }
+                for (int channels = 1; channels <= 4; channels++) {
+                    char what[64];
+                    sprintf(what, "%dx%dx%d q%d", w, h, comp, q);
+                    if (!decode_exact(jpg.data, (int)jpg.size, channels, what)) failed = 1;
+                }
+            }
+            free(jpg.data);
+            free(img);
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        Bytes file = {NULL, 0};
+        unsigned char chunk[1 << 16];
+        size_t got;
+        while (f && (got = fread(chunk, 1, sizeof(chunk), f)) > 0) append(&file, chunk, (int)got);
+        if (f) fclose(f);
+        for (int channels = 1; channels <= 4; channels++) {
+            if (!file.data || !decode_exact(file.data, (int)file.size, channels, argv[i])) failed = 1;
+        }
+        free(file.data);
+    }
+
+    if (!failed) printf("decode_into: all decodes fit their buffers\n");
+    return failed;
+}
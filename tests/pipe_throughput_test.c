@@ -0,0 +1,125 @@
+// Pipes 1,000 raw frames through one whitebg process and reads them back:
+// P5, P6 and P7 with 1-4 channels, each sent once with 8-bit samples and
+// once with the same values as 16-bit, which must come out identical.
+//
+//   cc -std=c99 -O2 -Iinclude src/*.c -lm -lpthread -o whitebg
+//   cc -std=c99 -O2 -Iinclude tests/pipe_throughput_test.c src/pnm.c src/imgbuf.c
+//      -o pipe_throughput_test
+//   ./pipe_throughput_test [./whitebg]
+//
+// Returns 0 when every frame comes back; prints frames per second.
+#define _POSIX_C_SOURCE 200809L
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/pnm.h"
+
+#define FRAMES 1000
+#define WIDTH 160
+#define HEIGHT 120
+
+// A noisy disc on a near-white background, different for every frame
+static void make_frame(unsigned char *img, int channels, int seed) {
+    unsigned state = (unsigned)seed * 2654435761u + 1;
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            int dx = x - WIDTH / 2 - seed % 17, dy = y - HEIGHT / 2;
+            int inside = dx * dx + dy * dy < 40 * 40;
+            for (int k = 0; k < channels; k++) {
+                state = state * 1103515245u + 12345u;
+                unsigned char noise = (unsigned char)(state >> 24);
+                *img++ = inside ? noise : (k == 3 || (channels == 2 && k == 1)) ? 255 : 248 + noise % 8;
+            }
+        }
+    }
+}
+
+static void write_frame(FILE *f, const unsigned char *img, int channels, int wide) {
+    int maxval = wide ? 65535 : 255;
+    if (channels == 1 || channels == 3) {
+        fprintf(f, "P%c\n%d %d\n%d\n", channels == 1 ? '5' : '6', WIDTH, HEIGHT, maxval);
+    } else {
+        fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nENDHDR\n", WIDTH, HEIGHT, channels, maxval);
+    }
+    size_t size = (size_t)WIDTH * HEIGHT * channels;
+    if (!wide) {
+        fwrite(img, 1, size, f);
+        return;
+    }
+    // v * 257 is v in 16 bits: the same value, so the same result
+    for (size_t i = 0; i < size; i++) {
+        putc(img[i], f);
+        putc(img[i], f);
+    }
+}
+
+static double seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    const char *whitebg = argc > 1 ? argv[1] : "./whitebg";
+    char out_name[] = "/tmp/pipe_throughput_XXXXXX";
+    int fd = mkstemp(out_name);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+
+    // whitebg quitting early should fail the test, not kill it
+    signal(SIGPIPE, SIG_IGN);
+    char command[1024];
+    snprintf(command, sizeof(command), "%s --pnm -o %s - 60 >/dev/null", whitebg, out_name);
+    unsigned char *img = (unsigned char *)malloc((size_t)WIDTH * HEIGHT * 4);
+    double start = seconds();
+    FILE *pipe = popen(command, "w");
+    if (!pipe || !img) {
+        fprintf(stderr, "cannot run %s\n", whitebg);
+        return 1;
+    }
+    for (int i = 0; i < FRAMES; i += 2) {
+        int channels = 1 + i / 2 % 4;
+        make_frame(img, channels, i);
+        write_frame(pipe, img, channels, 0);
+        write_frame(pipe, img, channels, 1);
+    }
+    int status = pclose(pipe);
+    double elapsed = seconds() - start;
+
+    // Back out: FRAMES frames of the right shape, 16-bit ones equal to the
+    // 8-bit frame before them
+    FILE *f = fdopen(fd, "rb");
+    ImageBuffer buf = {0}, prev = {0};
+    int failed = status != 0, frames = 0, w, h, channels, r;
+    while (f && (r = pnm_read_frame(f, &buf, &w, &h, &channels)) > 0) {
+        size_t size = (size_t)w * h * channels;
+        if (w != WIDTH || h != HEIGHT || channels != 1 + frames / 2 % 4) {
+            fprintf(stderr, "frame %d: %dx%dx%d\n", frames, w, h, channels);
+            failed = 1;
+        } else if (frames % 2 == 0) {
+            if (!imgbuf_reserve(&prev, size)) return 1;
+            memcpy(prev.data, buf.data, size);
+        } else if (memcmp(prev.data, buf.data, size) != 0) {
+            fprintf(stderr, "frame %d: 16-bit result differs from 8-bit\n", frames);
+            failed = 1;
+        }
+        frames++;
+    }
+    if (!f || r < 0 || frames != FRAMES) {
+        fprintf(stderr, "%d of %d frames came back\n", frames, FRAMES);
+        failed = 1;
+    }
+
+    if (f) fclose(f);
+    remove(out_name);
+    imgbuf_free(&buf);
+    imgbuf_free(&prev);
+    free(img);
+    if (!failed) printf("pipe_throughput: %d frames of %dx%d in %.2f s, %.0f img/s\n", FRAMES, WIDTH, HEIGHT,
+                        elapsed, FRAMES / elapsed);
+    return failed;
+}